@@ -5,12 +5,11 @@
 // Globals
 // ---------------------------------------------------------------------
 
-CEqbcs *runInstance = NULL;
-const char *Title   = PROG_TITLE;
-const char *Version = PROG_VERSION;
+static const char * const Title   = PROG_TITLE;
+static const char * const Version = PROG_VERSION;
 
-int    EQBCS_TraceSockets=0;
-int    EQBCS_iDebugMode = 1;
+static const int EQBCS_TraceSockets=0;
+static const int EQBCS_iDebugMode = 1;
 
 // #define SOCKTRACE
 
@@ -22,6 +21,61 @@ const int CCharBufNode::CHUNKSIZE=      512;
 
 const int CClientNode::MAX_CHARNAMELEN= 50;
 const int CClientNode::PING_SECONDS=    50;
+// A RESUME session whose connection drops is held this long for the
+// client to come back with its token.
+const int CClientNode::RESUME_GRACE_SECS= 30;
+const int CClientNode::RESUME_TOKEN_LEN=  16;
+// Nothing read for this long after a PING and the client is dropped
+const int CClientNode::PONG_TIMEOUT_SECS= 30;
+const int CClientNode::TIMER_PING=        1;
+const int CClientNode::TIMER_PONG=        2;
+const int CClientNode::TIMER_GRACE=       3;
+const int CClientNode::TIMER_LOGIN=       4;
+const int CClientNode::TIMER_IDLE=        5;
+
+// 64 slots of 100ms, 6.4s and 409.6s: deadlines up to 7.2 hours out
+const int CTimerWheel::TICK_MSECS=        100;
+const int CTimerWheel::SLOT_BITS=         6;
+const int CTimerWheel::SLOTS=             64;
+const int CTimerWheel::LEVELS=            3;
+
+// -k file: a header, then SLOTS slots of SLOT_BYTES to start (256k),
+// doubled when all are taken
+const char * const CCheckpoint::MAGIC=         "EQBCSCK1";
+const int CCheckpoint::HEADER_BYTES=      64;
+const int CCheckpoint::SLOTS=             128;
+const int CCheckpoint::SLOT_BYTES=        2048;
+const int CCheckpoint::FIELD_COUNT=       4; // name, channels, NBSUB, NBFIELDS
+// Once this much is queued for a client, its NetBots packets are
+// conflated: only the latest packet from each sender is kept.
+const int CClientNode::NB_CONFLATE_BYTES= 16384;
+// NBDELTA clients get a full packet from each sender at least this often.
+const int CClientNode::NB_KEYFRAME_EVERY= 20;
+// BATCH without a window, and the longest window a client may ask for
+const int CClientNode::BATCH_MSECS=       10;
+const int CClientNode::BATCH_MSECS_MAX=   1000;
+
+// Output lanes, highest priority first.  Each drain round moves up to
+// LANE_WEIGHTS messages from each lane, until LANE_WIRE_BYTES are ready
+// for the socket; the rest waits in its lane.
+const int CClientNode::LANE_CONTROL=      0;
+const int CClientNode::LANE_DIRECT=       1;
+const int CClientNode::LANE_CHAT=         2;
+const int CClientNode::LANE_BULK=         3;
+const int CClientNode::LANE_COUNT=        4;
+const int CClientNode::LANE_WEIGHTS[]=    { 64, 16, 4, 1 };
+const int CClientNode::LANE_WIRE_BYTES=   4096;
+// Within a lane, senders take turns: each turn adds DRR_QUANTUM times
+// the sender's weight (-w name=weight, default 1) to what it may send.
+const int CClientNode::DRR_QUANTUM=       512;
+
+// Inbound token buckets, see -r
+const int CClientNode::RATE_BYTES=        0;
+const int CClientNode::RATE_MSGS=         1;
+const int CClientNode::RATE_CHAT=         2;
+const int CClientNode::RATE_NBMSG=        3;
+const int CClientNode::RATE_TELL=         4;
+const int CClientNode::RATE_CLASSES=      5;
 // CMD_BUFSIZE Must be longer than MAX_CHARNAMELEN - see code.
 // Also, must be large enough to handle NetBots msgs.
 const int CClientNode::CMD_BUFSIZE=     1024;
@@ -33,7 +87,27 @@ const unsigned char CClientNode::MSG_TYPE_TELL=     4;
 const unsigned char CClientNode::MSG_TYPE_CHANNELS= 5;
 const unsigned char CClientNode::MSG_TYPE_BCI=      6;
 
-unsigned int CClientNode::suiNextIDNum=   0;
+// Capabilities a client may ask for in its login, e.g. LOGIN=name:ROSTER;
+const unsigned int CClientNode::CAP_ROSTER=         0x0001;
+const unsigned int CClientNode::CAP_NBBATCH=        0x0002;
+const unsigned int CClientNode::CAP_NBID=           0x0004;
+const unsigned int CClientNode::CAP_NBDELTA=        0x0008;
+const unsigned int CClientNode::CAP_V2=             0x0010;
+const unsigned int CClientNode::CAP_DEFLATE=        0x0020;
+
+// v2 frames: [type][length hi][length lo][payload]
+const unsigned char CClientNode::FRAME_CONTROL=     1;
+const unsigned char CClientNode::FRAME_BROADCAST=   2;
+const unsigned char CClientNode::FRAME_NBPKT=       3;
+const unsigned char CClientNode::FRAME_TELL=        4;
+const unsigned char CClientNode::FRAME_CHANNEL=     5;
+const unsigned char CClientNode::FRAME_BCI=         6;
+const unsigned char CClientNode::FRAME_NBDELTA=     7;
+const unsigned char CClientNode::FRAME_BATCH=       8;
+const int CClientNode::FRAME_MAXLEN=                65535;
+
+const int CNBPacket::MAX_FIELDS=                    128;
+
 
 const int CSockio::OKAY=       0;
 const int CSockio::CLOSEERR=   -1;
@@ -43,9 +117,64 @@ const int CSockio::BADSOCK=    -4;
 const int CSockio::BADPARM=    -5;
 const int CSockio::NOSOCK=     -6;
 const int CSockio::NOCONN=     -7;
+const int CSockio::WOULDBLOCK= -8;
 
 const int CEqbcs::MAX_CLIENTS  = 50;
+// Backlog of 1 - Keep it light
+const int CEqbcs::LISTEN_BACKLOG = 1;
 const int CEqbcs::DEFAULT_PORT = 2112;
+// Joins and quits are collected for this long, then sent as one batch.
+const int CEqbcs::NOTIFY_BATCH_MSECS = 200;
+// Longest select() wait when no timer is armed
+const int CEqbcs::IDLE_WAKE_MSECS = 60000;
+
+// What a client over its -r limits gets
+const int CEqbcs::RATE_DELAY      = 0;
+const int CEqbcs::RATE_DROP       = 1;
+const int CEqbcs::RATE_DISCONNECT = 2;
+
+// Graded shedding when the loop falls behind, see -o.  Each level is
+// entered at twice the lag or queue of the one before it.
+const int CEqbcs::OVERLOAD_NONE      = 0;
+const int CEqbcs::OVERLOAD_CONFLATE  = 1; // every NetBots packet conflated
+const int CEqbcs::OVERLOAD_DROP_NB   = 2; // conflated NetBots held back
+const int CEqbcs::OVERLOAD_HOLD_CHAT = 3; // chat lane held back as well
+// A step is kept at least this long, and rechecked this often while on
+const int CEqbcs::OVERLOAD_STEP_MSECS = 1000;
+
+// Longest a hot upgrade waits on the new process before giving up on it
+const int CEqbcs::UPGRADE_WAIT_MSECS = 10000;
+
+// Changed clients are written to the -k file at most this often, and a
+// pass taking longer than CHECKPOINT_WARN_USECS is logged.
+const int CEqbcs::CHECKPOINT_MSECS      = 1000;
+const int CEqbcs::CHECKPOINT_WARN_USECS = 1000;
+
+// Most a client is read for at a time, and the size of the pooled
+// block it is read into.
+const int CEqbcs::INPUT_BLOCK_BYTES = 4096;
+
+// Reactor events.  Handler frames come from pool blocks of
+// FRAME_BLOCK_BYTES, or from the heap if one doesn't fit.
+const int CReactor::EV_READ=              1;
+const int CReactor::EV_WRITE=             2;
+const int CReactor::EV_OUT=               4;
+const int CReactor::EV_WAKE=              8;
+const int CReactor::FRAME_BLOCK_BYTES=    1024;
+const int CReactor::FRAME_HEADER_BYTES=   16;
+const int CIoAwait::OP_WAIT=              0;
+const int CIoAwait::OP_RECV=              1;
+const int CIoAwait::OP_SEND=              2;
+
+#ifndef UNIXWIN
+// What a writer thread holds per connection; the rest waits in the
+// client's lanes, where conflation still sees it
+const int CSendRing::BYTES = 32768;
+// What a reader thread holds per connection.  At most half an input
+// block, so on an upgrade what it held and what the loop had taken fit
+// one block together.
+const int CRecvRing::BYTES = 2048;
+#endif
 
 // ---------------------------------------------------------------------
 // Debug
@@ -99,6 +228,35 @@ int CTrace::dbg(const char *fmt,...)
   return (0);
 }
 
+// ---------------------------------------------------------------------
+// Clock - monotonic milliseconds, only differences are meaningful
+// ---------------------------------------------------------------------
+
+unsigned long CClock::msecs()
+{
+#ifdef UNIXWIN
+  return (unsigned long)GetTickCount();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec*1000UL + (unsigned long)(ts.tv_nsec/1000000);
+#endif
+}
+
+// Microseconds, for timing short stretches of work
+unsigned long CClock::usecs()
+{
+#ifdef UNIXWIN
+  return (unsigned long)GetTickCount()*1000UL;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec*1000000UL + (unsigned long)(ts.tv_nsec/1000);
+#endif
+}
+
 // ---------------------------------------------------------------------
 // Network Read/Write functions
 // ---------------------------------------------------------------------
@@ -229,6 +387,38 @@ void CSockio::vShutdownSockets(void){}
 int CSockio::iStartupSockets(int iVerbose){return 0;}
 #endif
 
+// ---------------------------------------------------------------------
+int CSockio::iWouldBlock(void)
+{
+  // True if the last socket call failed only because it would block
+#ifdef UNIXWIN
+  return (WSAGetLastError() == WSAEWOULDBLOCK) ? 1 : 0;
+#else
+  return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : 0;
+#endif
+}
+
+// ---------------------------------------------------------------------
+int CSockio::iSetNonBlocking(int iSocketHandle)
+{
+  // Client sockets are non-blocking so one slow reader cannot stall the
+  // server.  Returns CSockio::OKAY or CSockio::BADSOCK
+#ifdef UNIXWIN
+  u_long ulOn = 1;
+
+  if (ioctlsocket(iSocketHandle, FIONBIO, &ulOn) != 0) {
+    return (CSockio::BADSOCK);
+  }
+#else
+  int iFlags = fcntl(iSocketHandle, F_GETFL, 0);
+
+  if (iFlags < 0 || fcntl(iSocketHandle, F_SETFL, iFlags | O_NONBLOCK) < 0) {
+    return (CSockio::BADSOCK);
+  }
+#endif
+  return (CSockio::OKAY);
+}
+
 // ---------------------------------------------------------------------
 int CSockio::iReadSock(int iSocketHandle, void *pBuffer, int iSize, int *piBytesRead)
 {
@@ -280,6 +470,15 @@ int CSockio::iReadSock(int iSocketHandle, void *pBuffer, int iSize, int *piBytes
 
   while ( iSizeLeft > 0 && iNbrRead > 0) {
     iNbrRead = recv(iSocketHandle, &pBuf[iTotalRead], iSizeLeft, 0);
+    if (iNbrRead < 0) {
+      if (iWouldBlock()) {
+        if (piBytesRead) {
+          *piBytesRead = iTotalRead;
+        }
+        return (CSockio::WOULDBLOCK);
+      }
+      break;
+    }
     iTotalRead += iNbrRead;
     iSizeLeft  -= iNbrRead;
   }
@@ -306,7 +505,8 @@ int CSockio::iWriteSock(int iSocketHandle, void *pBuffer, int iSize, int *piByte
   // Writes to socket until all bytes have been written Passes back number
   // of bytes written in *piBytesWritten Returns CSockio::OKAY, or
   // CSockio::READERR if error On error, socket should be closed by calling
-  // functions
+  // functions.  A non-blocking socket that fills up returns
+  // CSockio::WOULDBLOCK with the bytes written so far.
 
   int             iNbrWritten = 1;
   int             iSizeLeft;
@@ -362,7 +562,21 @@ int CSockio::iWriteSock(int iSocketHandle, void *pBuffer, int iSize, int *piByte
 #endif
 
   while ( iSizeLeft > 0 && iNbrWritten > 0) {
+#ifdef MSG_NOSIGNAL
+    // No SIGPIPE for a process embedding us
+    iNbrWritten = send(iSocketHandle, &pBuf[iTotalWritten], iSizeLeft, MSG_NOSIGNAL);
+#else
     iNbrWritten = send(iSocketHandle, &pBuf[iTotalWritten], iSizeLeft, 0);
+#endif
+    if (iNbrWritten < 0) {
+      if (iWouldBlock()) {
+        if (piBytesWritten) {
+          *piBytesWritten = iTotalWritten;
+        }
+        return (CSockio::WOULDBLOCK);
+      }
+      break;
+    }
     iTotalWritten += iNbrWritten;
     iSizeLeft  -= iNbrWritten;
   }
@@ -521,6 +735,21 @@ int CCharBufNode::allRead()
   return (nextReadPos == nextWritePos) ? 1 : 0;
 }
 
+int CCharBufNode::unread()
+{
+  return nextWritePos - nextReadPos;
+}
+
+const char *CCharBufNode::readPtr()
+{
+  return &buffer[nextReadPos];
+}
+
+void CCharBufNode::advance(int n)
+{
+  nextReadPos = (n < unread()) ? nextReadPos + n : nextWritePos;
+}
+
 int CCharBufNode::isFull()
 {
   return (nextWritePos < CCharBufNode::CHUNKSIZE) ? 0 : 1;
@@ -555,7 +784,9 @@ CCharBuf::CCharBuf(void)
 {
   // Create empty charbuf
   head = NULL;
+  tail = NULL;
   nextReadPos=0;
+  iWaiting=0;
 }
 
 CCharBuf::~CCharBuf()
@@ -568,7 +799,6 @@ CCharBuf::~CCharBuf()
 void CCharBuf::IncreaseBuf()
 {
   CCharBufNode *cbn;
-  CCharBufNode *cbn_temp;
 
   cbn = new CCharBufNode;
 
@@ -576,12 +806,9 @@ void CCharBuf::IncreaseBuf()
     head = cbn;
   }
   else {
-    cbn_temp = head;
-    while (cbn_temp->getNext() != NULL) {
-      cbn_temp = cbn_temp->getNext();
-    }
-    cbn_temp->setNext(cbn);
+    tail->setNext(cbn);
   }
+  tail = cbn;
 }
 
 CCharBufNode *CCharBuf::DequeueHead()
@@ -592,6 +819,7 @@ CCharBufNode *CCharBuf::DequeueHead()
   cbn = head->getNext();
   delete head;
   head = cbn;
+  if (head == NULL) tail = NULL;
 
   return cbn;
 }
@@ -602,25 +830,19 @@ int CCharBuf::hasWaiting()
   return (head && head->allRead() == 0) ? 1 : 0;
 }
 
-void CCharBuf::writeChar(char ch)
+int CCharBuf::waiting()
 {
-  CCharBufNode *cbn;
-
-  if (head == NULL) {
-    IncreaseBuf();
-  }
-
-  cbn = head;
-  while (cbn->getNext()) {
-    cbn = cbn->getNext();
-  }
+  return iWaiting;
+}
 
-  if (cbn->isFull()) {
+void CCharBuf::writeChar(char ch)
+{
+  if (head == NULL || tail->isFull()) {
     IncreaseBuf();
-    cbn = cbn->getNext();
   }
 
-  cbn->writech(ch);
+  tail->writech(ch);
+  iWaiting++;
 }
 
 void CCharBuf::writesz(const char *szStr)
@@ -633,12 +855,34 @@ void CCharBuf::writesz(const char *szStr)
   }
 }
 
+void CCharBuf::write(const char *pData, int iLen)
+{
+  while (iLen-- > 0) {
+    writeChar(*pData++);
+  }
+}
+
+int CCharBuf::lineLength()
+{
+  // Bytes up to and including the first '\n', or all that is waiting
+  int iLen = 0;
+  const char *pEnd;
+
+  for (CCharBufNode *cbn = head; cbn != NULL; cbn = cbn->getNext()) {
+    pEnd = (const char *)memchr(cbn->readPtr(), '\n', cbn->unread());
+    if (pEnd) return iLen + (int)(pEnd - cbn->readPtr()) + 1;
+    iLen += cbn->unread();
+  }
+  return iLen;
+}
+
 char CCharBuf::readChar()
 {
   char ch = 0;
 
   if (head && head->allRead() == 0) {
     ch = head->readch();
+    iWaiting--;
     if (head->allRead()) {
       if (head->getNext()) {
         head = DequeueHead();
@@ -652,1156 +896,6861 @@ char CCharBuf::readChar()
   return ch;
 }
 
-// ---------------------------------------------------------------------
-// ClientNode Stuff
-// ---------------------------------------------------------------------
-CClientNode::CClientNode(const char *szCharName, int iSocketHandle, CClientNode *newNext)
+int CCharBuf::peek(char *pBuffer, int iMax)
 {
-  bAuthorized = 0;
-  bCmdMode = 0;
-  bLocalEcho = 1;
-  lastWriteError = 0;
-  lastReadError = 0;
-  closeMe = 0;
-  readyToSend = 0;
-  this->szCharName = new char[MAX_CHARNAMELEN];
-  cmdBuf = new char[CMD_BUFSIZE];
-  memset(cmdBuf, 0, CMD_BUFSIZE);
-  cmdBufUsed=0;
-  this->chanList=NULL;
-  lastPingReponseTimeSecs = 0;
-  lastPingSecs = time(NULL); // pretend we have already pinged.
-
-  bTempWriteBlock = false;
-
-  if (suiNextIDNum == 0) {
-    suiNextIDNum = rand(); // rand sucks.
+  // Copy up to iMax waiting bytes without consuming them
+  int iCopied = 0;
+  int iChunk;
+
+  for (CCharBufNode *cbn = head; cbn != NULL && iCopied < iMax; cbn = cbn->getNext()) {
+    iChunk = cbn->unread();
+    if (iChunk > iMax - iCopied) iChunk = iMax - iCopied;
+    memcpy(&pBuffer[iCopied], cbn->readPtr(), iChunk);
+    iCopied += iChunk;
   }
-  suiNextIDNum++;
-  this->uiIDNum = suiNextIDNum;
-
-  strncpy(this->szCharName, szCharName, MAX_CHARNAMELEN-1);
 
-  next = newNext;
-  this->iSocketHandle = iSocketHandle;
-  inBuf = new CCharBuf();
-  outBuf = new CCharBuf();
-  lastChar = '\n'; // force name on next
+  return iCopied;
 }
 
-CClientNode::~CClientNode()
+void CCharBuf::skip(int n)
 {
-  if (this->chanList) delete this->chanList;
-  if (inBuf) delete inBuf;
-  inBuf = NULL;
-  if (outBuf) delete outBuf;
-  outBuf = NULL;
+  // Consume n bytes, normally the ones a partial write got out
+  int iChunk;
+
+  while (n > 0 && head && head->allRead() == 0) {
+    iChunk = (n < head->unread()) ? n : head->unread();
+    head->advance(iChunk);
+    iWaiting -= iChunk;
+    n -= iChunk;
+    if (head->allRead()) {
+      if (head->getNext()) {
+        head = DequeueHead();
+      }
+      else {
+        head->reset();
+      }
+    }
+  }
 }
 
 // ---------------------------------------------------------------------
-// Eqbcs Stuff
+// StrBuf Stuff - growable string, for messages built once and sent to many
 // ---------------------------------------------------------------------
-CEqbcs::CEqbcs()
+CStrBuf::CStrBuf()
 {
-  amRunning = 0;
-  clientList = NULL;
-  listenBuf = NULL;
-  iServerHandle = -1;
-  iExitNow = 0;
-  iSigHupCaught = 0;
-  iPort = DEFAULT_PORT;
-  iAddr=INADDR_ANY;
-  bNetBotChanges = false;
-  listenBufOn = true;
-  LogFile=stdout;
+  buffer = NULL;
+  used = 0;
+  allocated = 0;
+  Grow(64);
 }
 
-CEqbcs::~CEqbcs()
+CStrBuf::~CStrBuf()
 {
-  CClientNode *cn;
-
-  for (cn = clientList; cn != NULL; cn = cn->next) {
-    cn->closeMe = 1;
-  }
-  CloseAllSockets();
-  CSockio::vShutdownSockets();
-  CClientNode *cn_next=NULL;
-  for (cn = clientList; cn != NULL; cn = cn_next) {
-    cn_next = cn->next;
-    delete cn;
-  }
+  if (buffer) delete [] buffer;
 }
 
-// ---------------------------------------------------------------------
-// Initiliaze Networking and Bind To Port
-// ---------------------------------------------------------------------
-int CEqbcs::NET_initServer(int iPort, struct sockaddr_in *sockAddress)
+void CStrBuf::Grow(int needed)
 {
-  // return handle to server, or -1 on error
-  int socketOpt = 1;
-  int iHandle = 1;
+  char *newBuffer;
+  int newSize = (allocated > 0) ? allocated : 64;
 
-  if (CSockio::iStartupSockets(EQBCS_TraceSockets) != 0) {
-    perror("Failed to create winsock");
-  }
-
-  if ((iHandle = (int)socket(AF_INET,SOCK_STREAM,0))==0) {
-    // if socket failed then display error and exit
-    perror("Create master_socket");
-    return -1;
-  }
+  if (needed < allocated) return;
+  while (newSize <= needed) newSize *= 2;
 
-  // multi connections
-  if (setsockopt(iHandle, SOL_SOCKET, SO_REUSEADDR,
-    (char *)&socketOpt, sizeof(socketOpt))<0)
-    {
-    CSockio::iCloseSock(iServerHandle, 1, 1, EQBCS_TraceSockets);
-    perror("setsockopt");
-    return -1;
+  newBuffer = new char[newSize];
+  if (buffer) {
+    memcpy(newBuffer, buffer, used);
+    delete [] buffer;
   }
+  newBuffer[used] = 0;
+  buffer = newBuffer;
+  allocated = newSize;
+}
 
-  sockAddress->sin_family = AF_INET;
-  sockAddress->sin_addr.s_addr = iAddr;
-  sockAddress->sin_port = htons((unsigned short)iPort);
+void CStrBuf::clear()
+{
+  used = 0;
+  buffer[0] = 0;
+}
 
-  if (bind(iHandle, (struct sockaddr *)sockAddress,
-    sizeof(struct sockaddr_in))<0)
-    {
-    // if bind failed then display error message and exit
-     perror("bind");
-  }
+int CStrBuf::length()
+{
+  return used;
+}
 
-  // backlog of 1 - Keep it light
-  if (listen(iHandle, 1)<0) {
-    perror("listen");
-  }
+const char *CStrBuf::getsz()
+{
+  return buffer;
+}
 
-  return iHandle;
+void CStrBuf::appendChar(char ch)
+{
+  Grow(used+1);
+  buffer[used++] = ch;
+  buffer[used] = 0;
 }
 
-// ---------------------------------------------------------------------
-// Count the clients (Active and Inactive)
-// ---------------------------------------------------------------------
-int CEqbcs::countClients(void)
+void CStrBuf::appendsz(const char *szStr)
 {
-  int count = 0;
+  int len;
 
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-    count++;
+  if (szStr) {
+    len = (int)strlen(szStr);
+    Grow(used+len);
+    memcpy(&buffer[used], szStr, len+1);
+    used += len;
   }
+}
 
-  return count;
+void CStrBuf::append(const char *pData, int iLen)
+{
+  Grow(used+iLen);
+  memcpy(&buffer[used], pData, iLen);
+  used += iLen;
+  buffer[used] = 0;
 }
 
 // ---------------------------------------------------------------------
-// Get max file descriptor (for select in win32)
+// NetBots packet fields
 // ---------------------------------------------------------------------
-int CEqbcs::getMaxFD()
+CNBPacket::CNBPacket()
 {
-  int max = iServerHandle;
-
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-    if (cn->closeMe == 0) {
-      max = (cn->iSocketHandle > max) ? cn->iSocketHandle : max;
-    }
-  }
-
-  return (max < 0) ? 1 : max+1;
+  fieldStart = new const char*[MAX_FIELDS];
+  fieldLen = new int[MAX_FIELDS];
+  keyLen = new int[MAX_FIELDS];
+  iFields = 0;
+  bOverflow = false;
 }
 
+CNBPacket::~CNBPacket()
+{
+  delete [] fieldStart;
+  delete [] fieldLen;
+  delete [] keyLen;
+}
 
-// ---------------------------------------------------------------------
-// Write Local Char - one char to local buffer
-// ---------------------------------------------------------------------
-
-void CEqbcs::WriteLocalChar(char ch)
+void CNBPacket::parse(const char *szBody)
 {
-  if (listenBuf && listenBufOn) {
-    listenBuf->writeChar(ch);
+  const char *p = szBody;
+
+  iFields = 0;
+  bOverflow = false;
+  while (iFields < MAX_FIELDS) {
+    fieldStart[iFields] = p;
+    keyLen[iFields] = -1;
+    while (*p && *p != '|' && *p != '\n') {
+      if (*p == '=' && keyLen[iFields] < 0) keyLen[iFields] = (int)(p - fieldStart[iFields]);
+      p++;
+    }
+    fieldLen[iFields] = (int)(p - fieldStart[iFields]);
+    iFields++;
+    if (*p != '|') return;
+    p++;
   }
+  bOverflow = true;
 }
 
-// ---------------------------------------------------------------------
-// Send String to local only
-// ---------------------------------------------------------------------
-
-void CEqbcs::WriteLocalString(const char *szStr)
+CNBFieldMask::CNBFieldMask(const char *szKeys, CNBFieldMask *newNext)
 {
-  while (*szStr) {
-    WriteLocalChar(*szStr);
-    szStr++;
-  }
+  this->szKeys = new char[strlen(szKeys)+1];
+  strcpy(this->szKeys, szKeys);
+  iRefs = 0;
+  uiCachedSerial = 0;
+  filtered = new CStrBuf();
+  filteredParsed = new CNBPacket();
+  next = newNext;
 }
 
-// ---------------------------------------------------------------------
-// Send char to all clients
-// ---------------------------------------------------------------------
+CNBFieldMask::~CNBFieldMask()
+{
+  delete [] szKeys;
+  delete filtered;
+  delete filteredParsed;
+}
 
-void CEqbcs::AppendCharToAll(char ch)
+bool CNBFieldMask::hasKey(const char *pKey, int iKeyLen)
 {
-  if (listenBuf && listenBufOn) listenBuf->writeChar(ch);
+  const char *p = szKeys;
 
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-    if (cn->bAuthorized && cn->closeMe==0 && cn->iSocketHandle>=0
-      && cn->bTempWriteBlock==false)
-      {
-      cn->outBuf->writeChar(ch);
+  while (*p) {
+    if (strncmp(p, pKey, iKeyLen) == 0 && (p[iKeyLen] == ',' || p[iKeyLen] == 0)) {
+      return true;
     }
+    while (*p && *p != ',') p++;
+    if (*p == ',') p++;
   }
+  return false;
 }
 
-// ---------------------------------------------------------------------
-// Write To All
-// ---------------------------------------------------------------------
-void CEqbcs::SendToAll(const char *szStr)
+void CNBFieldMask::filter(CNBPacket *pPacket)
 {
-  if (szStr) {
-    while (*szStr) {
-      AppendCharToAll(*szStr);
-      szStr++;
+  // Keep the wanted key=value fields and any field without a key
+  int i;
+  bool bFirst = true;
+
+  filtered->clear();
+  for (i=0; i < pPacket->iFields; i++) {
+    if (pPacket->keyLen[i] < 0 || hasKey(pPacket->fieldStart[i], pPacket->keyLen[i])) {
+      if (!bFirst) filtered->appendChar('|');
+      bFirst = false;
+      filtered->append(pPacket->fieldStart[i], pPacket->fieldLen[i]);
     }
   }
+  filtered->appendChar('\n');
+  filteredParsed->parse(filtered->getsz());
 }
 
-// ---------------------------------------------------------------------
-// Write sender name to each
-// ---------------------------------------------------------------------
-void CEqbcs::SendMyNameToAll(CClientNode *cn, int iMsgType)
+CNBSentState::CNBSentState(unsigned uiSenderID, CNBSentState *newNext)
 {
-  if (iMsgType == CClientNode::MSG_TYPE_NBMSG) {
-    SendToAll("\tNBPKT:");
-    SendToAll(cn->szCharName);
-    SendToAll(":");
-  }
-  else {
-    AppendCharToAll('<');
-    SendToAll(cn->szCharName);
-    AppendCharToAll('>');
-    AppendCharToAll(' ');
-  }
+  this->uiSenderID = uiSenderID;
+  iSinceKey = 0;
+  last = new CStrBuf();
+  parsed = new CNBPacket();
+  next = newNext;
 }
 
-// ---------------------------------------------------------------------
-// Write sender name to specific client
-// ---------------------------------------------------------------------
-void CEqbcs::SendMyNameToOne(CClientNode *cn, CClientNode *cn_to, int iMsgType)
+CNBSentState::~CNBSentState()
 {
-  // iMsgType not used currently.  Included in definition in case it's
-  // needed later
-  if (cn_to->bAuthorized && cn_to->closeMe == 0 &&
-    cn_to->iSocketHandle >= 0 && cn->bTempWriteBlock == false)
-  {
-     if(iMsgType == CClientNode::MSG_TYPE_BCI)
-     {
-        cn_to->outBuf->writeChar('{');
-        cn_to->outBuf->writesz(cn->szCharName);
-        cn_to->outBuf->writeChar('}');
-        cn_to->outBuf->writeChar(' ');
-        return;
-     }
-     cn_to->outBuf->writeChar('[');
-     cn_to->outBuf->writesz(cn->szCharName);
-     cn_to->outBuf->writeChar(']');
-     cn_to->outBuf->writeChar(' ');
-
-     WriteLocalChar('[');
-     WriteLocalString(cn->szCharName);
-     WriteLocalString("] to [");
-     WriteLocalString(cn_to->szCharName);
-     WriteLocalString("]: ");
-  }
+  delete last;
+  delete parsed;
 }
 
 // ---------------------------------------------------------------------
-// Write Own Name to Each
+// Token bucket
 // ---------------------------------------------------------------------
-void CEqbcs::WriteOwnNames(void)
+CTokenBucket::CTokenBucket()
 {
-  // Called only when msgall mode is on.
-  WriteLocalString(" [*ALL*] ");
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-    if (cn->bAuthorized && cn->closeMe == 0 &&
-      cn->iSocketHandle >= 0 && cn->bTempWriteBlock == false)
-      {
-      cn->outBuf->writeChar(' ');
-      cn->outBuf->writesz(cn->szCharName);
-      cn->outBuf->writeChar(' ');
-    }
-  }
+  iRate = 0;
+  lTokens = 0;
+  ulLast = 0;
+}
+
+void CTokenBucket::setRate(int iRate)
+{
+  this->iRate = iRate;
+  lTokens = (long)iRate * 1000;
+  ulLast = CClock::msecs();
+}
+
+void CTokenBucket::refill(unsigned long ulNow)
+{
+  if (iRate == 0) return;
+  lTokens += (long)(ulNow - ulLast) * iRate;
+  if (lTokens > (long)iRate * 1000) lTokens = (long)iRate * 1000;
+  ulLast = ulNow;
+}
+
+bool CTokenBucket::canTake(int n)
+{
+  return iRate == 0 || lTokens >= (long)n * 1000;
+}
+
+void CTokenBucket::take(int n)
+{
+  if (iRate) lTokens -= (long)n * 1000;
+}
+
+int CTokenBucket::msecsUntilClear()
+{
+  // Until the debt is paid off, 0 if there is none
+  if (iRate == 0 || lTokens >= 0) return 0;
+  return (int)((-lTokens + iRate - 1) / iRate);
 }
 
 // ---------------------------------------------------------------------
-// Send Net Bot Send List to this client
+// Partly written messages
 // ---------------------------------------------------------------------
-void CEqbcs::SendNetBotSendList(CClientNode *cnSend)
+CSentUnit::CSentUnit()
 {
-  cnSend->outBuf->writesz("\tNBCLIENTLIST=");
-  int iCount = 0;
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-    if (cn->bAuthorized && cn->closeMe == 0 &&
-      cn->iSocketHandle >= 0 && cn->bTempWriteBlock == false)
-      {
-      if (iCount++) cnSend->outBuf->writeChar(' ');
-      cnSend->outBuf->writesz(cn->szCharName);
-    }
-  }
-  cnSend->outBuf->writesz("\n");
+  bFrames = false;
+  bBatch = false;
+  sent = new CStrBuf();
+  clear();
+}
+
+CSentUnit::~CSentUnit()
+{
+  delete sent;
+}
+
+void CSentUnit::clear()
+{
+  sent->clear();
+  iHdrUsed = 0;
+  iLeft = 0;
 }
 
 // ---------------------------------------------------------------------
-// Notify Net Bot Changes, if any
+// pData was just written.  Whatever it finished is forgotten, what is
+// left of it starts or adds to the message still going out.
 // ---------------------------------------------------------------------
-void CEqbcs::NotifyNetBotChanges(void)
+void CSentUnit::note(const char *pData, int iLen)
 {
-  if (bNetBotChanges) {
-    for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-      if (cn->bAuthorized && cn->closeMe == 0 &&
-        cn->iSocketHandle >= 0 && cn->bTempWriteBlock == false)
-        {
-        SendNetBotSendList(cn);
+  const char *p;
+  int iTake;
+  int i;
+
+  if (bFrames == false && bBatch == false) {
+    // Only what follows the last '\n' is a line in progress
+    for (i = iLen; i > 0 && pData[i-1] != '\n'; i--);
+    if (i > 0) sent->clear();
+    sent->append(&pData[i], iLen - i);
+    return;
+  }
+
+  while (iLen > 0) {
+    if (bFrames) {
+      if (iHdrUsed == 0 && bBatch == false && iLen >= 3) {
+        // A whole frame in what was written: nothing to keep
+        iTake = 3 + (((unsigned char)pData[1] << 8) | (unsigned char)pData[2]);
+        if (iTake <= iLen) {
+          pData += iTake;
+          iLen -= iTake;
+          continue;
+        }
+      }
+      if (iHdrUsed < 3) {
+        hdr[iHdrUsed++] = (unsigned char)*pData;
+        iTake = 1;
+        if (iHdrUsed == 3) iLeft = (hdr[1] << 8) | hdr[2];
+      }
+      else {
+        iTake = (iLen < iLeft) ? iLen : iLeft;
+        iLeft -= iTake;
+      }
+      sent->append(pData, iTake);
+      if (iHdrUsed == 3 && iLeft == 0) {
+        // A batch goes on until a frame short of FRAME_MAXLEN ends it
+        iHdrUsed = 0;
+        if (bBatch == false || ((hdr[1] << 8) | hdr[2]) < CClientNode::FRAME_MAXLEN) {
+          sent->clear();
+        }
       }
     }
-    bNetBotChanges = false;
+    else if (iLeft == 0) {
+      // v1 batch: its \tBATCH=<bytes> line
+      for (iTake = 0; iTake < iLen && pData[iTake] != '\n'; iTake++);
+      if (iTake < iLen) iTake++;
+      sent->append(pData, iTake);
+      if (pData[iTake-1] == '\n') {
+        p = strchr(sent->getsz(), '=');
+        if ((iLeft = p ? atoi(p+1) : 0) <= 0) clear();
+      }
+    }
+    else {
+      iTake = (iLen < iLeft) ? iLen : iLeft;
+      iLeft -= iTake;
+      sent->append(pData, iTake);
+      if (iLeft == 0) sent->clear();
+    }
+    pData += iTake;
+    iLen -= iTake;
   }
 }
 
 // ---------------------------------------------------------------------
-// Notify Net Bot Client Join
+// Timers
 // ---------------------------------------------------------------------
-void CEqbcs::NotifyClientJoin(char *szName)
+CTimer::CTimer(CClientNode *cn)
 {
-  if (szName != NULL && *szName !=0)
-  {
-    for (CClientNode *cn=clientList; cn != NULL; cn = cn->next)
-    {
-      if (cn->bAuthorized && cn->closeMe == 0 && cn->iSocketHandle >= 0 && cn->bTempWriteBlock == false)
-      {
-        cn->outBuf->writesz("\tNBJOIN=");
-        cn->outBuf->writesz(szName);
-        cn->outBuf->writesz("\n");
-      }
-    }
+  iKind = 0;
+  this->cn = cn;
+  ulTick = 0;
+  iSlot = 0;
+  wheel = NULL;
+  next = prev = NULL;
+}
+
+CTimer::~CTimer()
+{
+  cancel();
+}
+
+void CTimer::cancel()
+{
+  if (wheel) wheel->remove(this);
+}
+
+CTimerWheel::CTimerWheel()
+{
+  slots = new CTimer*[LEVELS*SLOTS];
+  for (int i=0; i < LEVELS*SLOTS; i++) slots[i] = NULL;
+  ulCurTick = 0;
+  ulTickMsecs = CClock::msecs();
+  iCount = 0;
+}
+
+CTimerWheel::~CTimerWheel()
+{
+  for (int i=0; i < LEVELS*SLOTS; i++) {
+    while (slots[i]) remove(slots[i]);
+  }
+  delete [] slots;
+}
+
+void CTimerWheel::place(CTimer *t)
+{
+  unsigned long ulDelta = t->ulTick - ulCurTick;
+  int iLevel = 0;
+
+  while (iLevel < LEVELS-1 && ulDelta >= (1UL << (SLOT_BITS*(iLevel+1)))) iLevel++;
+  if (ulDelta >= (1UL << (SLOT_BITS*LEVELS))) {
+    // Past the last level: fires at the edge, the owner re-arms it
+    t->ulTick = ulCurTick + (1UL << (SLOT_BITS*LEVELS)) - 1;
+  }
+  t->iSlot = iLevel*SLOTS + (int)((t->ulTick >> (SLOT_BITS*iLevel)) & (SLOTS-1));
+  t->prev = NULL;
+  t->next = slots[t->iSlot];
+  if (t->next) t->next->prev = t;
+  slots[t->iSlot] = t;
+}
+
+void CTimerWheel::unlink(CTimer *t)
+{
+  if (t->prev) t->prev->next = t->next;
+  else slots[t->iSlot] = t->next;
+  if (t->next) t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+}
+
+// Move the slot of iLevel that has come round down the levels
+void CTimerWheel::cascade(int iLevel)
+{
+  int iSlot = iLevel*SLOTS + (int)((ulCurTick >> (SLOT_BITS*iLevel)) & (SLOTS-1));
+  CTimer *t;
+
+  while ((t = slots[iSlot]) != NULL) {
+    unlink(t);
+    place(t);
   }
 }
 
+void CTimerWheel::add(CTimer *t, int iKind, int iMsecs)
+{
+  unsigned long ulNow = CClock::msecs();
+
+  remove(t);
+  if (iMsecs < 0) iMsecs = 0;
+  // Round up so a timer never fires early, and never into this tick
+  t->ulTick = ulCurTick + (ulNow - ulTickMsecs + iMsecs + TICK_MSECS - 1) / TICK_MSECS;
+  if (t->ulTick == ulCurTick) t->ulTick++;
+  t->iKind = iKind;
+  t->wheel = this;
+  place(t);
+  iCount++;
+}
+
+void CTimerWheel::remove(CTimer *t)
+{
+  if (t->wheel != this) return;
+  unlink(t);
+  t->wheel = NULL;
+  iCount--;
+}
+
 // ---------------------------------------------------------------------
-// Notify Net Bot Client Quit
+// The next timer due by ulNow, disarmed, or NULL once there are none
 // ---------------------------------------------------------------------
-void CEqbcs::NotifyClientQuit(char *szName)
+CTimer *CTimerWheel::expired(unsigned long ulNow)
 {
-  if (szName != NULL && *szName !=0)
-  {
-    for (CClientNode *cn=clientList; cn != NULL; cn = cn->next)
-    {
-      if (cn->bAuthorized && cn->closeMe == 0 && cn->iSocketHandle >= 0 && cn->bTempWriteBlock == false)
-      {
-        cn->outBuf->writesz("\tNBQUIT=");
-        cn->outBuf->writesz(szName);
-        cn->outBuf->writesz("\n");
-      }
+  CTimer *t;
+
+  for (;;) {
+    if ((t = slots[ulCurTick & (SLOTS-1)]) != NULL) {
+      remove(t);
+      return t;
+    }
+    if (ulNow - ulTickMsecs < (unsigned long)TICK_MSECS) return NULL;
+    ulTickMsecs += TICK_MSECS;
+    ulCurTick++;
+    for (int iLevel=LEVELS-1; iLevel > 0; iLevel--) {
+      if ((ulCurTick & ((1UL << (SLOT_BITS*iLevel)) - 1)) == 0) cascade(iLevel);
     }
   }
 }
 
 // ---------------------------------------------------------------------
-// Add new incoming client
+// Milliseconds until the next timer or cascade, -1 if nothing is armed
 // ---------------------------------------------------------------------
-void CEqbcs::HandleNewClient(struct sockaddr_in *sockAddress)
+int CTimerWheel::msecsLeft(unsigned long ulNow)
 {
-  // Open the new socket as 'new_socket'
-  char buf[256];
-  int iSocketHandle;
-  int iBytesWrote;
-  int addrlen=sizeof(*sockAddress);
-  const char *loginName = "--LOGIN--";
+  unsigned long ulTick = ulCurTick;
+  long lLeft;
 
-  iSocketHandle = (int)accept((unsigned)iServerHandle, (struct sockaddr *)sockAddress, (socklen_t *)&addrlen);
+  if (iCount == 0) return -1;
+  while (slots[ulTick & (SLOTS-1)] == NULL) {
+    ulTick++;
+    if ((ulTick & (SLOTS-1)) == 0) break;
+  }
+  lLeft = (long)((ulTick - ulCurTick) * TICK_MSECS) - (long)(ulNow - ulTickMsecs);
+  return lLeft < 0 ? 0 : (int)lLeft;
+}
 
-  if (iSocketHandle < 0) {
-    perror("Failed to connect new client - accept");
-    return;
+// ---------------------------------------------------------------------
+// Block pool
+// ---------------------------------------------------------------------
+CBlockPool::CBlockPool(int iBlockBytes)
+{
+  // Room for the free list link
+  if (iBlockBytes < (int)sizeof(char *)) iBlockBytes = sizeof(char *);
+  this->iBlockBytes = iBlockBytes;
+  uiMade = 0;
+  uiInUse = 0;
+  uiPeakInUse = 0;
+  pFree = NULL;
+}
+
+CBlockPool::~CBlockPool()
+{
+  char *pNext;
+
+  while (pFree) {
+    memcpy(&pNext, pFree, sizeof(pNext));
+    delete [] pFree;
+    pFree = pNext;
   }
+}
 
-  if (countClients() < MAX_CLIENTS) {
-    sprintf((char *)buf, "-- Client connection: fd %d\n", iSocketHandle);
-    WriteLocalString(buf);
+char *CBlockPool::alloc()
+{
+  char *pBlock = pFree;
 
-    clientList = new CClientNode(loginName, iSocketHandle, clientList);
+  if (pBlock) {
+    memcpy(&pFree, pBlock, sizeof(pFree));
   }
   else {
-    WriteLocalString("-- Incoming client rejected -- too many connections\n");
-    sprintf(buf, (char *)"Denied - too many connections");
-    CSockio::iWriteSock(iSocketHandle, buf, (int)strlen(buf), &iBytesWrote);
-    CSockio::iCloseSock(iSocketHandle, 1, 1, EQBCS_TraceSockets);
+    pBlock = new char[iBlockBytes];
+    uiMade++;
   }
+  if (++uiInUse > uiPeakInUse) uiPeakInUse = uiInUse;
+  return pBlock;
+}
+
+void CBlockPool::release(char *pBlock)
+{
+  memcpy(pBlock, &pFree, sizeof(pFree));
+  pFree = pBlock;
+  uiInUse--;
 }
 
+#ifndef UNIXWIN
 // ---------------------------------------------------------------------
-// Update channel list
+// Send rings
 // ---------------------------------------------------------------------
-void CEqbcs::HandleUpdateChannels(CClientNode *cn)
+CSendRing::CSendRing(int iSocket)
 {
-  char szTemp[2048]={0};
-  int i=0;
+  pData = new char[BYTES];
+  uiHead = 0;
+  uiTail = 0;
+  this->iSocket = iSocket;
+  iError = 0;
+  iWaiting = 0;
+  iClosing = 0;
+  iReleased = 0;
+  iQueued = 0;
+  bWantWrite = false;
+  sentUnit = NULL;
+  owner = NULL;
+  bMoved = false;
+  writer = NULL;
+  next = NULL;
+  nextAdded = NULL;
+  nextQueued = NULL;
+  nextRetired = NULL;
+}
+
+CSendRing::~CSendRing()
+{
+  // Our own handle: closing it leaves the connection up
+  if (iSocket != -1) close(iSocket);
+  delete [] pData;
+  if (sentUnit) delete sentUnit;
+}
 
-  if (cn->chanList!=NULL) delete cn->chanList;
-  while (cn->inBuf->hasWaiting()) szTemp[i++]=cn->inBuf->readChar();
-  szTemp[i]=0;
-  cn->chanList=new char[strlen(szTemp)+1];
-  strcpy(cn->chanList,szTemp);
-  sprintf(szTemp, "%s joined channels %s.\n", cn->szCharName, cn->chanList);
-  cn->outBuf->writesz(szTemp);
-  WriteLocalString(szTemp);
+int CSendRing::used()
+{
+  return (int)(uiHead - uiTail);
 }
 
 // ---------------------------------------------------------------------
-// Process Tells
+// Loop side: as much of pData as there is room for
 // ---------------------------------------------------------------------
-void CEqbcs::HandleTell(CClientNode *cn)
+int CSendRing::put(const char *pData, int iLen)
 {
-  char szName[CClientNode::MAX_CHARNAMELEN];
-  char szMsg[2048]={0};
-  char szTemp[2048];
-  char *token;
-  char ch;
-  int i=0;
-  CClientNode *cn_to=clientList;
+  unsigned uiAt = uiHead;
+  int iRoom = BYTES - (int)(uiAt - uiTail);
+  int iFirst;
+
+  // Room the writer gave back is only reused after it is done with it
+  __sync_synchronize();
+  if (iLen > iRoom) iLen = iRoom;
+  iFirst = BYTES - (int)(uiAt & (BYTES-1));
+  if (iFirst > iLen) iFirst = iLen;
+  memcpy(&this->pData[uiAt & (BYTES-1)], pData, iFirst);
+  memcpy(this->pData, &pData[iFirst], iLen - iFirst);
+  // The bytes are in before the writer can see them
+  __sync_synchronize();
+  uiHead = uiAt + iLen;
+  return iLen;
+}
 
-  ch=cn->inBuf->readChar();
-  while (ch!=' ' && ch!='\n' && ch!='\0' && i<CClientNode::MAX_CHARNAMELEN-1 && cn->inBuf->hasWaiting()) {
-    szName[i++]=ch;
-    ch=cn->inBuf->readChar();
-  }
-  szName[i]='\0';
+// ---------------------------------------------------------------------
+// Whatever was not sent, onto out.  Only once its writer has let go.
+// ---------------------------------------------------------------------
+void CSendRing::copyOut(CCharBuf *out)
+{
+  int iLen = used();
+  int iFirst = BYTES - (int)(uiTail & (BYTES-1));
 
-  i=0;
-  while (cn->inBuf->hasWaiting()) {
-    ch=cn->inBuf->readChar();
-    if (ch=='\\' && cn->inBuf->hasWaiting()) ch=cn->inBuf->readChar();
-    szMsg[i++]=ch;
-    }
-  szMsg[i++]='\n';
-  szMsg[i]='\0';
+  if (iFirst > iLen) iFirst = iLen;
+  out->write(&pData[uiTail & (BYTES-1)], iFirst);
+  out->write(pData, iLen - iFirst);
+  uiTail = uiHead;
+}
 
-  while (cn_to!=NULL && strcasecmp(cn_to->szCharName, szName)!=0)
-    cn_to=cn_to->next;
+// ---------------------------------------------------------------------
+// Receive rings
+// ---------------------------------------------------------------------
+CRecvRing::CRecvRing(int iSocket)
+{
+  pData = new char[BYTES];
+  uiHead = 0;
+  uiTail = 0;
+  uiRecvd = 0;
+  this->iSocket = iSocket;
+  bFrames = false;
+  iHdrUsed = 0;
+  iFrameLeft = 0;
+  iError = 0;
+  iFull = 0;
+  iClosing = 0;
+  iReleased = 0;
+  iQueued = 0;
+  owner = NULL;
+  reader = NULL;
+  next = NULL;
+  nextAdded = NULL;
+  nextQueued = NULL;
+  nextRetired = NULL;
+}
 
-  if (cn_to!=NULL) {
-    SendMyNameToOne(cn, cn_to, CClientNode::MSG_TYPE_TELL);
-    cn_to->outBuf->writesz(szMsg);
-    WriteLocalString(szMsg);
-    return;
-  } else {
-    i=0;
-    for (cn_to=clientList; cn_to!=NULL; cn_to=cn_to->next) {
-      if((cn->bLocalEcho || cn_to!=cn) && cn_to->chanList!=NULL) {
-        strncpy(szTemp,cn_to->chanList,2048);
-        token=strtok(szTemp," \n");
-        while (token!=NULL) {
-          if (strcmp(token,szName)==0) {
-            WriteLocalString(szName);
-            WriteLocalString(": ");
-            SendMyNameToOne(cn, cn_to, CClientNode::MSG_TYPE_TELL);
-            cn_to->outBuf->writesz(szMsg);
-            WriteLocalString(szMsg);
-            i=1;
-            break;
-          } else
-            token=strtok(NULL," \n");
-        }
-      }
-    }
-  }
-  if (i==0) {
-      cn->outBuf->writesz("-- ");
-      cn->outBuf->writesz(szName);
-      cn->outBuf->writesz(": No such name.\n");
-      while (cn->inBuf->hasWaiting()) ch=cn->inBuf->readChar();
-  }
+CRecvRing::~CRecvRing()
+{
+  if (iSocket != -1) close(iSocket);
+  delete [] pData;
 }
 
-// copy/paste of HandleTell. works for the time being -.-
-void CEqbcs::HandleBciMessage(CClientNode *cn)
+int CRecvRing::used()
 {
-   char szName[CClientNode::MAX_CHARNAMELEN];
-  char szMsg[2048]={0};
-  char szTemp[2048];
-  char *token;
-  char ch;
-  int i=0;
-  CClientNode *cn_to=clientList;
+  return (int)(uiHead - uiTail);
+}
 
-  ch=cn->inBuf->readChar();
-  while (ch!=' ' && ch!='\n' && ch!='\0' && i<CClientNode::MAX_CHARNAMELEN-1 && cn->inBuf->hasWaiting()) {
-    szName[i++]=ch;
-    ch=cn->inBuf->readChar();
-  }
-  szName[i]='\0';
+// ---------------------------------------------------------------------
+// Loop side: up to iMax bytes of whole messages
+// ---------------------------------------------------------------------
+int CRecvRing::take(char *pOut, int iMax)
+{
+  unsigned uiAt = uiTail;
+  int iLen = (int)(uiHead - uiAt);
+  int iFirst;
+
+  // The bytes behind uiHead are in
+  __sync_synchronize();
+  if (iLen > iMax) iLen = iMax;
+  iFirst = BYTES - (int)(uiAt & (BYTES-1));
+  if (iFirst > iLen) iFirst = iLen;
+  memcpy(pOut, &pData[uiAt & (BYTES-1)], iFirst);
+  memcpy(&pOut[iFirst], pData, iLen - iFirst);
+  // Done with the bytes before their room is given back
+  __sync_synchronize();
+  uiTail = uiAt + iLen;
+  return iLen;
+}
 
-  i=0;
-  while (cn->inBuf->hasWaiting()) {
-    ch=cn->inBuf->readChar();
-    if (ch=='\\' && cn->inBuf->hasWaiting()) ch=cn->inBuf->readChar();
-    szMsg[i++]=ch;
-    }
-  szMsg[i++]='\n';
-  szMsg[i]='\0';
+// ---------------------------------------------------------------------
+// Everything read and not taken, a partial message too, into pOut.
+// Only once its reader has stopped.
+// ---------------------------------------------------------------------
+void CRecvRing::copyOut(char *pOut)
+{
+  int iLen = (int)(uiRecvd - uiTail);
+  int iFirst = BYTES - (int)(uiTail & (BYTES-1));
+
+  if (iFirst > iLen) iFirst = iLen;
+  memcpy(pOut, &pData[uiTail & (BYTES-1)], iFirst);
+  memcpy(&pOut[iFirst], pData, iLen - iFirst);
+  uiTail = uiRecvd;
+  uiHead = uiRecvd;
+}
 
-  while (cn_to!=NULL && strcasecmp(cn_to->szCharName, szName)!=0)
-    cn_to=cn_to->next;
+// ---------------------------------------------------------------------
+// Writer threads
+// ---------------------------------------------------------------------
+CWriter::CWriter(int iLoopWakeFd, CSendRing * volatile *loopQueue, CWriter *newNext)
+{
+  bStarted = false;
+  iWakeFds[0] = iWakeFds[1] = -1;
+  this->iLoopWakeFd = iLoopWakeFd;
+  this->loopQueue = loopQueue;
+  rings = NULL;
+  added = NULL;
+  iSleeping = 0;
+  iStop = 0;
+  iRings = 0;
+  bNudge = false;
+  ulBytes = ulSends = ulStalls = 0;
+  ulStatsBytes = ulStatsSends = ulStatsStalls = 0;
+  next = newNext;
+}
 
-  if (cn_to!=NULL) {
-    SendMyNameToOne(cn, cn_to, CClientNode::MSG_TYPE_BCI);
-    cn_to->outBuf->writesz(szMsg);
-    return;
-  } else {
-    i=0;
-    for (cn_to=clientList; cn_to!=NULL; cn_to=cn_to->next) {
-      if((cn->bLocalEcho || cn_to!=cn) && cn_to->chanList!=NULL) {
-        strncpy(szTemp,cn_to->chanList,2048);
-        token=strtok(szTemp," \n");
-        while (token!=NULL) {
-          if (strcmp(token,szName)==0) {
-            WriteLocalString(szName);
-            WriteLocalString(": ");
-            SendMyNameToOne(cn, cn_to, CClientNode::MSG_TYPE_BCI);
-            cn_to->outBuf->writesz(szMsg);
-            WriteLocalString(szMsg);
-            i=1;
-            break;
-          } else
-            token=strtok(NULL," \n");
-        }
-      }
-    }
+CWriter::~CWriter()
+{
+  stop();
+  if (iWakeFds[0] != -1) {
+    close(iWakeFds[0]);
+    close(iWakeFds[1]);
   }
-  if (i==0) {
-      cn->outBuf->writesz("-- ");
-      cn->outBuf->writesz(szName);
-      cn->outBuf->writesz(": No such name.\n");
-      while (cn->inBuf->hasWaiting()) ch=cn->inBuf->readChar();
+}
+
+bool CWriter::start()
+{
+  if (pipe(iWakeFds) != 0) {
+    iWakeFds[0] = iWakeFds[1] = -1;
+    return false;
   }
+  fcntl(iWakeFds[0], F_SETFL, O_NONBLOCK);
+  fcntl(iWakeFds[1], F_SETFL, O_NONBLOCK);
+  bStarted = pthread_create(&thread, NULL, Run, this) == 0;
+  return bStarted;
 }
 
 // ---------------------------------------------------------------------
-// Disconnect command
+// Loop side: have the thread finish its pass and return.  Its rings
+// are left as they are, for the loop to take back.
 // ---------------------------------------------------------------------
-void CEqbcs::CmdDisconnect(CClientNode *cn)
+void CWriter::stop()
 {
-  if (cn) {
-    WriteLocalString("-- ");
-    WriteLocalString(cn->szCharName);
-    WriteLocalString(" CmdDisconnect.\n");
-    cn->closeMe = 1;
+  if (bStarted == false) return;
+  iStop = 1;
+  __sync_synchronize();
+  if (write(iWakeFds[1], "", 1) < 0) {
+    // Full already, it will wake
   }
+  pthread_join(thread, NULL);
+  bStarted = false;
 }
 
 // ---------------------------------------------------------------------
-// Send Names command
+// Loop side: give the writer a ring.  It takes the list whole, so
+// pushing is the only contention.
 // ---------------------------------------------------------------------
-void CEqbcs::CmdSendNames(CClientNode *cn_to)
+void CWriter::add(CSendRing *ring)
 {
-  int count = 0;
-
-  cn_to->outBuf->writesz("-- Names:");
-  WriteLocalString("-- ");
-  WriteLocalString(cn_to->szCharName);
-  WriteLocalString(" Requested Names:");
+  CSendRing *head;
+
+  ring->writer = this;
+  do {
+    head = added;
+    ring->nextAdded = head;
+  } while (__sync_bool_compare_and_swap(&added, head, ring) == false);
+  iRings++;
+  bNudge = true;
+}
 
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-    if (cn->bAuthorized && cn->closeMe == 0 && cn->iSocketHandle >= 0) {
-      count++;
-      cn_to->outBuf->writeChar(' ');
-      cn_to->outBuf->writesz(cn->szCharName);
-      WriteLocalString(" ");
-      WriteLocalString(cn->szCharName);
+// ---------------------------------------------------------------------
+// Loop side: wake the writer if it is asleep.  It says it is before it
+// looks for work one last time, so either it sees what the loop just
+// did or the loop sees it sleeping.
+// ---------------------------------------------------------------------
+void CWriter::nudge()
+{
+  bNudge = false;
+  __sync_synchronize();
+  if (iSleeping && __sync_bool_compare_and_swap(&iSleeping, 1, 0)) {
+    if (write(iWakeFds[1], "", 1) < 0) {
+      // Full already, it will wake
     }
   }
-  cn_to->outBuf->writesz(".\n");
-  WriteLocalString(".\n");
+}
+
+void *CWriter::Run(void *pWriter)
+{
+  ((CWriter *)pWriter)->loop();
+  return NULL;
+}
+
+bool CWriter::hasWork()
+{
+  if (iStop || added) return true;
+  for (CSendRing *ring = rings; ring != NULL; ring = ring->next) {
+    if (ring->iClosing) return true;
+    if (ring->iError == 0 && ring->bWantWrite == false && ring->used() > 0) return true;
+  }
+  return false;
 }
 
 // ---------------------------------------------------------------------
-// Do a command
+// The loop's handler for the ring has something to look at: room it
+// was waiting for, or an error.  Queued once until the loop takes it.
 // ---------------------------------------------------------------------
-void CEqbcs::DoCommand(CClientNode *cn)
+void CWriter::tellLoop(CSendRing *ring)
 {
-  // Note: All found commands should process and return immediately.
-  if (cn) {
-    cn->bCmdMode = false;
-    cn->cmdBufUsed = 0;
-    if (cn->cmdBuf) {
-      if (strcmp("NBMSG", cn->cmdBuf)==0) {
-        cn->inBuf->writeChar('\t');
-        cn->inBuf->writeChar((char)CClientNode::MSG_TYPE_NBMSG);
-        return;
-      }
-      if (!strcmp("BCI", cn->cmdBuf))
-      {
-         cn->inBuf->writeChar('\t');
-         cn->inBuf->writeChar((char)CClientNode::MSG_TYPE_BCI);
-         return;
-      }
-      if (strcmp("NBNAMES", cn->cmdBuf)==0) {
-        SendNetBotSendList(cn);
-        return;
-      }
-      if (strcmp("NAMES", cn->cmdBuf) == 0) {
-        CmdSendNames(cn);
-        return;
-      }
-      if (strcmp("DISCONNECT", cn->cmdBuf) == 0) {
-        CmdDisconnect(cn);
-        return;
-      }
-      if (strcmp("MSGALL", cn->cmdBuf) == 0) {
-        cn->inBuf->writeChar('\t');
-        cn->inBuf->writeChar((char)CClientNode::MSG_TYPE_MSGALL);
-        return;
-      }
-      if (strcmp("TELL", cn->cmdBuf) == 0) {
-        cn->inBuf->writeChar('\t');
-        cn->inBuf->writeChar((char)CClientNode::MSG_TYPE_TELL);
-        return;
-      }
-      if (strcmp("CHANNELS", cn->cmdBuf) == 0) {
-        cn->inBuf->writeChar('\t');
-        cn->inBuf->writeChar((char)CClientNode::MSG_TYPE_CHANNELS);
-        return;
-      }
-      if (strncmp("LOCALECHO", cn->cmdBuf,9) == 0) {
-        (cn->cmdBuf[10]=='1') ? cn->bLocalEcho=1 : cn->bLocalEcho=0;
-        cn->outBuf->writesz("-- Local Echo: ");
-        (cn->bLocalEcho) ? cn->outBuf->writesz("ON\n") : cn->outBuf->writesz("OFF\n");
-        return;
+  CSendRing *head;
+
+  if (__sync_bool_compare_and_swap(&ring->iQueued, 0, 1)) {
+    do {
+      head = *loopQueue;
+      ring->nextQueued = head;
+    } while (__sync_bool_compare_and_swap(loopQueue, head, ring) == false);
+  }
+  if (write(iLoopWakeFd, "", 1) < 0) {
+    // Full already, it will wake
+  }
+}
+
+// ---------------------------------------------------------------------
+// Send until the ring is empty or the socket full.  An error is left
+// for the loop to find, as is the room it may be waiting for.
+// ---------------------------------------------------------------------
+void CWriter::sendSome(CSendRing *ring)
+{
+  unsigned uiAt;
+  int iLen;
+  int iSent;
+
+  while (ring->iError == 0 && (iLen = ring->used()) > 0) {
+    // The bytes behind uiHead are in
+    __sync_synchronize();
+    uiAt = ring->uiTail;
+    if (iLen > CSendRing::BYTES - (int)(uiAt & (CSendRing::BYTES-1))) {
+      iLen = CSendRing::BYTES - (int)(uiAt & (CSendRing::BYTES-1));
+    }
+#ifdef MSG_NOSIGNAL
+    iSent = send(ring->iSocket, &ring->pData[uiAt & (CSendRing::BYTES-1)], iLen, MSG_NOSIGNAL);
+#else
+    iSent = send(ring->iSocket, &ring->pData[uiAt & (CSendRing::BYTES-1)], iLen, 0);
+#endif
+    ulSends++;
+    if (iSent < 0 && errno == EINTR) continue;
+    if (iSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      ulStalls++;
+      ring->bWantWrite = true;
+      break;
+    }
+    if (iSent <= 0) {
+      ring->iError = (iSent < 0 && errno) ? errno : EPIPE;
+      tellLoop(ring);
+      break;
+    }
+    if (ring->sentUnit) ring->sentUnit->note(&ring->pData[uiAt & (CSendRing::BYTES-1)], iSent);
+    // Done with the bytes before their room is given back
+    __sync_synchronize();
+    ring->uiTail = uiAt + iSent;
+    ulBytes += iSent;
+  }
+  if (ring->iWaiting && ring->used() <= CSendRing::BYTES/2 &&
+    __sync_bool_compare_and_swap(&ring->iWaiting, 1, 0))
+    {
+    tellLoop(ring);
+  }
+}
+
+void CWriter::loop()
+{
+  struct pollfd *fds = NULL;
+  CSendRing **polled = NULL;
+  CSendRing *ring;
+  CSendRing *prev;
+  CSendRing *taken;
+  char szDrain[64];
+  int iFds;
+  int iFdsSize = 0;
+
+  while (iStop == 0) {
+    taken = __sync_lock_test_and_set(&added, (CSendRing *)NULL);
+    while (taken != NULL) {
+      ring = taken;
+      taken = ring->nextAdded;
+      ring->next = rings;
+      rings = ring;
+    }
+
+    iFds = 1;
+    for (prev = NULL, ring = rings; ring != NULL; ) {
+      if (ring->iClosing) {
+        // Let go: the loop takes it from here on its next pass
+        CSendRing *gone = ring;
+
+        ring = ring->next;
+        if (prev) prev->next = ring;
+        else rings = ring;
+        close(gone->iSocket);
+        gone->iSocket = -1;
+        __sync_synchronize();
+        gone->iReleased = 1;
+        if (write(iLoopWakeFd, "", 1) < 0) {
+          // Full already, it will wake
+        }
+        continue;
       }
-      if ( strcmp( "PONG", cn->cmdBuf ) == 0)
-      {
-         cn->lastPingReponseTimeSecs = time( NULL );
-         return;
+      if (ring->bWantWrite == false) sendSome(ring);
+      if (ring->bWantWrite && ring->iError == 0) iFds++;
+      prev = ring;
+      ring = ring->next;
+    }
+
+    iSleeping = 1;
+    __sync_synchronize();
+    if (hasWork()) {
+      iSleeping = 0;
+      continue;
+    }
+    if (iFds > iFdsSize) {
+      delete [] fds;
+      delete [] polled;
+      iFdsSize = iFds * 2;
+      fds = new struct pollfd[iFdsSize];
+      polled = new CSendRing*[iFdsSize];
+    }
+    fds[0].fd = iWakeFds[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    iFds = 1;
+    for (ring = rings; ring != NULL; ring = ring->next) {
+      if (ring->bWantWrite && ring->iError == 0) {
+        fds[iFds].fd = ring->iSocket;
+        fds[iFds].events = POLLOUT;
+        fds[iFds].revents = 0;
+        polled[iFds++] = ring;
       }
     }
+    if (poll(fds, iFds, -1) < 0 && errno != EINTR) perror("Writer poll");
+    iSleeping = 0;
+    if (fds[0].revents) {
+      while (read(iWakeFds[0], szDrain, sizeof(szDrain)) > 0);
+    }
+    for (int i=1; i < iFds; i++) {
+      if (fds[i].revents) polled[i]->bWantWrite = false;
+    }
   }
+  delete [] fds;
+  delete [] polled;
+}
 
-  cn->outBuf->writesz("-- Unknown Command: ");
-  if (cn->cmdBuf) cn->outBuf->writesz(cn->cmdBuf);
-  cn->outBuf->writesz(".\n");
+// ---------------------------------------------------------------------
+// Reader threads
+// ---------------------------------------------------------------------
+CReader::CReader(int iLoopWakeFd, CRecvRing * volatile *loopQueue, CReader *newNext)
+{
+  bStarted = false;
+  iWakeFds[0] = iWakeFds[1] = -1;
+  this->iLoopWakeFd = iLoopWakeFd;
+  this->loopQueue = loopQueue;
+  rings = NULL;
+  added = NULL;
+  iSleeping = 0;
+  iStop = 0;
+  iRings = 0;
+  ulBytes = ulMsgs = 0;
+  ulStatsBytes = ulStatsMsgs = 0;
+  next = newNext;
 }
 
-void CEqbcs::PingAllClients( time_t curTime )
+CReader::~CReader()
 {
-   for ( CClientNode *cn = clientList; cn != NULL; cn = cn->next )
-   {
-      if ( cn->lastPingSecs + cn->PING_SECONDS < curTime )
-      {
-         cn->outBuf->writesz( "\tPING\n" );
-         cn->lastPingSecs = curTime;
-      }
-   }
+  stop();
+  if (iWakeFds[0] != -1) {
+    close(iWakeFds[0]);
+    close(iWakeFds[1]);
+  }
+}
+
+bool CReader::start()
+{
+  if (pipe(iWakeFds) != 0) {
+    iWakeFds[0] = iWakeFds[1] = -1;
+    return false;
+  }
+  fcntl(iWakeFds[0], F_SETFL, O_NONBLOCK);
+  fcntl(iWakeFds[1], F_SETFL, O_NONBLOCK);
+  bStarted = pthread_create(&thread, NULL, Run, this) == 0;
+  return bStarted;
+}
+
+void CReader::stop()
+{
+  if (bStarted == false) return;
+  iStop = 1;
+  __sync_synchronize();
+  if (write(iWakeFds[1], "", 1) < 0) {
+    // Full already, it will wake
+  }
+  pthread_join(thread, NULL);
+  bStarted = false;
+}
 
+void CReader::add(CRecvRing *ring)
+{
+  CRecvRing *head;
+
+  ring->reader = this;
+  do {
+    head = added;
+    ring->nextAdded = head;
+  } while (__sync_bool_compare_and_swap(&added, head, ring) == false);
+  iRings++;
+  nudge();
 }
 
 // ---------------------------------------------------------------------
-// Read All Clients that (might) have pending data
+// Loop side: as CWriter::nudge, for a new or closing ring or room in a
+// full one
 // ---------------------------------------------------------------------
-void CEqbcs::ReadAllClients(fd_set *fds)
+void CReader::nudge()
 {
-  char ch;
-  int iBytesRead;
-  int lastRet = CSockio::OKAY;
+  __sync_synchronize();
+  if (iSleeping && __sync_bool_compare_and_swap(&iSleeping, 1, 0)) {
+    if (write(iWakeFds[1], "", 1) < 0) {
+      // Full already, it will wake
+    }
+  }
+}
 
-#ifdef UNIXWIN
-  WSASetLastError(0);
-#endif
+void *CReader::Run(void *pReader)
+{
+  ((CReader *)pReader)->loop();
+  return NULL;
+}
 
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next)    {
-    if (FD_ISSET(cn->iSocketHandle, fds)) {
-      if ((lastRet = CSockio::iReadSock(cn->iSocketHandle,
-        &ch, 1, &iBytesRead)) == CSockio::OKAY && iBytesRead)
-        {
-        if (iBytesRead < 0) {
-          cn->lastReadError = iBytesRead;
-          cn->closeMe = 1;
-        }
-        else if (cn->bAuthorized && cn->bCmdMode == false) {
-          if (ch == '\t' && cn->inBuf->hasWaiting() == 0) {
-            cn->bCmdMode = true;
-          }
-          else if (ch == '\n') {
-            cn->readyToSend = 1;
-            cn->lastChar = ' '; // force to no spaces at start of next line
-          }
-          else if (cn->lastChar != ' ' || ch != ' ') {
-            cn->inBuf->writeChar(ch);
-            cn->lastChar = ch;
-          }
-        }
-        else if (cn->cmdBufUsed < (CClientNode::CMD_BUFSIZE-1)) {
-          if (ch == '\n' && cn->bCmdMode) {
-            cn->cmdBuf[cn->cmdBufUsed] = 0;
-            DoCommand(cn);
-            cn->lastChar = ' ';
-          }
-          else if (ch != '\r') {
-            cn->cmdBuf[cn->cmdBufUsed] = ch;
-            cn->cmdBufUsed++;
-          }
-        }
-      }
-      else {
-#ifdef UNIXWIN
-        if (lastRet != CSockio::OKAY || WSAGetLastError()) {
-          if (lastRet == -2) {
-            cn->lastReadError = -1;
-          }
-          else {
-            CSockio::vPrintSockErr();
-            cn->lastReadError = WSAGetLastError();
-          }
-          cn->closeMe = 1;
-          WSASetLastError(0);
-        }
-#else
-        if (lastRet == CSockio::READERR) {
-          cn->lastReadError = 1;
-          cn->closeMe = 1;
-        }
-#endif
-      }
+bool CReader::hasWork()
+{
+  if (iStop || added) return true;
+  for (CRecvRing *ring = rings; ring != NULL; ring = ring->next) {
+    if (ring->iClosing) return true;
+  }
+  return false;
+}
+
+void CReader::tellLoop(CRecvRing *ring)
+{
+  CRecvRing *head;
+
+  if (__sync_bool_compare_and_swap(&ring->iQueued, 0, 1)) {
+    do {
+      head = *loopQueue;
+      ring->nextQueued = head;
+    } while (__sync_bool_compare_and_swap(loopQueue, head, ring) == false);
+    if (write(iLoopWakeFd, "", 1) < 0) {
+      // Full already, it will wake
     }
   }
 }
 
 // ---------------------------------------------------------------------
-// Clean dead clients
+// Where the last whole line or frame in what was just read ends, from
+// where the last one before it did.  Frames are followed through their
+// headers; the state carries over to the next read.
 // ---------------------------------------------------------------------
-void CEqbcs::CleanDeadClients(void)
+unsigned CReader::split(CRecvRing *ring, unsigned uiFrom, unsigned uiTo)
 {
-  CClientNode *cn = clientList;
-  CClientNode *cn_last = NULL;
-  CClientNode *cn_temp = NULL;
+  unsigned uiWhole = ring->uiHead;
+  unsigned uiAt;
+  int iTake;
+
+  for (uiAt = uiFrom; uiAt != uiTo; ) {
+    if (ring->bFrames == false) {
+      if (ring->pData[uiAt++ & (CRecvRing::BYTES-1)] == '\n') {
+        uiWhole = uiAt;
+        ulMsgs++;
+      }
+      continue;
+    }
+    if (ring->iHdrUsed < 3) {
+      ring->hdr[ring->iHdrUsed++] = (unsigned char)ring->pData[uiAt++ & (CRecvRing::BYTES-1)];
+      if (ring->iHdrUsed < 3) continue;
+      ring->iFrameLeft = (ring->hdr[1] << 8) | ring->hdr[2];
+    }
+    iTake = (int)(uiTo - uiAt);
+    if (iTake > ring->iFrameLeft) iTake = ring->iFrameLeft;
+    uiAt += iTake;
+    ring->iFrameLeft -= iTake;
+    if (ring->iFrameLeft == 0) {
+      ring->iHdrUsed = 0;
+      uiWhole = uiAt;
+      ulMsgs++;
+    }
+  }
+  return uiWhole;
+}
 
-  while (cn != NULL) {
-    if (cn->iSocketHandle == -1 && cn->closeMe == 1) {
-      if (cn_last == NULL) // It's the head.
+// ---------------------------------------------------------------------
+// Read until the socket is empty or the ring full, then hand the loop
+// the whole messages.  A full ring that holds no whole message goes as
+// it is; so does everything once the connection has ended.
+// ---------------------------------------------------------------------
+void CReader::recvSome(CRecvRing *ring)
+{
+  unsigned uiWhole = ring->uiHead;
+  unsigned uiSplit;
+  unsigned uiAt;
+  int iRoom;
+  int iLen;
+  int iGot;
+  int iEnded = 0;
+
+  while (iEnded == 0) {
+    // Room the loop gave back is only reused after it is done with it
+    __sync_synchronize();
+    iRoom = CRecvRing::BYTES - (int)(ring->uiRecvd - ring->uiTail);
+    if (iRoom == 0) {
+      ring->iFull = 1;
+      __sync_synchronize();
+      // Unless the loop took some in between, it says when it has
+      if (ring->uiRecvd - ring->uiTail < (unsigned)CRecvRing::BYTES &&
+        __sync_bool_compare_and_swap(&ring->iFull, 1, 0))
         {
-        clientList = clientList->next;
-        delete cn;
-        cn = clientList;
+        continue;
       }
-      else {
-        cn_temp = cn;
-        cn_last->next = cn->next;
-        cn = cn->next;
-        delete cn_temp;
+      break;
+    }
+    uiAt = ring->uiRecvd & (CRecvRing::BYTES-1);
+    iLen = CRecvRing::BYTES - (int)uiAt;
+    if (iLen > iRoom) iLen = iRoom;
+    iGot = (int)recv(ring->iSocket, &ring->pData[uiAt], iLen, 0);
+    if (iGot < 0 && errno == EINTR) continue;
+    if (iGot < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (iGot <= 0) {
+      iEnded = (iGot < 0 && errno) ? errno : -1;
+      break;
+    }
+    ulBytes += iGot;
+    uiSplit = split(ring, ring->uiRecvd, ring->uiRecvd + iGot);
+    if ((int)(uiSplit - uiWhole) > 0) uiWhole = uiSplit;
+    ring->uiRecvd += iGot;
+  }
+  if (iEnded || ring->uiRecvd - ring->uiTail == (unsigned)CRecvRing::BYTES) {
+    uiWhole = ring->uiRecvd;
+  }
+  if (uiWhole != ring->uiHead) {
+    // The bytes are in before the loop can see them
+    __sync_synchronize();
+    ring->uiHead = uiWhole;
+  }
+  if (iEnded) {
+    // After what came before it
+    __sync_synchronize();
+    ring->iError = iEnded;
+  }
+  if (uiWhole != ring->uiTail || iEnded) tellLoop(ring);
+}
+
+void CReader::loop()
+{
+  struct pollfd *fds = NULL;
+  CRecvRing **polled = NULL;
+  CRecvRing *ring;
+  CRecvRing *prev;
+  CRecvRing *taken;
+  char szDrain[64];
+  int iFds;
+  int iFdsSize = 0;
+
+  while (iStop == 0) {
+    taken = __sync_lock_test_and_set(&added, (CRecvRing *)NULL);
+    while (taken != NULL) {
+      ring = taken;
+      taken = ring->nextAdded;
+      ring->next = rings;
+      rings = ring;
+    }
+
+    iFds = 1;
+    for (prev = NULL, ring = rings; ring != NULL; ) {
+      if (ring->iClosing) {
+        CRecvRing *gone = ring;
+
+        ring = ring->next;
+        if (prev) prev->next = ring;
+        else rings = ring;
+        close(gone->iSocket);
+        gone->iSocket = -1;
+        __sync_synchronize();
+        gone->iReleased = 1;
+        if (write(iLoopWakeFd, "", 1) < 0) {
+          // Full already, it will wake
+        }
+        continue;
       }
+      iFds++;
+      prev = ring;
+      ring = ring->next;
     }
-    else {
-      cn_last = cn;
-      cn = cn->next;
+
+    // Said before the last look, as in CWriter::loop; a ring the loop
+    // made room in since is polled below
+    iSleeping = 1;
+    __sync_synchronize();
+    if (hasWork()) {
+      iSleeping = 0;
+      continue;
+    }
+    if (iFds > iFdsSize) {
+      delete [] fds;
+      delete [] polled;
+      iFdsSize = iFds * 2;
+      fds = new struct pollfd[iFdsSize];
+      polled = new CRecvRing*[iFdsSize];
+    }
+    fds[0].fd = iWakeFds[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    iFds = 1;
+    for (ring = rings; ring != NULL; ring = ring->next) {
+      if (ring->iError == 0 && ring->iFull == 0) {
+        fds[iFds].fd = ring->iSocket;
+        fds[iFds].events = POLLIN;
+        fds[iFds].revents = 0;
+        polled[iFds++] = ring;
+      }
+    }
+    if (poll(fds, iFds, -1) < 0 && errno != EINTR) perror("Reader poll");
+    iSleeping = 0;
+    if (fds[0].revents) {
+      while (read(iWakeFds[0], szDrain, sizeof(szDrain)) > 0);
+    }
+    for (int i=1; i < iFds; i++) {
+      if (fds[i].revents) recvSome(polled[i]);
     }
   }
+  delete [] fds;
+  delete [] polled;
 }
+#endif
 
 // ---------------------------------------------------------------------
-// Close socket handles for dead clients
+// Connection handler coroutines.  A frame is a block of the reactor's
+// pool with the pool in front, NULL there if it came from the heap.
 // ---------------------------------------------------------------------
-void CEqbcs::CloseDeadClients(void)
+void *CConnTask::promise_type::operator new(size_t n, CEqbcs &, CClientNode *cn)
 {
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-    if (cn->iSocketHandle != -1 && cn->closeMe == 1) {
-      CSockio::iCloseSock(cn->iSocketHandle, 1, 1, EQBCS_TraceSockets);
-      NotifyClientQuit(cn->szCharName);
-      WriteLocalString("-- ");
-      WriteLocalString(cn->szCharName);
-      WriteLocalString(" has left the server.\n");
-      cn->iSocketHandle = -1;
-      bNetBotChanges = true;
+  CBlockPool *pool = cn->reactor->framePool;
+  char *pFrame;
+
+  if ((int)n + CReactor::FRAME_HEADER_BYTES > pool->iBlockBytes) {
+    pool = NULL;
+    pFrame = (char *)::operator new(n + CReactor::FRAME_HEADER_BYTES);
+  }
+  else {
+    pFrame = pool->alloc();
+  }
+  memcpy(pFrame, &pool, sizeof(pool));
+  return pFrame + CReactor::FRAME_HEADER_BYTES;
+}
+
+void CConnTask::promise_type::operator delete(void *p, size_t n)
+{
+  char *pFrame = (char *)p - CReactor::FRAME_HEADER_BYTES;
+  CBlockPool *pool;
+
+  memcpy(&pool, pFrame, sizeof(pool));
+  if (pool) pool->release(pFrame);
+  else ::operator delete(pFrame);
+}
+
+CConnTask CConnTask::promise_type::get_return_object()
+{
+  CConnTask task;
+
+  task.handle = std::coroutine_handle<promise_type>::from_promise(*this);
+  return task;
+}
+
+std::suspend_always CConnTask::promise_type::initial_suspend() noexcept
+{
+  return std::suspend_always();
+}
+
+std::suspend_always CConnTask::promise_type::final_suspend() noexcept
+{
+  // Kept until StopHandler destroys it
+  return std::suspend_always();
+}
+
+void CConnTask::promise_type::return_void()
+{
+}
+
+void CConnTask::promise_type::unhandled_exception()
+{
+  abort();
+}
+
+// ---------------------------------------------------------------------
+// Reactor
+// ---------------------------------------------------------------------
+CReactor::CReactor()
+{
+  framePool = new CBlockPool(FRAME_BLOCK_BYTES);
+  uiResumes = 0;
+  readyHead = readyTail = NULL;
+  timedHead = NULL;
+}
+
+CReactor::~CReactor()
+{
+  delete framePool;
+}
+
+void CReactor::unlinkTimed(CClientNode *cn)
+{
+  if (cn->prevTimed) cn->prevTimed->nextTimed = cn->nextTimed;
+  else if (timedHead == cn) timedHead = cn->nextTimed;
+  else return;
+  if (cn->nextTimed) cn->nextTimed->prevTimed = cn->prevTimed;
+  cn->prevTimed = cn->nextTimed = NULL;
+}
+
+// ---------------------------------------------------------------------
+// cn's handler suspends until one of iWant is posted, or for at most
+// iMsecs (-1 for no deadline)
+// ---------------------------------------------------------------------
+void CReactor::wait(CClientNode *cn, int iWant, int iMsecs)
+{
+  cn->iWant = iWant;
+  if (iMsecs >= 0) {
+    cn->ulWakeAt = CClock::msecs() + iMsecs;
+    cn->prevTimed = NULL;
+    cn->nextTimed = timedHead;
+    if (timedHead) timedHead->prevTimed = cn;
+    timedHead = cn;
+  }
+  post(cn, 0);
+}
+
+// ---------------------------------------------------------------------
+// Events for cn, kept until its handler takes them.  It is made ready
+// if it waits for one of them.
+// ---------------------------------------------------------------------
+void CReactor::post(CClientNode *cn, int iEvents)
+{
+  cn->iEvents |= iEvents;
+  if ((cn->iEvents & cn->iWant) == 0 || cn->bReady) return;
+  cn->bReady = true;
+  cn->nextReady = NULL;
+  if (readyTail) readyTail->nextReady = cn;
+  else readyHead = cn;
+  readyTail = cn;
+}
+
+// ---------------------------------------------------------------------
+// cn's handler is going away
+// ---------------------------------------------------------------------
+void CReactor::cancel(CClientNode *cn)
+{
+  CClientNode *prev = NULL;
+
+  unlinkTimed(cn);
+  if (cn->bReady) {
+    for (CClientNode *c = readyHead; c != cn; c = c->nextReady) prev = c;
+    if (prev) prev->nextReady = cn->nextReady;
+    else readyHead = cn->nextReady;
+    if (readyTail == cn) readyTail = prev;
+    cn->bReady = false;
+  }
+  cn->iWant = 0;
+  cn->iEvents = 0;
+}
+
+// ---------------------------------------------------------------------
+// Post EV_WAKE to the handlers whose deadline has come
+// ---------------------------------------------------------------------
+void CReactor::expire(unsigned long ulNow)
+{
+  CClientNode *cn = timedHead;
+  CClientNode *cnNext;
+
+  while (cn != NULL) {
+    cnNext = cn->nextTimed;
+    if ((long)(ulNow - cn->ulWakeAt) >= 0) {
+      unlinkTimed(cn);
+      post(cn, EV_WAKE);
     }
+    cn = cnNext;
+  }
+}
+
+// ---------------------------------------------------------------------
+// Milliseconds until the first deadline, 0 if a handler is ready
+// already, -1 for neither
+// ---------------------------------------------------------------------
+int CReactor::msecsLeft(unsigned long ulNow)
+{
+  int iLeft = -1;
+  long lLeft;
+
+  if (readyHead) return 0;
+  for (CClientNode *cn = timedHead; cn != NULL; cn = cn->nextTimed) {
+    lLeft = (long)(cn->ulWakeAt - ulNow);
+    if (lLeft < 0) lLeft = 0;
+    if (iLeft < 0 || lLeft < iLeft) iLeft = (int)lLeft;
+  }
+  return iLeft;
+}
+
+// ---------------------------------------------------------------------
+// Resume the ready handlers in the order they got their events.  Those
+// they make ready in turn run in this pass too.
+// ---------------------------------------------------------------------
+void CReactor::run()
+{
+  CClientNode *cn;
+
+  while ((cn = readyHead) != NULL) {
+    readyHead = cn->nextReady;
+    if (readyHead == NULL) readyTail = NULL;
+    cn->bReady = false;
+    if (cn->iWant == 0 || !cn->handler) continue;
+    unlinkTimed(cn);
+    uiResumes++;
+    cn->handler.resume();
+  }
+}
+
+// ---------------------------------------------------------------------
+// Connection handler awaits
+// ---------------------------------------------------------------------
+CIoAwait::CIoAwait(CEqbcs *server, CClientNode *cn, int iOp, int iWant, int iMsecs)
+{
+  this->server = server;
+  this->cn = cn;
+  this->iOp = iOp;
+  this->iWant = iWant | CReactor::EV_WAKE;
+  this->iMsecs = iMsecs;
+  iResult = 0;
+  bDone = false;
+}
+
+// ---------------------------------------------------------------------
+// No need to suspend when Send gets bytes out, or something it waits
+// for was posted while the handler ran
+// ---------------------------------------------------------------------
+bool CIoAwait::await_ready()
+{
+  if (iOp == OP_SEND) {
+    iResult = server->SendOutput(cn);
+    bDone = (iResult != 0);
+    if (bDone) return true;
+  }
+  return (cn->iEvents & iWant) != 0;
+}
+
+void CIoAwait::await_suspend(std::coroutine_handle<>)
+{
+  cn->reactor->wait(cn, iWant, iMsecs);
+}
+
+// ---------------------------------------------------------------------
+// Take the events it was resumed for and do its I/O.  Input that
+// stopped a Send is left for the Recv that follows.
+// ---------------------------------------------------------------------
+int CIoAwait::await_resume()
+{
+  int iGot;
+
+  if (bDone) return iResult;
+  iGot = cn->iEvents & iWant;
+  cn->iWant = 0;
+  if (iOp == OP_SEND) {
+    cn->iEvents &= ~(iGot & ~CReactor::EV_READ);
+    return (iGot & CReactor::EV_WRITE) ? server->SendOutput(cn) : 0;
+  }
+  cn->iEvents &= ~iGot;
+  if (iOp == OP_RECV && ((iGot & CReactor::EV_READ) || server->InputWaiting(cn))) {
+    return server->RecvInput(cn);
+  }
+  return 0;
+}
+
+// ---------------------------------------------------------------------
+// Checkpoint file.  A slot is [used][adler32][length][body], the body
+// being FIELD_COUNT strings each ending in a 0.
+// ---------------------------------------------------------------------
+CCheckpoint::CCheckpoint()
+{
+  iFd = -1;
+  map = NULL;
+  iSlots = SLOTS;
+  orphan = new bool[iSlots];
+  for (int i=0; i < iSlots; i++) orphan[i] = false;
+  uiWrites = 0;
+  uiAllocFailures = 0;
+  ulTotalUsecs = 0;
+  ulMaxUsecs = 0;
+}
+
+CCheckpoint::~CCheckpoint()
+{
+#ifndef UNIXWIN
+  if (map) munmap(map, HEADER_BYTES + iSlots*SLOT_BYTES);
+  if (iFd != -1) close(iFd);
+#endif
+  delete [] orphan;
+}
+
+char *CCheckpoint::slotBody(int iSlot)
+{
+  return map + HEADER_BYTES + iSlot*SLOT_BYTES;
+}
+
+// ---------------------------------------------------------------------
+// Map szFile, creating it if need be.  Returns the number of slots
+// kept from the last run, -1 on failure.
+// ---------------------------------------------------------------------
+int CCheckpoint::load(const char *szFile)
+{
+#ifdef UNIXWIN
+  fprintf(stderr, "Checkpoint files are not supported on this platform.\n");
+  return -1;
+#else
+  char head[16];
+  unsigned int *hdr = (unsigned int *)(head + 8);
+  struct stat st;
+  int iSize;
+  int iKept = 0;
+
+  if ((iFd = open(szFile, O_RDWR|O_CREAT, 0600)) == -1) {
+    perror(szFile);
+    return -1;
+  }
+  if (fstat(iFd, &st) != 0) {
+    perror(szFile);
+    return -1;
+  }
+  // Keep the size the last run grew to.  A crash while growing can
+  // leave the file longer than its header says; the header wins.
+  if (st.st_size >= (off_t)sizeof(head) &&
+    pread(iFd, head, sizeof(head), 0) == (ssize_t)sizeof(head) &&
+    memcmp(head, MAGIC, 8) == 0 && hdr[0] > (unsigned)SLOTS &&
+    hdr[1] == (unsigned)SLOT_BYTES &&
+    st.st_size >= (off_t)HEADER_BYTES + (off_t)hdr[0]*SLOT_BYTES)
+  {
+    iSlots = hdr[0];
+    delete [] orphan;
+    orphan = new bool[iSlots];
+    for (int i=0; i < iSlots; i++) orphan[i] = false;
+  }
+  iSize = HEADER_BYTES + iSlots*SLOT_BYTES;
+  if (st.st_size != iSize && ftruncate(iFd, iSize) != 0) {
+    perror(szFile);
+    return -1;
+  }
+  map = (char *)mmap(NULL, iSize, PROT_READ|PROT_WRITE, MAP_SHARED, iFd, 0);
+  if (map == MAP_FAILED) {
+    map = NULL;
+    perror(szFile);
+    return -1;
+  }
+  hdr = (unsigned int *)(map + 8);
+  if (memcmp(map, MAGIC, 8) != 0 || hdr[0] != (unsigned)iSlots ||
+    hdr[1] != (unsigned)SLOT_BYTES)
+  {
+    // New, or laid out differently: start clean
+    memset(map, 0, iSize);
+    memcpy(map, MAGIC, 8);
+    hdr[0] = iSlots;
+    hdr[1] = SLOT_BYTES;
+    return 0;
+  }
+  for (int i=0; i < iSlots; i++) {
+    unsigned int *slot = (unsigned int *)slotBody(i);
+
+    if (slot[0] == 0) continue;
+    if (slot[2] > (unsigned)(SLOT_BYTES-12) ||
+      slot[1] != adler32(1, (const Bytef *)&slot[3], slot[2]))
+    {
+      // Torn by the crash
+      slot[0] = 0;
+      continue;
+    }
+    orphan[i] = true;
+    iKept++;
+  }
+  return iKept;
+#endif
+}
+
+// ---------------------------------------------------------------------
+// The slot left from the last run for szName, -1 if there is none
+// ---------------------------------------------------------------------
+int CCheckpoint::claim(const char *szName)
+{
+  for (int i=0; i < iSlots; i++) {
+    if (orphan[i] && strcmp(field(i, 0), szName) == 0) {
+      orphan[i] = false;
+      return i;
+    }
+  }
+  return -1;
+}
+
+// ---------------------------------------------------------------------
+// Double the number of slots.  The new ones read as unused; the header
+// is only updated once the file and the mapping have both grown.
+// ---------------------------------------------------------------------
+bool CCheckpoint::grow()
+{
+#ifdef UNIXWIN
+  return false;
+#else
+  int iNew = iSlots*2;
+  int iNewSize = HEADER_BYTES + iNew*SLOT_BYTES;
+  char *newMap;
+  bool *newOrphan;
+
+  if (ftruncate(iFd, iNewSize) != 0) return false;
+  newMap = (char *)mmap(NULL, iNewSize, PROT_READ|PROT_WRITE, MAP_SHARED, iFd, 0);
+  if (newMap == MAP_FAILED) return false;
+  munmap(map, HEADER_BYTES + iSlots*SLOT_BYTES);
+  map = newMap;
+  newOrphan = new bool[iNew];
+  for (int i=0; i < iNew; i++) newOrphan[i] = i < iSlots ? orphan[i] : false;
+  delete [] orphan;
+  orphan = newOrphan;
+  iSlots = iNew;
+  ((unsigned int *)(map + 8))[0] = iSlots;
+  return true;
+#endif
+}
+
+// ---------------------------------------------------------------------
+// A free slot, else a new one from growing the file, else one still
+// waiting for its owner.  -1 (and counted) if none can be had.  The
+// slot is taken at once with a bad checksum, so a second login before
+// the next write cannot get it too and a crash leaves it unused.
+// ---------------------------------------------------------------------
+int CCheckpoint::alloc()
+{
+  int iSlot = -1;
+  int iOrphan = -1;
+  int iOld = iSlots;
+  unsigned int *slot;
+
+  for (int i=0; i < iSlots && iSlot == -1; i++) {
+    if (((unsigned int *)slotBody(i))[0] == 0) iSlot = i;
+    else if (orphan[i] && iOrphan == -1) iOrphan = i;
+  }
+  if (iSlot == -1) {
+    if (grow()) iSlot = iOld;
+    else if ((iSlot = iOrphan) != -1) orphan[iSlot] = false;
+    else {
+      uiAllocFailures++;
+      return -1;
+    }
+  }
+  slot = (unsigned int *)slotBody(iSlot);
+  slot[1] = 0;
+  slot[2] = 0;
+  slot[0] = 1;
+  return iSlot;
+}
+
+bool CCheckpoint::store(int iSlot, const char **fields)
+{
+  unsigned int *slot = (unsigned int *)slotBody(iSlot);
+  char *pBody = (char *)&slot[3];
+  unsigned int uiLen = 0;
+  int iLen;
+
+  for (int i=0; i < FIELD_COUNT; i++) {
+    uiLen += strlen(fields[i]) + 1;
+  }
+  if (uiLen > (unsigned)(SLOT_BYTES-12)) return false;
+
+  // Unused while it is rewritten, so a crash midway leaves nothing
+  *(volatile unsigned int *)&slot[0] = 0;
+  for (int i=0; i < FIELD_COUNT; i++) {
+    iLen = strlen(fields[i]) + 1;
+    memcpy(pBody, fields[i], iLen);
+    pBody += iLen;
+  }
+  slot[2] = uiLen;
+  slot[1] = adler32(1, (const Bytef *)&slot[3], uiLen);
+  *(volatile unsigned int *)&slot[0] = 1;
+  return true;
+}
+
+void CCheckpoint::release(int iSlot)
+{
+  ((unsigned int *)slotBody(iSlot))[0] = 0;
+  orphan[iSlot] = false;
+}
+
+const char *CCheckpoint::field(int iSlot, int iField)
+{
+  const char *p = slotBody(iSlot) + 12;
+
+  while (iField-- > 0) p += strlen(p) + 1;
+  return p;
+}
+
+// ---------------------------------------------------------------------
+// Per sender output queue
+// ---------------------------------------------------------------------
+CSenderQueue::CSenderQueue(unsigned uiSenderID, int iWeight, CSenderQueue *newNext)
+{
+  this->uiSenderID = uiSenderID;
+  this->iWeight = iWeight;
+  iDeficit = CClientNode::DRR_QUANTUM * iWeight;
+  buf = new CCharBuf();
+  next = newNext;
+}
+
+CSenderQueue::~CSenderQueue()
+{
+  delete buf;
+}
+
+// ---------------------------------------------------------------------
+// ClientNode Stuff
+// ---------------------------------------------------------------------
+CClientNode::CClientNode(const char *szCharName, int iSocketHandle, CClientNode *newNext)
+{
+  bAuthorized = 0;
+  bCmdMode = 0;
+  bLocalEcho = 1;
+  lastWriteError = 0;
+  lastReadError = 0;
+  closeMe = 0;
+  uiCaps = 0;
+  uiRosterVersion = 0;
+  this->szCharName = new char[MAX_CHARNAMELEN];
+  szNBPrefix = new char[MAX_CHARNAMELEN+16];
+  szNBIDPrefix = new char[32];
+  szNBDeltaPrefix = new char[MAX_CHARNAMELEN+16];
+  szNBDeltaIDPrefix = new char[32];
+  szNBPrefix[0] = szNBIDPrefix[0] = 0;
+  szNBDeltaPrefix[0] = szNBDeltaIDPrefix[0] = 0;
+  cmdBuf = new char[CMD_BUFSIZE];
+  memset(cmdBuf, 0, CMD_BUFSIZE);
+  cmdBufUsed=0;
+  this->chanList=NULL;
+  liveTimer = new CTimer(this);
+  ulLastHeard = CClock::msecs();
+  idleTimer = new CTimer(this);
+  ulLastActive = ulLastHeard;
+  ulPingSent = 0;
+  iPreAuthBytes = 0;
+  pInput = NULL;
+  iInputPos = iInputLen = 0;
+  reactor = NULL;
+  iWant = 0;
+  iEvents = 0;
+  bReady = false;
+  nextReady = NULL;
+  ulWakeAt = 0;
+  nextTimed = prevTimed = NULL;
+  iCheckpointSlot = -1;
+  bCheckpointDirty = false;
+
+  uiIDNum = 0;           // given out by the server that accepted us
+
+  strncpy(this->szCharName, szCharName, MAX_CHARNAMELEN-1);
+
+  next = newNext;
+  this->iSocketHandle = iSocketHandle;
+  inBuf = new CCharBuf();
+  outBuf = new CCharBuf();
+  lanes = new CSenderQueue*[LANE_COUNT];
+  laneCursor = new CSenderQueue*[LANE_COUNT];
+  for (int i=0; i < LANE_COUNT; i++) lanes[i] = laneCursor[i] = NULL;
+  iFairWeight = 1;
+  rateLimits = new CTokenBucket[RATE_CLASSES];
+  uiRateDrops = 0;
+  ulRateLogged = 0;
+  textOut = new CStrBuf();
+  zDeflate = NULL;
+  zInflate = NULL;
+  wireOut = NULL;
+  zIn = NULL;
+  iBatchMsecs = 0;
+  bBatchOpen = false;
+  ulBatchStart = 0;
+  batchOut = NULL;
+  frameHdrUsed = 0;
+  frameIn = new CStrBuf();
+  nbLast = new CStrBuf();
+  nbLastParsed = new CNBPacket();
+  uiNBSerial = 0;
+  nbMask = NULL;
+  nbPending = NULL;
+  nbSent = NULL;
+  nbSubList = NULL;
+  nbSubscribers = NULL;
+  nbSubscriberCount = 0;
+  nbSubscriberSize = 0;
+  szResumeToken = NULL;
+  bDetached = false;
+  sentUnit = new CSentUnit();
+  sendRing = NULL;
+  recvRing = NULL;
+  lastChar = '\n'; // force name on next
+}
+
+CClientNode::~CClientNode()
+{
+  if (this->chanList) delete [] this->chanList;
+  delete [] szNBPrefix;
+  delete [] szNBIDPrefix;
+  delete [] szNBDeltaPrefix;
+  delete [] szNBDeltaIDPrefix;
+  if (inBuf) delete inBuf;
+  inBuf = NULL;
+  if (outBuf) delete outBuf;
+  outBuf = NULL;
+  for (int i=0; i < LANE_COUNT; i++) {
+    while (lanes[i]) {
+      CSenderQueue *queue = lanes[i]->next;
+      delete lanes[i];
+      lanes[i] = queue;
+    }
+  }
+  delete [] lanes;
+  delete [] laneCursor;
+  delete [] rateLimits;
+  delete textOut;
+#ifdef EQBCS_ZLIB
+  if (zDeflate) {
+    deflateEnd(zDeflate);
+    delete zDeflate;
+  }
+  if (zInflate) {
+    inflateEnd(zInflate);
+    delete zInflate;
+  }
+#endif
+  if (wireOut) delete wireOut;
+  if (zIn) delete zIn;
+  if (batchOut) delete batchOut;
+  delete sentUnit;
+  delete frameIn;
+  delete nbLast;
+  delete nbLastParsed;
+  while (nbPending) {
+    CNBPending *pending = nbPending->next;
+    delete nbPending;
+    nbPending = pending;
+  }
+  while (nbSent) {
+    CNBSentState *sent = nbSent->next;
+    delete nbSent;
+    nbSent = sent;
+  }
+  if (nbSubList) delete [] nbSubList;
+  if (nbSubscribers) delete [] nbSubscribers;
+  if (szResumeToken) delete [] szResumeToken;
+  delete liveTimer;
+  delete idleTimer;
+}
+
+// ---------------------------------------------------------------------
+// Server text for this client.  v1 gets it as is, v2 gets each line as
+// a control frame once its '\n' arrives.
+// ---------------------------------------------------------------------
+void CClientNode::writeChar(char ch, int iLane, CClientNode *cnFrom)
+{
+  char szChar[2];
+
+  szChar[0] = ch;
+  szChar[1] = 0;
+  writesz(szChar, iLane, cnFrom);
+}
+
+void CClientNode::writesz(const char *szStr, int iLane, CClientNode *cnFrom)
+{
+  const char *pEnd;
+
+  if ((uiCaps & CAP_V2) == 0) {
+    laneBuf(iLane, cnFrom)->writesz(szStr);
+    return;
+  }
+  while (szStr && (pEnd = strchr(szStr, '\n')) != NULL) {
+    textOut->append(szStr, (int)(pEnd - szStr));
+    writeFrame(FRAME_CONTROL, NULL, NULL, textOut->getsz(), textOut->length(), iLane, cnFrom);
+    textOut->clear();
+    szStr = pEnd + 1;
+  }
+  textOut->appendsz(szStr);
+}
+
+// ---------------------------------------------------------------------
+// DEFLATE: one zlib stream each way, starting after the login's ';'
+// ---------------------------------------------------------------------
+bool CClientNode::StartDeflate()
+{
+#ifndef EQBCS_ZLIB
+  // Built without zlib
+  return false;
+#else
+  if (zDeflate) return true;
+
+  zDeflate = new z_stream;
+  memset(zDeflate, 0, sizeof(*zDeflate));
+  zInflate = new z_stream;
+  memset(zInflate, 0, sizeof(*zInflate));
+  if (deflateInit(zDeflate, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    delete zDeflate;
+    zDeflate = NULL;
+  }
+  if (inflateInit(zInflate) != Z_OK) {
+    delete zInflate;
+    zInflate = NULL;
+  }
+  if (zDeflate == NULL || zInflate == NULL) return false;
+
+  wireOut = new CCharBuf();
+  zIn = new CCharBuf();
+  return true;
+#endif
+}
+
+// ---------------------------------------------------------------------
+// Compress everything queued this tick and sync flush it, so a tick's
+// output costs one flush and never waits on the next tick
+// ---------------------------------------------------------------------
+void CClientNode::CompressOut()
+{
+#ifdef EQBCS_ZLIB
+  char inChunk[1024];
+  char outChunk[2048];
+  CCharBuf *src = batchOut ? batchOut : outBuf;
+  int iIn;
+  int iFlush;
+
+  while ((iIn = src->peek(inChunk, sizeof(inChunk))) > 0) {
+    src->skip(iIn);
+    iFlush = src->hasWaiting() ? Z_NO_FLUSH : Z_SYNC_FLUSH;
+    zDeflate->next_in = (Bytef *)inChunk;
+    zDeflate->avail_in = iIn;
+    do {
+      zDeflate->next_out = (Bytef *)outChunk;
+      zDeflate->avail_out = sizeof(outChunk);
+      deflate(zDeflate, iFlush);
+      wireOut->write(outChunk, sizeof(outChunk) - zDeflate->avail_out);
+    } while (zDeflate->avail_out == 0);
+  }
+#endif
+}
+
+// ---------------------------------------------------------------------
+// Bytes queued for this client, compressed or not, less a chat lane
+// DrainLanes is holding back
+// ---------------------------------------------------------------------
+int CClientNode::pendingOut(bool bHoldChat)
+{
+  int iWaiting = lanesWaiting(bHoldChat) + outBuf->waiting() + (batchOut ? batchOut->waiting() : 0) +
+    (wireOut ? wireOut->waiting() : 0);
+
+#ifndef UNIXWIN
+  if (sendRing) iWaiting += sendRing->used();
+#endif
+  return iWaiting;
+}
+
+// ---------------------------------------------------------------------
+// Anything the socket can take now, not counting an unreleased batch
+// ---------------------------------------------------------------------
+bool CClientNode::hasWireOut(bool bHoldChat)
+{
+  if (wireOut && wireOut->hasWaiting()) return true;
+  if (batchOut) return batchOut->hasWaiting() != 0;
+  return outBuf->hasWaiting() || lanesWaiting(bHoldChat);
+}
+
+// ---------------------------------------------------------------------
+// Milliseconds until the open batch is due, -1 if none is open
+// ---------------------------------------------------------------------
+int CClientNode::batchMsecsLeft()
+{
+  unsigned long ulElapsed;
+
+  if (bBatchOpen == false) return -1;
+  ulElapsed = CClock::msecs() - ulBatchStart;
+  return (ulElapsed >= (unsigned long)iBatchMsecs) ? 0 :
+    iBatchMsecs - (int)ulElapsed;
+}
+
+// ---------------------------------------------------------------------
+// Close the batch: everything queued goes to batchOut behind one
+// \tBATCH=<bytes> line, or one BATCH frame per 64K for v2
+// ---------------------------------------------------------------------
+void CClientNode::ReleaseBatch()
+{
+  char chunk[1024];
+  char szHeader[32];
+  int iLen;
+  int iChunk;
+  bool bFull = false;
+
+  while ((iLen = outBuf->waiting()) > 0) {
+    if (uiCaps & CAP_V2) {
+      if (iLen > FRAME_MAXLEN) iLen = FRAME_MAXLEN;
+      bFull = (iLen == FRAME_MAXLEN);
+      batchOut->writeChar((char)FRAME_BATCH);
+      batchOut->writeChar((char)((iLen >> 8) & 0xff));
+      batchOut->writeChar((char)(iLen & 0xff));
+    }
+    else {
+      sprintf(szHeader, "\tBATCH=%d\n", iLen);
+      batchOut->writesz(szHeader);
+    }
+    while (iLen > 0) {
+      iChunk = outBuf->peek(chunk, (iLen < (int)sizeof(chunk)) ? iLen : (int)sizeof(chunk));
+      batchOut->write(chunk, iChunk);
+      outBuf->skip(iChunk);
+      iLen -= iChunk;
+    }
+  }
+  if (bFull) {
+    // A batch ends on a frame short of FRAME_MAXLEN, empty if need be
+    batchOut->writeChar((char)FRAME_BATCH);
+    batchOut->writeChar(0);
+    batchOut->writeChar(0);
+  }
+  bBatchOpen = false;
+}
+
+// ---------------------------------------------------------------------
+// front was taken off the output already and not sent: it goes first
+// again, ahead of whatever is queued for the socket.  Takes front.
+// bPlain: front was never compressed, so with DEFLATE it goes ahead of
+// what is still to be.
+// ---------------------------------------------------------------------
+void CClientNode::PutBack(CCharBuf *front, bool bPlain)
+{
+  char buf[512];
+  int bufUsed;
+  CCharBuf **wire = (zDeflate && bPlain == false) ? &wireOut : batchOut ? &batchOut : &outBuf;
+
+  while ((bufUsed = (*wire)->peek(buf, sizeof(buf))) > 0) {
+    front->write(buf, bufUsed);
+    (*wire)->skip(bufUsed);
+  }
+  delete *wire;
+  *wire = front;
+}
+
+// ---------------------------------------------------------------------
+// Queue a v2 frame.  szFrom and szChannel, when given, go ahead of the
+// data as [length][name].
+// ---------------------------------------------------------------------
+void CClientNode::writeFrame(unsigned char ucType, const char *szFrom,
+  const char *szChannel, const char *pData, int iLen, int iLane, CClientNode *cnFrom)
+{
+  CCharBuf *lane = laneBuf(iLane, cnFrom);
+  int iFromLen = szFrom ? (int)strlen(szFrom) : 0;
+  int iChanLen = szChannel ? (int)strlen(szChannel) : 0;
+  int iTotal;
+
+  if (iFromLen > 255) iFromLen = 255;
+  if (iChanLen > 255) iChanLen = 255;
+  iTotal = (szFrom ? iFromLen+1 : 0) + (szChannel ? iChanLen+1 : 0) + iLen;
+  if (iTotal > FRAME_MAXLEN) {
+    iLen -= iTotal - FRAME_MAXLEN;
+    iTotal = FRAME_MAXLEN;
+  }
+
+  lane->writeChar((char)ucType);
+  lane->writeChar((char)((iTotal >> 8) & 0xff));
+  lane->writeChar((char)(iTotal & 0xff));
+  if (szFrom) {
+    lane->writeChar((char)iFromLen);
+    lane->write(szFrom, iFromLen);
+  }
+  if (szChannel) {
+    lane->writeChar((char)iChanLen);
+    lane->write(szChannel, iChanLen);
+  }
+  lane->write(pData, iLen);
+}
+
+// ---------------------------------------------------------------------
+// The queue for cnFrom's messages in a lane; server messages are sender
+// 0.  Its handler is told there is output.
+// ---------------------------------------------------------------------
+CCharBuf *CClientNode::laneBuf(int iLane, CClientNode *cnFrom)
+{
+  unsigned uiSenderID = cnFrom ? cnFrom->uiIDNum : 0;
+  CSenderQueue *queue;
+
+  if (reactor) reactor->post(this, CReactor::EV_OUT);
+  for (queue = lanes[iLane]; queue != NULL; queue = queue->next) {
+    if (queue->uiSenderID == uiSenderID) return queue->buf;
+  }
+  lanes[iLane] = new CSenderQueue(uiSenderID, cnFrom ? cnFrom->iFairWeight : 1, lanes[iLane]);
+  return lanes[iLane]->buf;
+}
+
+// ---------------------------------------------------------------------
+// Bytes still waiting in the lanes
+// ---------------------------------------------------------------------
+int CClientNode::lanesWaiting(bool bHoldChat)
+{
+  int iWaiting = 0;
+
+  for (int i=0; i < LANE_COUNT; i++) {
+    if (bHoldChat && i == LANE_CHAT) continue;
+    for (CSenderQueue *queue = lanes[i]; queue != NULL; queue = queue->next) {
+      iWaiting += queue->buf->waiting();
+    }
+  }
+  return iWaiting;
+}
+
+// ---------------------------------------------------------------------
+// Length of the next whole message, a v1 line or a v2 frame
+// ---------------------------------------------------------------------
+int CClientNode::messageLength(CCharBuf *src)
+{
+  char header[3];
+
+  if (uiCaps & CAP_V2) {
+    if (src->peek(header, 3) < 3) return src->waiting();
+    return 3 + (((unsigned char)header[1] << 8) | (unsigned char)header[2]);
+  }
+  return src->lineLength();
+}
+
+// ---------------------------------------------------------------------
+// Move one message from a lane to outBuf, deficit round robin by sender.
+// A sender's turn adds its quantum; it sends while its deficit covers
+// the next message, and an emptied queue is dropped with its deficit.
+// ---------------------------------------------------------------------
+bool CClientNode::MoveFairMessage(int iLane)
+{
+  char chunk[1024];
+  CSenderQueue *queue;
+  CSenderQueue **link;
+  int iLen;
+  int iChunk;
+
+  if (lanes[iLane] == NULL) return false;
+
+  for (;;) {
+    queue = laneCursor[iLane];
+    if (queue == NULL) queue = laneCursor[iLane] = lanes[iLane];
+    iLen = messageLength(queue->buf);
+    if (iLen <= queue->iDeficit) break;
+    laneCursor[iLane] = queue->next ? queue->next : lanes[iLane];
+    laneCursor[iLane]->iDeficit += DRR_QUANTUM * laneCursor[iLane]->iWeight;
+  }
+
+  queue->iDeficit -= iLen;
+  while (iLen > 0) {
+    iChunk = queue->buf->peek(chunk, (iLen < (int)sizeof(chunk)) ? iLen : (int)sizeof(chunk));
+    outBuf->write(chunk, iChunk);
+    queue->buf->skip(iChunk);
+    iLen -= iChunk;
+  }
+
+  if (queue->buf->hasWaiting() == 0) {
+    for (link = &lanes[iLane]; *link != queue; link = &(*link)->next);
+    *link = queue->next;
+    laneCursor[iLane] = queue->next;
+    if (laneCursor[iLane]) {
+      laneCursor[iLane]->iDeficit += DRR_QUANTUM * laneCursor[iLane]->iWeight;
+    }
+    delete queue;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------
+// Weighted drain of the lanes into outBuf, while the socket is keeping up
+// ---------------------------------------------------------------------
+void CClientNode::DrainLanes(bool bHoldChat, int iWireBytes)
+{
+  bool bMoved = true;
+  int iLane;
+  int iCount;
+
+  while (bMoved && outBuf->waiting() < iWireBytes) {
+    bMoved = false;
+    for (iLane=0; iLane < LANE_COUNT; iLane++) {
+      if (bHoldChat && iLane == LANE_CHAT) continue;
+      for (iCount=0; iCount < LANE_WEIGHTS[iLane] &&
+        outBuf->waiting() < iWireBytes; iCount++)
+        {
+        if (MoveFairMessage(iLane) == false) break;
+        bMoved = true;
+      }
+    }
+  }
+}
+
+// ---------------------------------------------------------------------
+// RESUME: swap the connection of the new login cn into this session.
+// cn is left with the old socket, if any, and is dropped by the caller.
+// Output already compressed for the old connection goes with it.  A
+// message the old connection was partway through is sent again whole.
+// ---------------------------------------------------------------------
+void CClientNode::TakeConnection(CClientNode *cn)
+{
+  unsigned char hdr[3];
+  int iTemp;
+  char *pTemp;
+  CCharBuf *bufTemp;
+  CStrBuf *strTemp;
+  z_stream *zTemp;
+
+#ifndef UNIXWIN
+  if (sendRing) {
+    // Its writer has the message it was partway through; it comes back
+    // with the ring
+    sendRing->bMoved = true;
+    if (sentUnit == NULL) sentUnit = new CSentUnit();
+  }
+#endif
+  if (sentUnit->sent->length() > 0) {
+    // Never compressed, so it goes ahead of outBuf or batchOut
+    bufTemp = new CCharBuf();
+    bufTemp->write(sentUnit->sent->getsz(), sentUnit->sent->length());
+    PutBack(bufTemp, true);
+  }
+  sentUnit->clear();
+
+  pTemp = pInput; pInput = cn->pInput; cn->pInput = pTemp;
+  iTemp = iInputPos; iInputPos = cn->iInputPos; cn->iInputPos = iTemp;
+  iTemp = iInputLen; iInputLen = cn->iInputLen; cn->iInputLen = iTemp;
+  iTemp = iSocketHandle; iSocketHandle = cn->iSocketHandle; cn->iSocketHandle = iTemp;
+  iTemp = cmdBufUsed; cmdBufUsed = cn->cmdBufUsed; cn->cmdBufUsed = iTemp;
+  iTemp = frameHdrUsed; frameHdrUsed = cn->frameHdrUsed; cn->frameHdrUsed = iTemp;
+  pTemp = cmdBuf; cmdBuf = cn->cmdBuf; cn->cmdBuf = pTemp;
+  bufTemp = inBuf; inBuf = cn->inBuf; cn->inBuf = bufTemp;
+  bufTemp = wireOut; wireOut = cn->wireOut; cn->wireOut = bufTemp;
+  bufTemp = zIn; zIn = cn->zIn; cn->zIn = bufTemp;
+  strTemp = frameIn; frameIn = cn->frameIn; cn->frameIn = strTemp;
+  zTemp = zDeflate; zDeflate = cn->zDeflate; cn->zDeflate = zTemp;
+  zTemp = zInflate; zInflate = cn->zInflate; cn->zInflate = zTemp;
+  memcpy(hdr, frameHdr, 3);
+  memcpy(frameHdr, cn->frameHdr, 3);
+  memcpy(cn->frameHdr, hdr, 3);
+
+  uiCaps = (uiCaps & ~CAP_DEFLATE) | (cn->uiCaps & CAP_DEFLATE);
+  bCmdMode = cn->bCmdMode;
+  lastChar = cn->lastChar;
+  lastReadError = 0;
+  lastWriteError = 0;
+  closeMe = 0;
+  bDetached = false;
+  ulLastHeard = CClock::msecs();
+}
+
+// ---------------------------------------------------------------------
+// Eqbcs Stuff
+// ---------------------------------------------------------------------
+CEqbcs::CEqbcs()
+{
+  amRunning = 0;
+  clientList = NULL;
+  listenBuf = NULL;
+  iServerHandle = -1;
+  iExitNow = 0;
+  iSigHupCaught = 0;
+  iUpgradeCaught = 0;
+  iUpgradeFd = -1;
+  upgradeArgv = NULL;
+  iPort = DEFAULT_PORT;
+  iAddr=INADDR_ANY;
+  bNetBotChanges = false;
+  uiRosterVersion = 0;
+  bRosterCacheValid = false;
+  rosterNames = new CStrBuf();
+  rosterDelta = new CStrBuf();
+  notifyLines = new CStrBuf();
+  bNotifyPending = false;
+  ulNotifyStart = 0;
+  idLines = new CStrBuf();
+  lineIn = new CStrBuf();
+  nbDelta = new CStrBuf();
+  bNBSubsDirty = true;
+  uiNBSerial = 0;
+  fieldMasks = NULL;
+  senderWeights = NULL;
+  configWeights = NULL;
+  szConfigFile = NULL;
+  tune.iMaxClients = MAX_CLIENTS;
+  tune.iBacklog = LISTEN_BACKLOG;
+  tune.iIdleWakeMsecs = IDLE_WAKE_MSECS;
+  tune.iPingSecs = CClientNode::PING_SECONDS;
+  tune.iPongTimeoutSecs = CClientNode::PONG_TIMEOUT_SECS;
+  timers = new CTimerWheel();
+  reactor = new CReactor();
+  inputPool = new CBlockPool(INPUT_BLOCK_BYTES);
+  tune.iLoginSecs = 0;
+  tune.iMaxPending = 0;
+  tune.iMaxPreAuthBytes = 0;
+  uiLoginsRejected = 0;
+  for (int i=0; i < CClientNode::RATE_CLASSES; i++) tune.iRates[i] = 0;
+  tune.iRateMode = RATE_DELAY;
+  tune.iOverloadLagMsecs = 0;
+  tune.iOverloadQueueBytes = 0;
+  tune.iNotifyMsecs = NOTIFY_BATCH_MSECS;
+  tune.iIdleSecs = 0;
+  tune.iNBConflateBytes = CClientNode::NB_CONFLATE_BYTES;
+  tune.iLaneWireBytes = CClientNode::LANE_WIRE_BYTES;
+  tune.iReaders = 0;
+  tune.iWriters = 0;
+  tune.iStatsSecs = 0;
+#ifndef UNIXWIN
+  readers = NULL;
+  writers = NULL;
+  recvQueue = NULL;
+  sendQueue = NULL;
+  retiredRecv = NULL;
+  retiredSend = NULL;
+#endif
+  ulStatsStart = 0;
+  ulBytesIn = ulMsgsIn = 0;
+  ulPasses = ulBusyMsecs = 0;
+  ulBytesOut = 0;
+  iOverloadLevel = OVERLOAD_NONE;
+  ulOverloadSince = 0;
+  iLoopLagMsecs = 0;
+  uiOverloadChanges = 0;
+  uiNBDropped = 0;
+  szCheckpointFile = NULL;
+  checkpoint = NULL;
+  bCheckpointDirty = false;
+  ulCheckpointLast = 0;
+  ulStartMsecs = CClock::msecs();
+  iWatchdogMsecs = 0;
+  ulWatchdogLast = 0;
+  uiNextIDNum = 0;
+  uiAccepted = 0;
+  iPeakClients = 0;
+  szRealmName = NULL;
+  realms = NULL;
+  bLogShared = false;
+  bLogLineStart = true;
+  iWakeFds[0] = iWakeFds[1] = -1;
+  ulLoopMsecs = 0;
+  listenBufOn = true;
+  LogFile=stdout;
+}
+
+CEqbcs::~CEqbcs()
+{
+  CClientNode *cn;
+
+  StopStages();
+  for (cn = clientList; cn != NULL; cn = cn->next) {
+    cn->closeMe = 1;
+  }
+  CloseAllSockets();
+  CSockio::vShutdownSockets();
+  CClientNode *cn_next=NULL;
+  for (cn = clientList; cn != NULL; cn = cn_next) {
+    cn_next = cn->next;
+    StopHandler(cn);
+    ReleaseInput(cn);
+    delete cn;
+  }
+  delete rosterNames;
+  delete rosterDelta;
+  delete notifyLines;
+  delete idLines;
+  delete lineIn;
+  delete nbDelta;
+  delete timers;
+  delete reactor;
+  delete inputPool;
+  if (checkpoint) delete checkpoint;
+  while (fieldMasks) {
+    CNBFieldMask *mask = fieldMasks->next;
+    delete fieldMasks;
+    fieldMasks = mask;
+  }
+  FreeWeights(senderWeights);
+  FreeWeights(configWeights);
+  while (realms) {
+    CRealm *realm = realms->next;
+    delete realms;
+    realms = realm;
+  }
+}
+
+// ---------------------------------------------------------------------
+// Initiliaze Networking and Bind To Port
+// ---------------------------------------------------------------------
+int CEqbcs::NET_initServer(int iPort, struct sockaddr_in *sockAddress)
+{
+  // return handle to server, or -1 on error
+  int socketOpt = 1;
+  int iHandle = 1;
+
+  if (CSockio::iStartupSockets(EQBCS_TraceSockets) != 0) {
+    perror("Failed to create winsock");
+  }
+
+  if ((iHandle = PassedListenSocket()) != -1) {
+    return iHandle;
+  }
+
+  if ((iHandle = (int)socket(AF_INET,SOCK_STREAM,0))==0) {
+    // if socket failed then display error and exit
+    perror("Create master_socket");
+    return -1;
+  }
+
+  // multi connections
+  if (setsockopt(iHandle, SOL_SOCKET, SO_REUSEADDR,
+    (char *)&socketOpt, sizeof(socketOpt))<0)
+    {
+    CSockio::iCloseSock(iServerHandle, 1, 1, EQBCS_TraceSockets);
+    perror("setsockopt");
+    return -1;
+  }
+
+  sockAddress->sin_family = AF_INET;
+  sockAddress->sin_addr.s_addr = iAddr;
+  sockAddress->sin_port = htons((unsigned short)iPort);
+
+  if (bind(iHandle, (struct sockaddr *)sockAddress,
+    sizeof(struct sockaddr_in))<0)
+    {
+    // if bind failed then display error message and exit
+     perror("bind");
+  }
+
+  if (listen(iHandle, tune.iBacklog)<0) {
+    perror("listen");
+  }
+
+  return iHandle;
+}
+
+// ---------------------------------------------------------------------
+// IDs go out on the wire to NBID clients, so keep them short.
+// ---------------------------------------------------------------------
+unsigned CEqbcs::NextIDNum()
+{
+  if (uiNextIDNum == 0) {
+    uiNextIDNum = rand() % 1000; // rand sucks.
+  }
+  return ++uiNextIDNum;
+}
+
+// ---------------------------------------------------------------------
+// Count the clients (Active and Inactive)
+// ---------------------------------------------------------------------
+int CEqbcs::countClients(void)
+{
+  int count = 0;
+
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    count++;
+  }
+
+  return count;
+}
+
+// ---------------------------------------------------------------------
+// Connections that have not logged in yet
+// ---------------------------------------------------------------------
+int CEqbcs::countPending(void)
+{
+  int count = 0;
+
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->bAuthorized == false && cn->closeMe == 0) count++;
+  }
+
+  return count;
+}
+
+// ---------------------------------------------------------------------
+// Turn away a connection that has not logged in
+// ---------------------------------------------------------------------
+void CEqbcs::RejectLogin(CClientNode *cn, const char *szWhy)
+{
+  char buf[256];
+  int iBytesWrote;
+
+  uiLoginsRejected++;
+  sprintf(buf, "-- Login rejected on fd %d: %s (%u so far).\n",
+    cn->iSocketHandle, szWhy, uiLoginsRejected);
+  WriteLocalString(buf);
+  sprintf(buf, "Denied - %s", szWhy);
+  CSockio::iWriteSock(cn->iSocketHandle, buf, (int)strlen(buf), &iBytesWrote);
+  cn->closeMe = 1;
+}
+
+// ---------------------------------------------------------------------
+// Get max file descriptor (for select in win32)
+// ---------------------------------------------------------------------
+int CEqbcs::getMaxFD()
+{
+  int max = iServerHandle;
+
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->closeMe == 0) {
+      max = (cn->iSocketHandle > max) ? cn->iSocketHandle : max;
+    }
+  }
+
+  return (max < 0) ? 1 : max+1;
+}
+
+
+// ---------------------------------------------------------------------
+// Write Local Char - one char to local buffer
+// ---------------------------------------------------------------------
+
+void CEqbcs::WriteLocalChar(char ch)
+{
+  if (listenBuf && listenBufOn) {
+    listenBuf->writeChar(ch);
+  }
+}
+
+// ---------------------------------------------------------------------
+// Send String to local only
+// ---------------------------------------------------------------------
+
+void CEqbcs::WriteLocalString(const char *szStr)
+{
+  while (*szStr) {
+    WriteLocalChar(*szStr);
+    szStr++;
+  }
+}
+
+// ---------------------------------------------------------------------
+// Relay a line to every client.  MSGALL skips the sender and shows each
+// v1 recipient its own name after the sender's.
+// ---------------------------------------------------------------------
+void CEqbcs::RelayBroadcast(CClientNode *cn, int iMsgType, const char *szText)
+{
+  bool bMsgAll = (iMsgType == CClientNode::MSG_TYPE_MSGALL);
+
+  WriteLocalChar('<');
+  WriteLocalString(cn->szCharName);
+  WriteLocalString("> ");
+  if (bMsgAll) WriteLocalString(" [*ALL*] ");
+  WriteLocalString(szText);
+  WriteLocalChar('\n');
+
+  for (CClientNode *cn_to=clientList; cn_to != NULL; cn_to = cn_to->next) {
+    if (cn_to->bAuthorized && cn_to->closeMe == 0 && cn_to->iSocketHandle >= 0 &&
+      (bMsgAll == false || cn_to != cn))
+      {
+      if (cn_to->uiCaps & CClientNode::CAP_V2) {
+        cn_to->writeFrame(CClientNode::FRAME_BROADCAST, cn->szCharName, NULL,
+          szText, (int)strlen(szText), CClientNode::LANE_CHAT, cn);
+      }
+      else {
+        cn_to->writeChar('<', CClientNode::LANE_CHAT, cn);
+        cn_to->writesz(cn->szCharName, CClientNode::LANE_CHAT, cn);
+        cn_to->writesz("> ", CClientNode::LANE_CHAT, cn);
+        if (bMsgAll) {
+          cn_to->writeChar(' ', CClientNode::LANE_CHAT, cn);
+          cn_to->writesz(cn_to->szCharName, CClientNode::LANE_CHAT, cn);
+          cn_to->writeChar(' ', CClientNode::LANE_CHAT, cn);
+        }
+        cn_to->writesz(szText, CClientNode::LANE_CHAT, cn);
+        cn_to->writeChar('\n', CClientNode::LANE_CHAT, cn);
+      }
+    }
+  }
+}
+
+// ---------------------------------------------------------------------
+// Build the space separated roster once, shared by every recipient
+// ---------------------------------------------------------------------
+void CEqbcs::BuildRosterCache()
+{
+  if (bRosterCacheValid) return;
+
+  rosterNames->clear();
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->bAuthorized && cn->closeMe == 0 && cn->iSocketHandle >= 0) {
+      if (rosterNames->length()) rosterNames->appendChar(' ');
+      rosterNames->appendsz(cn->szCharName);
+    }
+  }
+  bRosterCacheValid = true;
+}
+
+// ---------------------------------------------------------------------
+// Send Net Bot Send List to this client
+// ---------------------------------------------------------------------
+void CEqbcs::SendNetBotSendList(CClientNode *cnSend)
+{
+  BuildRosterCache();
+  cnSend->writesz("\tNBCLIENTLIST=");
+  cnSend->writesz(rosterNames->getsz());
+  cnSend->writesz("\n");
+}
+
+// ---------------------------------------------------------------------
+// Send the versioned roster to a ROSTER capable client
+// ---------------------------------------------------------------------
+void CEqbcs::SendNetBotRoster(CClientNode *cnSend)
+{
+  char szVersion[16];
+
+  BuildRosterCache();
+  sprintf(szVersion, "%u", uiRosterVersion);
+  cnSend->writesz("\tNBROSTER=");
+  cnSend->writesz(szVersion);
+  if (rosterNames->length()) {
+    cnSend->writeChar(' ');
+    cnSend->writesz(rosterNames->getsz());
+  }
+  cnSend->writesz("\n");
+  cnSend->uiRosterVersion = uiRosterVersion;
+}
+
+// ---------------------------------------------------------------------
+// Record a join (+) or quit (-) for the next roster delta
+// ---------------------------------------------------------------------
+void CEqbcs::NoteRosterChange(char chOp, const char *szName)
+{
+  rosterDelta->appendChar(' ');
+  rosterDelta->appendChar(chOp);
+  rosterDelta->appendsz(szName);
+  bRosterCacheValid = false;
+  bNetBotChanges = true;
+  StartNotifyWindow();
+}
+
+// ---------------------------------------------------------------------
+// Open the notification window on the first join/quit of a batch
+// ---------------------------------------------------------------------
+void CEqbcs::StartNotifyWindow()
+{
+  if (bNotifyPending == false) {
+    bNotifyPending = true;
+    ulNotifyStart = CClock::msecs();
+  }
+}
+
+// ---------------------------------------------------------------------
+// Milliseconds until the pending batch is due, -1 if nothing pending
+// ---------------------------------------------------------------------
+int CEqbcs::NotifyMsecsLeft()
+{
+  unsigned long ulElapsed;
+
+  if (bNotifyPending == false) return -1;
+  ulElapsed = CClock::msecs() - ulNotifyStart;
+  return (ulElapsed >= (unsigned long)tune.iNotifyMsecs) ? 0 :
+    tune.iNotifyMsecs - (int)ulElapsed;
+}
+
+// ---------------------------------------------------------------------
+// Notify Net Bot Changes, if any
+// ---------------------------------------------------------------------
+void CEqbcs::NotifyNetBotChanges(bool bNow)
+{
+  // Joins and quits are held until the batch window closes, so a burst
+  // of logins costs one notification per recipient.  NBBATCH clients get
+  // the ordered changes on one line, the rest the pre-rendered NBJOIN and
+  // NBQUIT lines.  ROSTER clients that are current get only the delta,
+  // which applies to the version before it.  Everyone else gets the
+  // full list.  bNow sends them without waiting for the window.
+  char szVersion[16];
+  int iLeft = NotifyMsecsLeft();
+
+  if (iLeft < 0 || (iLeft > 0 && bNow == false)) return;
+
+  FlushNetBotIDs();
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->bAuthorized && cn->closeMe == 0 && cn->iSocketHandle >= 0) {
+      if ((cn->uiCaps & CClientNode::CAP_NBBATCH) == 0) {
+        cn->writesz(notifyLines->getsz());
+      }
+      else if (rosterDelta->length()) {
+        cn->writesz("\tNBCHANGES=");
+        cn->writesz(rosterDelta->getsz()+1);
+        cn->writesz("\n");
+      }
+    }
+  }
+  notifyLines->clear();
+  bNotifyPending = false;
+
+  if (bNetBotChanges) {
+    uiRosterVersion++;
+    sprintf(szVersion, "%u", uiRosterVersion);
+    for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+      if (cn->bAuthorized && cn->closeMe == 0 && cn->iSocketHandle >= 0) {
+        if ((cn->uiCaps & CClientNode::CAP_ROSTER) == 0) {
+          SendNetBotSendList(cn);
+        }
+        else if (cn->uiRosterVersion+1 == uiRosterVersion) {
+          cn->writesz("\tNBROSTERDELTA=");
+          cn->writesz(szVersion);
+          cn->writesz(rosterDelta->getsz());
+          cn->writesz("\n");
+          cn->uiRosterVersion = uiRosterVersion;
+        }
+        else {
+          SendNetBotRoster(cn);
+        }
+      }
+    }
+    rosterDelta->clear();
+    bNetBotChanges = false;
+  }
+}
+
+// ---------------------------------------------------------------------
+// Render the NBPKT prefixes once, when the name is final
+// ---------------------------------------------------------------------
+void CEqbcs::SetNetBotPrefixes(CClientNode *cn)
+{
+  sprintf(cn->szNBPrefix, "\tNBPKT:%s:", cn->szCharName);
+  sprintf(cn->szNBIDPrefix, "\tNBI:%u:", cn->uiIDNum);
+  sprintf(cn->szNBDeltaPrefix, "\tNBDELTA:%s:", cn->szCharName);
+  sprintf(cn->szNBDeltaIDPrefix, "\tNBDI:%u:", cn->uiIDNum);
+}
+
+// ---------------------------------------------------------------------
+// Send every current name<->ID binding to a new NBID client
+// ---------------------------------------------------------------------
+void CEqbcs::SendNetBotIDs(CClientNode *cnSend)
+{
+  char szID[16];
+
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->bAuthorized && cn->closeMe == 0 && cn->iSocketHandle >= 0) {
+      sprintf(szID, "%u ", cn->uiIDNum);
+      cnSend->writesz("\tNBID=");
+      cnSend->writesz(szID);
+      cnSend->writesz(cn->szCharName);
+      cnSend->writesz("\n");
+    }
+  }
+}
+
+// ---------------------------------------------------------------------
+// Announce pending bindings to NBID clients.  Done with the join batch,
+// or earlier if a packet is about to use one of the new IDs.
+// ---------------------------------------------------------------------
+void CEqbcs::FlushNetBotIDs()
+{
+  if (idLines->length() == 0) return;
+
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->bAuthorized && cn->closeMe == 0 && cn->iSocketHandle >= 0 &&
+      (cn->uiCaps & CClientNode::CAP_NBID))
+      {
+      cn->writesz(idLines->getsz());
+    }
+  }
+  idLines->clear();
+}
+
+// ---------------------------------------------------------------------
+// Relay a NetBots packet.  The body is kept once and each recipient gets
+// the sender's pre-rendered name or ID prefix.
+// ---------------------------------------------------------------------
+void CEqbcs::RelayNetBotPacket(CClientNode *cn, const char *pBody, int iLen)
+{
+  cn->nbLast->clear();
+  cn->nbLast->append(pBody, iLen);
+  cn->nbLast->appendChar('\n');
+  cn->nbLastParsed->parse(cn->nbLast->getsz());
+  cn->uiNBSerial = ++uiNBSerial;
+
+  FlushNetBotIDs();
+  RebuildNetBotSubscribers();
+  for (int i=0; i < cn->nbSubscriberCount; i++) {
+    CClientNode *cn_to = cn->nbSubscribers[i];
+    if (cn_to->bAuthorized && cn_to->closeMe == 0 && cn_to->iSocketHandle >= 0) {
+      if (cn_to->nbPending || iOverloadLevel >= OVERLOAD_CONFLATE ||
+        cn_to->pendingOut() >= tune.iNBConflateBytes)
+        {
+        QueueConflated(cn_to, cn);
+      }
+      else {
+        WriteNetBotPacket(cn_to, cn, false);
+      }
+    }
+  }
+}
+
+// ---------------------------------------------------------------------
+// Does cn_to's NBSUB list take packets from cnFrom?  Entries are sender
+// names or channels the sender has joined; no list means everyone.
+// ---------------------------------------------------------------------
+bool CEqbcs::WantsNetBotsFrom(CClientNode *cn_to, CClientNode *cnFrom)
+{
+  char szSubs[2048];
+  char szChans[2048];
+  char *subToken;
+  char *subNext;
+  char *chanToken;
+  char *chanNext;
+
+  if (cn_to->nbSubList == NULL) return true;
+
+  strncpy(szSubs, cn_to->nbSubList, sizeof(szSubs)-1);
+  szSubs[sizeof(szSubs)-1] = 0;
+  for (subToken = strtok_r(szSubs, " \n", &subNext); subToken != NULL;
+    subToken = strtok_r(NULL, " \n", &subNext))
+    {
+    if (strcasecmp(subToken, cnFrom->szCharName) == 0) return true;
+    if (cnFrom->chanList == NULL) continue;
+    strncpy(szChans, cnFrom->chanList, sizeof(szChans)-1);
+    szChans[sizeof(szChans)-1] = 0;
+    for (chanToken = strtok_r(szChans, " \n", &chanNext); chanToken != NULL;
+      chanToken = strtok_r(NULL, " \n", &chanNext))
+      {
+      if (strcasecmp(subToken, chanToken) == 0) return true;
+    }
+  }
+
+  return false;
+}
+
+// ---------------------------------------------------------------------
+// Rebuild each sender's subscriber set, after a login, logout, channel
+// or NBSUB change.  Relaying then only touches interested clients.
+// ---------------------------------------------------------------------
+void CEqbcs::RebuildNetBotSubscribers()
+{
+  int count;
+
+  if (bNBSubsDirty == false) return;
+
+  count = countClients();
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->nbSubscriberSize < count) {
+      if (cn->nbSubscribers) delete [] cn->nbSubscribers;
+      cn->nbSubscriberSize = count;
+      cn->nbSubscribers = new CClientNode*[count];
+    }
+    cn->nbSubscriberCount = 0;
+    for (CClientNode *cn_to=clientList; cn_to != NULL; cn_to = cn_to->next) {
+      if (cn_to->bAuthorized && cn_to->closeMe == 0 && WantsNetBotsFrom(cn_to, cn)) {
+        cn->nbSubscribers[cn->nbSubscriberCount++] = cn_to;
+      }
+    }
+  }
+  bNBSubsDirty = false;
+}
+
+// ---------------------------------------------------------------------
+// Point a client at the shared mask for szKeys (space or comma
+// separated), or at none for "*" or an empty list.
+// ---------------------------------------------------------------------
+void CEqbcs::SetNetBotFields(CClientNode *cn, const char *szKeys)
+{
+  char szNormal[1024];
+  int i = 0;
+  CNBFieldMask *mask;
+  CNBFieldMask *mask_last = NULL;
+
+  for (; *szKeys && i < (int)sizeof(szNormal)-1; szKeys++) {
+    if (*szKeys == ' ' || *szKeys == ',') {
+      if (i && szNormal[i-1] != ',') szNormal[i++] = ',';
+    }
+    else {
+      szNormal[i++] = *szKeys;
+    }
+  }
+  if (i && szNormal[i-1] == ',') i--;
+  szNormal[i] = 0;
+  MarkCheckpoint(cn);
+
+  if (cn->nbMask) {
+    if (--cn->nbMask->iRefs == 0) {
+      for (mask = fieldMasks; mask != cn->nbMask; mask_last = mask, mask = mask->next);
+      if (mask_last) mask_last->next = mask->next;
+      else fieldMasks = mask->next;
+      delete mask;
+    }
+    cn->nbMask = NULL;
+  }
+
+  if (szNormal[0] == 0 || strcmp(szNormal, "*") == 0) return;
+
+  for (mask = fieldMasks; mask != NULL; mask = mask->next) {
+    if (strcmp(mask->szKeys, szNormal) == 0) break;
+  }
+  if (mask == NULL) {
+    mask = fieldMasks = new CNBFieldMask(szNormal, fieldMasks);
+  }
+  mask->iRefs++;
+  cn->nbMask = mask;
+}
+
+// ---------------------------------------------------------------------
+// NBFIELDS command: NBFIELDS key ... to pick fields, NBFIELDS * for all
+// ---------------------------------------------------------------------
+void CEqbcs::CmdNetBotFields(CClientNode *cn)
+{
+  SetNetBotFields(cn, &cn->cmdBuf[8]);
+
+  cn->writesz("-- NetBots fields: ");
+  cn->writesz(cn->nbMask ? cn->nbMask->szKeys : "*ALL*");
+  cn->writesz("\n");
+}
+
+// ---------------------------------------------------------------------
+// NBSUB command: NBSUB name|channel ... to pick senders, NBSUB * for all
+// ---------------------------------------------------------------------
+void CEqbcs::CmdNetBotSubscribe(CClientNode *cn)
+{
+  const char *szList = &cn->cmdBuf[5];
+
+  while (*szList == ' ') szList++;
+  if (cn->nbSubList) delete [] cn->nbSubList;
+  cn->nbSubList = NULL;
+  if (*szList && strcmp(szList, "*") != 0) {
+    cn->nbSubList = new char[strlen(szList)+1];
+    strcpy(cn->nbSubList, szList);
+  }
+  bNBSubsDirty = true;
+  MarkCheckpoint(cn);
+
+  cn->writesz("-- NetBots from: ");
+  cn->writesz(cn->nbSubList ? cn->nbSubList : "*ALL*");
+  cn->writesz("\n");
+}
+
+// ---------------------------------------------------------------------
+// Changed fields of pNew as key=value|key=value.  Returns false when the
+// packets differ in shape and a keyframe has to be sent instead.
+// ---------------------------------------------------------------------
+bool CEqbcs::BuildNetBotDelta(CNBPacket *pOld, CNBPacket *pNew, CStrBuf *out)
+{
+  int i;
+
+  out->clear();
+  if (pOld->bOverflow || pNew->bOverflow || pOld->iFields != pNew->iFields) {
+    return false;
+  }
+
+  for (i=0; i < pNew->iFields; i++) {
+    if (pOld->fieldLen[i] == pNew->fieldLen[i] &&
+      memcmp(pOld->fieldStart[i], pNew->fieldStart[i], pNew->fieldLen[i]) == 0)
+      {
+      continue;
+    }
+    // Only key=value fields can be applied by key
+    if (pNew->keyLen[i] < 0 || pOld->keyLen[i] != pNew->keyLen[i] ||
+      memcmp(pOld->fieldStart[i], pNew->fieldStart[i], pNew->keyLen[i]) != 0)
+      {
+      return false;
+    }
+    if (out->length()) out->appendChar('|');
+    out->append(pNew->fieldStart[i], pNew->fieldLen[i]);
+  }
+
+  return true;
+}
+
+// ---------------------------------------------------------------------
+// Queue cnFrom's latest packet for cn_to in the form cn_to asked for:
+// NBPKT by name or NBI by ID, only its NBFIELDS, and for NBDELTA clients
+// only the fields that changed since the last packet they got from
+// cnFrom.  v2 clients get the same as an NBPKT or NBDELTA frame.
+// ---------------------------------------------------------------------
+void CEqbcs::WriteNetBotPacket(CClientNode *cn_to, CClientNode *cnFrom, bool bSnapshot)
+{
+  bool bKeyframe = bSnapshot;
+  // A snapshot stays in one queue, in order with its count line
+  CClientNode *cnQueue = bSnapshot ? NULL : cnFrom;
+  bool bUseID = (cn_to->uiCaps & CClientNode::CAP_NBID) != 0;
+  bool bDelta = false;
+  char szID[16];
+  CNBSentState *sent = NULL;
+  CStrBuf *body = cnFrom->nbLast;
+  CNBPacket *parsed = cnFrom->nbLastParsed;
+  CNBFieldMask *mask = cn_to->nbMask;
+
+  if (mask) {
+    // Filtered once per mask, not once per recipient
+    if (mask->uiCachedSerial != cnFrom->uiNBSerial) {
+      mask->filter(cnFrom->nbLastParsed);
+      mask->uiCachedSerial = cnFrom->uiNBSerial;
+    }
+    body = mask->filtered;
+    parsed = mask->filteredParsed;
+  }
+
+  if (cn_to->uiCaps & CClientNode::CAP_NBDELTA) {
+    for (sent = cn_to->nbSent; sent != NULL; sent = sent->next) {
+      if (sent->uiSenderID == cnFrom->uiIDNum) break;
+    }
+    if (sent == NULL) {
+      sent = cn_to->nbSent = new CNBSentState(cnFrom->uiIDNum, cn_to->nbSent);
+      bKeyframe = true;
+    }
+    if (bKeyframe || ++sent->iSinceKey >= CClientNode::NB_KEYFRAME_EVERY ||
+      BuildNetBotDelta(sent->parsed, parsed, nbDelta) == false)
+      {
+      sent->iSinceKey = 0;
+    }
+    else {
+      bDelta = true;
+    }
+  }
+
+  if (cn_to->uiCaps & CClientNode::CAP_V2) {
+    // No trailing '\n' inside a frame
+    sprintf(szID, "%u", cnFrom->uiIDNum);
+    if (bDelta) {
+      cn_to->writeFrame(CClientNode::FRAME_NBDELTA, bUseID ? szID : cnFrom->szCharName,
+        NULL, nbDelta->getsz(), nbDelta->length(), CClientNode::LANE_BULK, cnQueue);
+    }
+    else {
+      cn_to->writeFrame(CClientNode::FRAME_NBPKT, bUseID ? szID : cnFrom->szCharName,
+        NULL, body->getsz(), body->length()-1, CClientNode::LANE_BULK, cnQueue);
+    }
+  }
+  else if (bDelta) {
+    cn_to->writesz(bUseID ? cnFrom->szNBDeltaIDPrefix : cnFrom->szNBDeltaPrefix, CClientNode::LANE_BULK, cnQueue);
+    cn_to->writesz(nbDelta->getsz(), CClientNode::LANE_BULK, cnQueue);
+    cn_to->writeChar('\n', CClientNode::LANE_BULK, cnQueue);
+  }
+  else {
+    cn_to->writesz(bUseID ? cnFrom->szNBIDPrefix : cnFrom->szNBPrefix, CClientNode::LANE_BULK, cnQueue);
+    cn_to->writesz(body->getsz(), CClientNode::LANE_BULK, cnQueue);
+  }
+
+  if (sent) {
+    sent->last->clear();
+    sent->last->appendsz(body->getsz());
+    sent->parsed->parse(sent->last->getsz());
+  }
+}
+
+// ---------------------------------------------------------------------
+// Drop the NBDELTA state every client keeps for a departed sender
+// ---------------------------------------------------------------------
+void CEqbcs::ForgetNetBotSender(unsigned uiSenderID)
+{
+  CNBSentState *sent;
+  CNBSentState *sent_last;
+
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    sent_last = NULL;
+    for (sent = cn->nbSent; sent != NULL; sent_last = sent, sent = sent->next) {
+      if (sent->uiSenderID == uiSenderID) {
+        if (sent_last) sent_last->next = sent->next;
+        else cn->nbSent = sent->next;
+        delete sent;
+        break;
+      }
+    }
+  }
+}
+
+// ---------------------------------------------------------------------
+// Client is behind: remember only that cnFrom has a newer packet, the
+// packet itself is taken from cnFrom->nbLast when the client catches up.
+// ---------------------------------------------------------------------
+void CEqbcs::QueueConflated(CClientNode *cn_to, CClientNode *cnFrom)
+{
+  CNBPending *pending;
+  CNBPending *last = NULL;
+
+  for (pending = cn_to->nbPending; pending != NULL; pending = pending->next) {
+    if (pending->uiSenderID == cnFrom->uiIDNum) {
+      uiNBDropped++;
+      return;
+    }
+    last = pending;
+  }
+
+  pending = new CNBPending;
+  pending->uiSenderID = cnFrom->uiIDNum;
+  pending->next = NULL;
+  if (last) last->next = pending;
+  else cn_to->nbPending = pending;
+  reactor->post(cn_to, CReactor::EV_OUT);
+}
+
+// ---------------------------------------------------------------------
+// Queue the latest packet of each conflated sender, once there is room
+// ---------------------------------------------------------------------
+void CEqbcs::DrainConflated(CClientNode *cn_to)
+{
+  CNBPending *pending;
+  CClientNode *cnFrom;
+
+  if (iOverloadLevel >= OVERLOAD_DROP_NB) return;
+  while (cn_to->nbPending && cn_to->pendingOut() < tune.iNBConflateBytes) {
+    pending = cn_to->nbPending;
+    for (cnFrom = clientList; cnFrom != NULL; cnFrom = cnFrom->next) {
+      if (cnFrom->uiIDNum == pending->uiSenderID) break;
+    }
+    if (cnFrom && cnFrom->closeMe == 0 && cnFrom->nbLast->length()) {
+      WriteNetBotPacket(cn_to, cnFrom, false);
+    }
+    cn_to->nbPending = pending->next;
+    delete pending;
+  }
+}
+
+// ---------------------------------------------------------------------
+// Snapshot command: the latest packet of every sender, then a count
+// ---------------------------------------------------------------------
+void CEqbcs::CmdSnapshot(CClientNode *cn_to)
+{
+  char szCount[32];
+  int count = 0;
+
+  FlushNetBotIDs();
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->bAuthorized && cn->closeMe == 0 && cn->iSocketHandle >= 0 &&
+      cn->nbLast->length() && WantsNetBotsFrom(cn_to, cn))
+      {
+      WriteNetBotPacket(cn_to, cn, true);
+      count++;
+    }
+  }
+  sprintf(szCount, "\tNBSNAPSHOT=%d\n", count);
+  // Behind the packets it counts
+  cn_to->writesz(szCount, CClientNode::LANE_BULK);
+}
+
+// ---------------------------------------------------------------------
+// Notify Net Bot Client Join
+// ---------------------------------------------------------------------
+void CEqbcs::NotifyClientJoin(char *szName)
+{
+  if (szName != NULL && *szName !=0)
+  {
+    notifyLines->appendsz("\tNBJOIN=");
+    notifyLines->appendsz(szName);
+    notifyLines->appendsz("\n");
+    StartNotifyWindow();
+  }
+}
+
+// ---------------------------------------------------------------------
+// Notify Net Bot Client Quit
+// ---------------------------------------------------------------------
+void CEqbcs::NotifyClientQuit(char *szName)
+{
+  if (szName != NULL && *szName !=0)
+  {
+    notifyLines->appendsz("\tNBQUIT=");
+    notifyLines->appendsz(szName);
+    notifyLines->appendsz("\n");
+    StartNotifyWindow();
+  }
+}
+
+// ---------------------------------------------------------------------
+// Add new incoming client
+// ---------------------------------------------------------------------
+void CEqbcs::HandleNewClient(struct sockaddr_in *sockAddress)
+{
+  // Open the new socket as 'new_socket'
+  char buf[256];
+  int iSocketHandle;
+  int iBytesWrote;
+  int addrlen=sizeof(*sockAddress);
+  const char *loginName = "--LOGIN--";
+
+  iSocketHandle = (int)accept((unsigned)iServerHandle, (struct sockaddr *)sockAddress, (socklen_t *)&addrlen);
+
+  if (iSocketHandle < 0) {
+    perror("Failed to connect new client - accept");
+    return;
+  }
+
+  if (countClients() < tune.iMaxClients && (tune.iMaxPending == 0 || countPending() < tune.iMaxPending)) {
+    if (CSockio::iSetNonBlocking(iSocketHandle) != CSockio::OKAY) {
+      perror("Failed to make client socket non-blocking");
+    }
+    sprintf((char *)buf, "-- Client connection: fd %d\n", iSocketHandle);
+    WriteLocalString(buf);
+
+    clientList = new CClientNode(loginName, iSocketHandle, clientList);
+    clientList->uiIDNum = NextIDNum();
+    StartHandler(clientList);
+    uiAccepted++;
+    if (countClients() > iPeakClients) iPeakClients = countClients();
+    if (tune.iLoginSecs > 0) {
+      timers->add(clientList->liveTimer, CClientNode::TIMER_LOGIN, tune.iLoginSecs*1000);
+    }
+  }
+  else {
+    uiLoginsRejected++;
+    if (countClients() < tune.iMaxClients) {
+      sprintf(buf, "-- Incoming client rejected -- too many logins pending (%u so far)\n",
+        uiLoginsRejected);
+      WriteLocalString(buf);
+      sprintf(buf, (char *)"Denied - too many logins pending");
+    }
+    else {
+      sprintf(buf, "-- Incoming client rejected -- too many connections (%u so far)\n",
+        uiLoginsRejected);
+      WriteLocalString(buf);
+      sprintf(buf, (char *)"Denied - too many connections");
+    }
+    CSockio::iWriteSock(iSocketHandle, buf, (int)strlen(buf), &iBytesWrote);
+    CSockio::iCloseSock(iSocketHandle, 1, 1, EQBCS_TraceSockets);
+  }
+}
+
+// ---------------------------------------------------------------------
+// Socket activation: the service manager bound and is listening on
+// fd 3 for us, and queues connections there while we restart.  Only
+// taken when LISTEN_PID says it was meant for this process.
+// ---------------------------------------------------------------------
+int CEqbcs::PassedListenSocket()
+{
+#ifdef UNIXWIN
+  return -1;
+#else
+  static const int LISTEN_FDS_START = 3;
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  const char *szPid = getenv("LISTEN_PID");
+  const char *szFds = getenv("LISTEN_FDS");
+  char buf[100];
+
+  if (szRealmName || szPid == NULL || szFds == NULL || atoi(szPid) != (int)getpid()) return -1;
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  if (atoi(szFds) < 1) return -1;
+  if (atoi(szFds) > 1) {
+    WriteLocalString("-- Only the first of the passed sockets is used.\n");
+  }
+  if (getsockname(LISTEN_FDS_START, (struct sockaddr *)&addr, &addrlen) != 0) {
+    perror("Passed socket");
+    return -1;
+  }
+  fcntl(LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+  // sin_port and sin6_port sit in the same place
+  iPort = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+  sprintf(buf, "-- Using the listening socket passed in, port %d.\n", iPort);
+  WriteLocalString(buf);
+  return LISTEN_FDS_START;
+#endif
+}
+
+// ---------------------------------------------------------------------
+// sd_notify: one datagram to $NOTIFY_SOCKET, an '@' there meaning the
+// abstract namespace.  Does nothing when not started that way.
+// ---------------------------------------------------------------------
+void CEqbcs::NotifyServiceManager(const char *szState)
+{
+#ifndef UNIXWIN
+  const char *szPath = getenv("NOTIFY_SOCKET");
+  struct sockaddr_un addr;
+  int iSock;
+  int iLen;
+
+  if (szPath == NULL || (szPath[0] != '/' && szPath[0] != '@')) return;
+  if ((iLen = (int)strlen(szPath)) >= (int)sizeof(addr.sun_path)) return;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, szPath, iLen);
+  if (addr.sun_path[0] == '@') addr.sun_path[0] = 0;
+
+  if ((iSock = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) return;
+  if (sendto(iSock, szState, strlen(szState), 0, (struct sockaddr *)&addr,
+    (socklen_t)(sizeof(addr.sun_family) + iLen)) < 0)
+    {
+    perror("NOTIFY_SOCKET");
+  }
+  close(iSock);
+#endif
+}
+
+// ---------------------------------------------------------------------
+// Listening and about to serve: tell the service manager, log how long
+// it took, and start the watchdog if one is wanted
+// ---------------------------------------------------------------------
+void CEqbcs::ServiceReady()
+{
+  char buf[100];
+  const char *szUsecs = getenv("WATCHDOG_USEC");
+  const char *szPid = getenv("WATCHDOG_PID");
+  unsigned long ulReady = CClock::msecs() - ulStartMsecs;
+
+  sprintf(buf, "-- Ready in %lums.\n", ulReady);
+  WriteLocalString(buf);
+  // The process as a whole is ready once all its realms are
+  if (szRealmName) return;
+  sprintf(buf, "READY=1\nSTATUS=Ready in %lums\n", ulReady);
+  NotifyServiceManager(buf);
+
+#ifndef UNIXWIN
+  // After -U, WATCHDOG_PID is the old process's and the setting came over with the state
+  if (iWatchdogMsecs == 0 && szUsecs && (szPid == NULL || atoi(szPid) == (int)getpid())) {
+    // Twice per interval, so one late loop doesn't get us killed
+    iWatchdogMsecs = (int)(atol(szUsecs) / 2000);
+    ulWatchdogLast = CClock::msecs();
+  }
+#endif
+}
+
+// ---------------------------------------------------------------------
+// Milliseconds until WATCHDOG=1 is due, -1 when there is no watchdog
+// ---------------------------------------------------------------------
+int CEqbcs::WatchdogMsecsLeft()
+{
+  unsigned long ulSince;
+
+  if (iWatchdogMsecs <= 0) return -1;
+  ulSince = CClock::msecs() - ulWatchdogLast;
+  return ulSince >= (unsigned long)iWatchdogMsecs ? 0 : iWatchdogMsecs - (int)ulSince;
+}
+
+// ---------------------------------------------------------------------
+// Update channel list
+// ---------------------------------------------------------------------
+void CEqbcs::SetChannels(CClientNode *cn, const char *szList)
+{
+  if (cn->chanList!=NULL) delete [] cn->chanList;
+  cn->chanList=new char[strlen(szList)+1];
+  strcpy(cn->chanList,szList);
+  bNBSubsDirty = true;
+  MarkCheckpoint(cn);
+  cn->writesz(cn->szCharName);
+  cn->writesz(" joined channels ");
+  cn->writesz(cn->chanList);
+  cn->writesz(".\n");
+  WriteLocalString(cn->szCharName);
+  WriteLocalString(" joined channels ");
+  WriteLocalString(cn->chanList);
+  WriteLocalString(".\n");
+}
+
+// ---------------------------------------------------------------------
+// Process Tells - v1 "name message" line, the message may use \ escapes
+// ---------------------------------------------------------------------
+void CEqbcs::HandleTell(CClientNode *cn, int iMsgType)
+{
+  char szName[CClientNode::MAX_CHARNAMELEN];
+  char ch;
+  int i=0;
+
+  ch=cn->inBuf->readChar();
+  while (ch!=' ' && ch!='\n' && ch!='\0' && i<CClientNode::MAX_CHARNAMELEN-1 && cn->inBuf->hasWaiting()) {
+    szName[i++]=ch;
+    ch=cn->inBuf->readChar();
+  }
+  szName[i]='\0';
+
+  lineIn->clear();
+  while (cn->inBuf->hasWaiting()) {
+    ch=cn->inBuf->readChar();
+    if (ch=='\\' && cn->inBuf->hasWaiting()) ch=cn->inBuf->readChar();
+    lineIn->appendChar(ch);
+  }
+
+  RouteTell(cn, szName, lineIn->getsz(), iMsgType, false);
+}
+
+// ---------------------------------------------------------------------
+// Send a tell to a client by name, or else to everyone on that channel
+// ---------------------------------------------------------------------
+void CEqbcs::RouteTell(CClientNode *cn, const char *szName, const char *szMsg,
+  int iMsgType, bool bChannelOnly)
+{
+  char szTemp[2048];
+  char *token;
+  char *tokNext;
+  bool bSent = false;
+  CClientNode *cn_to=clientList;
+
+  if (bChannelOnly == false) {
+    while (cn_to!=NULL && strcasecmp(cn_to->szCharName, szName)!=0)
+      cn_to=cn_to->next;
+
+    if (cn_to!=NULL) {
+      DeliverTell(cn, cn_to, NULL, iMsgType, szMsg);
+      return;
+    }
+  }
+
+  for (cn_to=clientList; cn_to!=NULL; cn_to=cn_to->next) {
+    if((cn->bLocalEcho || cn_to!=cn) && cn_to->chanList!=NULL) {
+      strncpy(szTemp,cn_to->chanList,sizeof(szTemp)-1);
+      szTemp[sizeof(szTemp)-1]=0;
+      for (token=strtok_r(szTemp," \n",&tokNext); token!=NULL;
+        token=strtok_r(NULL," \n",&tokNext))
+        {
+        if (strcmp(token,szName)==0) {
+          DeliverTell(cn, cn_to, szName, iMsgType, szMsg);
+          bSent = true;
+          break;
+        }
+      }
+    }
+  }
+  if (bSent == false) {
+    cn->writesz("-- ");
+    cn->writesz(szName);
+    cn->writesz(": No such name.\n");
+  }
+}
+
+// ---------------------------------------------------------------------
+// Write one tell or BCI message, szChannel set when sent to a channel
+// ---------------------------------------------------------------------
+void CEqbcs::DeliverTell(CClientNode *cn, CClientNode *cn_to, const char *szChannel,
+  int iMsgType, const char *szMsg)
+{
+  bool bBci = (iMsgType == CClientNode::MSG_TYPE_BCI);
+
+  if (cn_to->bAuthorized == 0 || cn_to->closeMe || cn_to->iSocketHandle < 0) return;
+
+  // BCI is only logged when it went to a channel
+  if (szChannel) {
+    WriteLocalString(szChannel);
+    WriteLocalString(": ");
+  }
+  if (bBci == false) {
+    WriteLocalChar('[');
+    WriteLocalString(cn->szCharName);
+    WriteLocalString("] to [");
+    WriteLocalString(cn_to->szCharName);
+    WriteLocalString("]: ");
+  }
+  if (bBci == false || szChannel) {
+    WriteLocalString(szMsg);
+    WriteLocalChar('\n');
+  }
+
+  if (cn_to->uiCaps & CClientNode::CAP_V2) {
+    if (bBci) {
+      cn_to->writeFrame(CClientNode::FRAME_BCI, cn->szCharName, NULL,
+        szMsg, (int)strlen(szMsg), CClientNode::LANE_DIRECT, cn);
+    }
+    else if (szChannel) {
+      cn_to->writeFrame(CClientNode::FRAME_CHANNEL, cn->szCharName, szChannel,
+        szMsg, (int)strlen(szMsg), CClientNode::LANE_DIRECT, cn);
+    }
+    else {
+      cn_to->writeFrame(CClientNode::FRAME_TELL, cn->szCharName, NULL,
+        szMsg, (int)strlen(szMsg), CClientNode::LANE_DIRECT, cn);
+    }
+    return;
+  }
+  cn_to->writeChar(bBci ? '{' : '[', CClientNode::LANE_DIRECT, cn);
+  cn_to->writesz(cn->szCharName, CClientNode::LANE_DIRECT, cn);
+  cn_to->writeChar(bBci ? '}' : ']', CClientNode::LANE_DIRECT, cn);
+  cn_to->writeChar(' ', CClientNode::LANE_DIRECT, cn);
+  cn_to->writesz(szMsg, CClientNode::LANE_DIRECT, cn);
+  cn_to->writeChar('\n', CClientNode::LANE_DIRECT, cn);
+}
+
+// ---------------------------------------------------------------------
+// Disconnect command
+// ---------------------------------------------------------------------
+void CEqbcs::CmdDisconnect(CClientNode *cn)
+{
+  if (cn) {
+    WriteLocalString("-- ");
+    WriteLocalString(cn->szCharName);
+    WriteLocalString(" CmdDisconnect.\n");
+    cn->closeMe = 1;
+  }
+}
+
+// ---------------------------------------------------------------------
+// Send Names command
+// ---------------------------------------------------------------------
+void CEqbcs::CmdSendNames(CClientNode *cn_to)
+{
+  int count = 0;
+
+  cn_to->writesz("-- Names:");
+  WriteLocalString("-- ");
+  WriteLocalString(cn_to->szCharName);
+  WriteLocalString(" Requested Names:");
+
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->bAuthorized && cn->closeMe == 0 && cn->iSocketHandle >= 0) {
+      count++;
+      cn_to->writeChar(' ');
+      cn_to->writesz(cn->szCharName);
+      WriteLocalString(" ");
+      WriteLocalString(cn->szCharName);
+    }
+  }
+  cn_to->writesz(".\n");
+  WriteLocalString(".\n");
+}
+
+// ---------------------------------------------------------------------
+// Do a command
+// ---------------------------------------------------------------------
+void CEqbcs::DoCommand(CClientNode *cn)
+{
+  // Note: All found commands should process and return immediately.
+  if (cn) {
+    cn->bCmdMode = false;
+    cn->cmdBufUsed = 0;
+    if (cn->cmdBuf) {
+      if (strcmp("PONG", cn->cmdBuf) != 0) cn->ulLastActive = CClock::msecs();
+      if (strcmp("NBMSG", cn->cmdBuf)==0) {
+        cn->inBuf->writeChar('\t');
+        cn->inBuf->writeChar((char)CClientNode::MSG_TYPE_NBMSG);
+        return;
+      }
+      if (!strcmp("BCI", cn->cmdBuf))
+      {
+         cn->inBuf->writeChar('\t');
+         cn->inBuf->writeChar((char)CClientNode::MSG_TYPE_BCI);
+         return;
+      }
+      if (strcmp("NBNAMES", cn->cmdBuf)==0) {
+        SendNetBotSendList(cn);
+        return;
+      }
+      if (strcmp("NBROSTER", cn->cmdBuf)==0) {
+        SendNetBotRoster(cn);
+        return;
+      }
+      if (strcmp("NBSNAPSHOT", cn->cmdBuf)==0) {
+        CmdSnapshot(cn);
+        return;
+      }
+      if (strncmp("NBSUB", cn->cmdBuf, 5)==0 &&
+        (cn->cmdBuf[5] == ' ' || cn->cmdBuf[5] == 0))
+        {
+        CmdNetBotSubscribe(cn);
+        return;
+      }
+      if (strncmp("NBFIELDS", cn->cmdBuf, 8)==0 &&
+        (cn->cmdBuf[8] == ' ' || cn->cmdBuf[8] == 0))
+        {
+        CmdNetBotFields(cn);
+        return;
+      }
+      if (strcmp("NAMES", cn->cmdBuf) == 0) {
+        CmdSendNames(cn);
+        return;
+      }
+      if (strcmp("DISCONNECT", cn->cmdBuf) == 0) {
+        CmdDisconnect(cn);
+        return;
+      }
+      if (strcmp("MSGALL", cn->cmdBuf) == 0) {
+        cn->inBuf->writeChar('\t');
+        cn->inBuf->writeChar((char)CClientNode::MSG_TYPE_MSGALL);
+        return;
+      }
+      if (strcmp("TELL", cn->cmdBuf) == 0) {
+        cn->inBuf->writeChar('\t');
+        cn->inBuf->writeChar((char)CClientNode::MSG_TYPE_TELL);
+        return;
+      }
+      if (strcmp("CHANNELS", cn->cmdBuf) == 0) {
+        cn->inBuf->writeChar('\t');
+        cn->inBuf->writeChar((char)CClientNode::MSG_TYPE_CHANNELS);
+        return;
+      }
+      if (strncmp("LOCALECHO", cn->cmdBuf,9) == 0) {
+        (cn->cmdBuf[10]=='1') ? cn->bLocalEcho=1 : cn->bLocalEcho=0;
+        cn->writesz("-- Local Echo: ");
+        (cn->bLocalEcho) ? cn->writesz("ON\n") : cn->writesz("OFF\n");
+        return;
+      }
+      if ( strcmp( "PONG", cn->cmdBuf ) == 0)
+      {
+         // Any input is taken as an answer, see RunTimers
+         return;
+      }
+    }
+  }
+
+  cn->writesz("-- Unknown Command: ");
+  if (cn->cmdBuf) cn->writesz(cn->cmdBuf);
+  cn->writesz(".\n");
+}
+
+// ---------------------------------------------------------------------
+// Next PING, the ping interval after the last one give or take a tenth, so
+// clients that logged in together don't get pinged together
+// ---------------------------------------------------------------------
+void CEqbcs::ArmPing(CClientNode *cn, int iSpentMsecs)
+{
+  int iMsecs = tune.iPingSecs*1000;
+
+  iMsecs += rand() % (iMsecs/5 + 1) - iMsecs/10;
+  timers->add(cn->liveTimer, CClientNode::TIMER_PING, iMsecs - iSpentMsecs);
+}
+
+// ---------------------------------------------------------------------
+// Next idle check, due when the client will have sent nothing but
+// PONGs for -t seconds.  Off when -t isn't given.
+// ---------------------------------------------------------------------
+void CEqbcs::ArmIdle(CClientNode *cn)
+{
+  unsigned long ulIdle = CClock::msecs() - cn->ulLastActive;
+
+  if (tune.iIdleSecs <= 0) {
+    cn->idleTimer->cancel();
+    return;
+  }
+  timers->add(cn->idleTimer, CClientNode::TIMER_IDLE,
+    ulIdle >= (unsigned long)tune.iIdleSecs*1000 ? 0 : tune.iIdleSecs*1000 - (int)ulIdle);
+}
+
+// ---------------------------------------------------------------------
+// Run the timers that are due: PINGs, their deadlines, idle checks, and
+// the end of a detached session's grace period
+// ---------------------------------------------------------------------
+void CEqbcs::RunTimers()
+{
+  unsigned long ulNow = CClock::msecs();
+  CTimer *t;
+  CClientNode *cn;
+
+  while ((t = timers->expired(ulNow)) != NULL) {
+    cn = t->cn;
+    if (cn->closeMe) continue;
+    if (t->iKind == CClientNode::TIMER_PING) {
+      cn->writesz("\tPING\n");
+      cn->ulPingSent = ulNow;
+      timers->add(t, CClientNode::TIMER_PONG, tune.iPongTimeoutSecs*1000);
+    }
+    else if (t->iKind == CClientNode::TIMER_PONG) {
+      if (ulNow - cn->ulLastHeard <= ulNow - cn->ulPingSent) {
+        ArmPing(cn, (int)(ulNow - cn->ulPingSent));
+      }
+      else {
+        // Treated like a lost connection, so RESUME still holds it
+        WriteLocalString("-- ");
+        WriteLocalString(cn->szCharName);
+        WriteLocalString(" did not answer PING, disconnecting.\n");
+        cn->lastReadError = 1;
+        cn->closeMe = 1;
+      }
+    }
+    else if (t->iKind == CClientNode::TIMER_GRACE && cn->bDetached) {
+      cn->closeMe = 1;
+    }
+    else if (t->iKind == CClientNode::TIMER_IDLE && cn->bDetached == false) {
+      if (tune.iIdleSecs > 0 && ulNow - cn->ulLastActive >= (unsigned long)tune.iIdleSecs*1000) {
+        // Alive but doing nothing: gone for good, not held for a RESUME
+        WriteLocalString("-- ");
+        WriteLocalString(cn->szCharName);
+        WriteLocalString(" was idle too long, disconnecting.\n");
+        cn->closeMe = 1;
+      }
+      else {
+        ArmIdle(cn);
+      }
+    }
+    else if (t->iKind == CClientNode::TIMER_LOGIN && cn->bAuthorized == false) {
+      RejectLogin(cn, "no login in time");
+    }
+  }
+}
+// ---------------------------------------------------------------------
+// Read from a client like CSockio::iReadSock, through zlib for DEFLATE
+// ---------------------------------------------------------------------
+int CEqbcs::ReadClient(CClientNode *cn, char *pBuffer, int iSize, int *piBytesRead)
+{
+  int lastRet = CSockio::OKAY;
+  z_stream *zs = cn->zInflate;
+
+  if (zs == NULL) {
+    lastRet = CSockio::iReadSock(cn->iSocketHandle, pBuffer, iSize, piBytesRead);
+    if (*piBytesRead > 0) cn->ulLastHeard = CClock::msecs();
+    return lastRet;
+  }
+
+  *piBytesRead = 0;
+  if (cn->zIn->hasWaiting() == 0) {
+    char rawChunk[512];
+    int iRaw = 0;
+
+    lastRet = CSockio::iReadSock(cn->iSocketHandle, rawChunk, sizeof(rawChunk), &iRaw);
+    if (iRaw > 0) cn->ulLastHeard = CClock::msecs();
+    if (InflateInput(cn, rawChunk, iRaw) == false) {
+      // Corrupt, or the client ended its stream
+      lastRet = CSockio::READERR;
+    }
+  }
+
+  while (*piBytesRead < iSize && cn->zIn->hasWaiting()) {
+    pBuffer[(*piBytesRead)++] = cn->zIn->readChar();
+  }
+  if (*piBytesRead == iSize) return CSockio::OKAY;
+  if (lastRet == CSockio::READERR) return CSockio::READERR;
+  return CSockio::WOULDBLOCK;
+}
+
+// ---------------------------------------------------------------------
+// DEFLATE: inflate what was read into zIn.  False if the stream is
+// corrupt or the client ended it.
+// ---------------------------------------------------------------------
+bool CEqbcs::InflateInput(CClientNode *cn, const char *pRaw, int iRaw)
+{
+#ifdef EQBCS_ZLIB
+  char outChunk[2048];
+  z_stream *zs = cn->zInflate;
+  int zRet = Z_OK;
+
+  zs->next_in = (Bytef *)pRaw;
+  zs->avail_in = iRaw;
+  while (iRaw > 0 && zRet == Z_OK && (zs->avail_in > 0 || zs->avail_out == 0)) {
+    zs->next_out = (Bytef *)outChunk;
+    zs->avail_out = sizeof(outChunk);
+    zRet = inflate(zs, Z_SYNC_FLUSH);
+    cn->zIn->write(outChunk, sizeof(outChunk) - zs->avail_out);
+  }
+  return zRet == Z_OK || zRet == Z_BUF_ERROR;
+#else
+  return false;
+#endif
+}
+
+// ---------------------------------------------------------------------
+// Shedding level for a loop lag and total queued output
+// ---------------------------------------------------------------------
+int CEqbcs::OverloadLevelFor(int iLag, int iQueue)
+{
+  int iLevel = OVERLOAD_NONE;
+
+  while (iLevel < OVERLOAD_HOLD_CHAT &&
+    ((tune.iOverloadLagMsecs && iLag >= tune.iOverloadLagMsecs << iLevel) ||
+    (tune.iOverloadQueueBytes && iQueue >= tune.iOverloadQueueBytes << iLevel)))
+    {
+    iLevel++;
+  }
+  return iLevel;
+}
+
+// ---------------------------------------------------------------------
+// Called once per loop with the time spent outside select.  A level is
+// left only once lag and queue are under half of what entered it, and
+// not within OVERLOAD_STEP_MSECS of entering it.  Chat held back is
+// not counted: it only moves once the level drops.
+// ---------------------------------------------------------------------
+void CEqbcs::UpdateOverload(int iWorkMsecs)
+{
+  static const char *szLevels[] = { "normal", "conflating NetBots",
+    "holding NetBots", "holding NetBots and chat" };
+  char szLine[200];
+  int iQueue = 0;
+  int iLevel;
+
+  iLoopLagMsecs = (iLoopLagMsecs*7 + iWorkMsecs) / 8;
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->closeMe == 0) iQueue += cn->pendingOut(iOverloadLevel >= OVERLOAD_HOLD_CHAT);
+  }
+
+  iLevel = OverloadLevelFor(iLoopLagMsecs, iQueue);
+  if (iLevel < iOverloadLevel) {
+    iLevel = OverloadLevelFor(iLoopLagMsecs*2, iQueue*2);
+    if (iLevel > iOverloadLevel) iLevel = iOverloadLevel;
+    if (CClock::msecs() - ulOverloadSince < (unsigned long)OVERLOAD_STEP_MSECS) return;
+  }
+  if (iLevel == iOverloadLevel) return;
+
+  if (iLevel < iOverloadLevel) {
+    // What was held back can go now
+    for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+      reactor->post(cn, CReactor::EV_OUT);
+    }
+  }
+  iOverloadLevel = iLevel;
+  ulOverloadSince = CClock::msecs();
+  uiOverloadChanges++;
+  sprintf(szLine, "-- Overload level %d (%s): lag %dms, queued %d bytes, "
+    "%u changes, %u NetBots packets dropped.\n", iLevel, szLevels[iLevel],
+    iLoopLagMsecs, iQueue, uiOverloadChanges, uiNBDropped);
+  WriteLocalString(szLine);
+}
+
+// ---------------------------------------------------------------------
+// Milliseconds until the overload level is next looked at without any
+// traffic to wake us, -1 at OVERLOAD_NONE
+// ---------------------------------------------------------------------
+int CEqbcs::OverloadMsecsLeft()
+{
+  unsigned long ulSince = CClock::msecs() - ulOverloadSince;
+
+  if (iOverloadLevel == OVERLOAD_NONE) return -1;
+  return OVERLOAD_STEP_MSECS - (int)(ulSince % OVERLOAD_STEP_MSECS);
+}
+
+// ---------------------------------------------------------------------
+// A client in debt on any bucket is not read until it is paid off, so
+// TCP pushes back on the sender instead of us queuing its input
+// ---------------------------------------------------------------------
+bool CEqbcs::ReadBlocked(CClientNode *cn)
+{
+  unsigned long ulNow = CClock::msecs();
+
+  if (cn->bAuthorized == false) return false;
+  for (int i=0; i < CClientNode::RATE_CLASSES; i++) {
+    cn->rateLimits[i].refill(ulNow);
+    if (cn->rateLimits[i].msecsUntilClear() > 0) return true;
+  }
+  return false;
+}
+
+// ---------------------------------------------------------------------
+// Milliseconds until a blocked client may be read again, 0 if it may
+// be now
+// ---------------------------------------------------------------------
+int CEqbcs::RateMsecsLeft(CClientNode *cn)
+{
+  unsigned long ulNow = CClock::msecs();
+  int iLeft = 0;
+  int iBucketLeft;
+
+  if (cn->bAuthorized == false) return 0;
+  for (int i=0; i < CClientNode::RATE_CLASSES; i++) {
+    cn->rateLimits[i].refill(ulNow);
+    if ((iBucketLeft = cn->rateLimits[i].msecsUntilClear()) > iLeft) iLeft = iBucketLeft;
+  }
+  return iLeft;
+}
+
+// ---------------------------------------------------------------------
+// Bytes read always go into debt; only disconnect mode acts on it
+// ---------------------------------------------------------------------
+void CEqbcs::ChargeBytes(CClientNode *cn, int iBytes)
+{
+  if (iBytes <= 0) return;
+  if (cn->bAuthorized == false) {
+    cn->iPreAuthBytes += iBytes;
+    if (tune.iMaxPreAuthBytes && cn->iPreAuthBytes > tune.iMaxPreAuthBytes && cn->closeMe == 0) {
+      RejectLogin(cn, "too much sent before login");
+    }
+    return;
+  }
+  cn->rateLimits[CClientNode::RATE_BYTES].take(iBytes);
+  if (tune.iRateMode == RATE_DISCONNECT &&
+    cn->rateLimits[CClientNode::RATE_BYTES].msecsUntilClear() > 0)
+    {
+    WriteLocalString("-- ");
+    WriteLocalString(cn->szCharName);
+    WriteLocalString(" over its byte rate limit, disconnecting.\n");
+    cn->closeMe = 1;
+  }
+}
+
+// ---------------------------------------------------------------------
+// Charge a relayed message to the message bucket and its class bucket.
+// Returns false if it should be dropped.
+// ---------------------------------------------------------------------
+bool CEqbcs::AdmitMessage(CClientNode *cn, int iClass)
+{
+  CTokenBucket *msgs = &cn->rateLimits[CClientNode::RATE_MSGS];
+  CTokenBucket *cls = &cn->rateLimits[iClass];
+  unsigned long ulNow = CClock::msecs();
+  char szCount[32];
+
+  msgs->refill(ulNow);
+  cls->refill(ulNow);
+  if (tune.iRateMode == RATE_DELAY || (msgs->canTake(1) && cls->canTake(1))) {
+    // Delay: let it through, the debt stops reading for a while
+    msgs->take(1);
+    cls->take(1);
+    return true;
+  }
+
+  if (tune.iRateMode == RATE_DISCONNECT) {
+    WriteLocalString("-- ");
+    WriteLocalString(cn->szCharName);
+    WriteLocalString(" over its message rate limit, disconnecting.\n");
+    cn->closeMe = 1;
+    return false;
+  }
+
+  // At most one log line a second per client
+  cn->uiRateDrops++;
+  if (ulNow - cn->ulRateLogged >= 1000) {
+    sprintf(szCount, "%u", cn->uiRateDrops);
+    WriteLocalString("-- ");
+    WriteLocalString(cn->szCharName);
+    WriteLocalString(" over its rate limit, messages dropped: ");
+    WriteLocalString(szCount);
+    WriteLocalString("\n");
+    cn->ulRateLogged = ulNow;
+  }
+  return false;
+}
+
+// ---------------------------------------------------------------------
+// Give a connected client its handler, first run in the next reactor
+// pass
+// ---------------------------------------------------------------------
+void CEqbcs::StartHandler(CClientNode *cn)
+{
+  cn->reactor = reactor;
+  cn->iEvents = 0;
+  cn->handler = ConnHandler(cn).handle;
+  cn->iWant = CReactor::EV_WAKE;
+  reactor->post(cn, CReactor::EV_WAKE);
+}
+
+// ---------------------------------------------------------------------
+// Destroy a client's handler; never the one running.  Its state is on
+// the CClientNode, so a new handler can take over where it was.
+// ---------------------------------------------------------------------
+void CEqbcs::StopHandler(CClientNode *cn)
+{
+  if (!cn->handler) return;
+  reactor->cancel(cn);
+  cn->handler.destroy();
+  cn->handler = std::coroutine_handle<>();
+}
+
+// ---------------------------------------------------------------------
+// A client's connection handler, one coroutine per connection.  It is
+// resumed only when its socket is ready, output was queued for it, or
+// its deadline comes: a batch due, a rate limit cleared.  Output goes
+// first, then a block of input is read and each line, command, frame
+// or login in it handled as it completes.  Over its rate limit, the
+// rest of the block is held until the limit clears.
+// ---------------------------------------------------------------------
+CConnTask CEqbcs::ConnHandler(CClientNode *cn)
+{
+  int iRet;
+
+  while (cn->closeMe == 0) {
+    cn->iEvents &= ~CReactor::EV_OUT;
+    while (WireFor(cn)->hasWaiting() && cn->closeMe == 0) {
+      if (co_await Send(cn) <= 0) break;
+    }
+    if (cn->closeMe) break;
+    if (ReadBlocked(cn)) {
+      co_await Wait(cn);
+      continue;
+    }
+    iRet = 0;
+    if (cn->pInput == NULL) iRet = co_await Recv(cn);
+    StepInput(cn);
+    if (cn->iInputPos == cn->iInputLen) ReleaseInput(cn);
+    if (iRet < 0) cn->closeMe = 1;
+  }
+}
+
+// ---------------------------------------------------------------------
+// What a handler awaits.  Recv also wakes for output to send, Send for
+// input to read unless the client is over its rate limit, and all of
+// them for output the socket can take.
+// ---------------------------------------------------------------------
+CIoAwait CEqbcs::Recv(CClientNode *cn)
+{
+  int iWant = CReactor::EV_READ | CReactor::EV_OUT;
+
+  GiveToReader(cn);
+  if (cn->hasWireOut(iOverloadLevel >= OVERLOAD_HOLD_CHAT)) iWant |= CReactor::EV_WRITE;
+  return CIoAwait(this, cn, CIoAwait::OP_RECV, iWant, WakeMsecs(cn));
+}
+
+CIoAwait CEqbcs::Send(CClientNode *cn)
+{
+  int iWant = CReactor::EV_WRITE;
+
+  if (ReadBlocked(cn) == false) iWant |= CReactor::EV_READ;
+  return CIoAwait(this, cn, CIoAwait::OP_SEND, iWant, WakeMsecs(cn));
+}
+
+CIoAwait CEqbcs::Wait(CClientNode *cn)
+{
+  int iWant = CReactor::EV_OUT;
+
+  if (cn->hasWireOut(iOverloadLevel >= OVERLOAD_HOLD_CHAT)) iWant |= CReactor::EV_WRITE;
+  return CIoAwait(this, cn, CIoAwait::OP_WAIT, iWant, WakeMsecs(cn));
+}
+
+// ---------------------------------------------------------------------
+// How long a handler may wait before it has something to do without
+// an event: its batch is due, its rate limit clears, or input is left
+// over.  -1 if only an event will do.
+// ---------------------------------------------------------------------
+int CEqbcs::WakeMsecs(CClientNode *cn)
+{
+  int iMsecs = cn->batchMsecsLeft();
+  int iRate = RateMsecsLeft(cn);
+
+  if (iRate > 0) {
+    if (iMsecs < 0 || iRate < iMsecs) iMsecs = iRate;
+  }
+  else if (InputWaiting(cn)) {
+    iMsecs = 0;
+  }
+  return iMsecs;
+}
+
+// ---------------------------------------------------------------------
+// Read what a client sent, up to INPUT_BLOCK_BYTES, into a pooled
+// block, or take it from the client's reader.  Returns the bytes read,
+// or -1 if the connection failed; what came before the failure is
+// still there to step through.
+// ---------------------------------------------------------------------
+int CEqbcs::RecvInput(CClientNode *cn)
+{
+  int iBytesRead = 0;
+  int lastRet;
+
+  // What a stopped reader had, given back
+  if (cn->pInput) return cn->iInputLen - cn->iInputPos;
+#ifndef UNIXWIN
+  if (cn->recvRing) return TakeInput(cn);
+#endif
+#ifdef UNIXWIN
+  WSASetLastError(0);
+#endif
+  cn->pInput = inputPool->alloc();
+  lastRet = ReadClient(cn, cn->pInput, INPUT_BLOCK_BYTES, &iBytesRead);
+  cn->iInputPos = 0;
+  cn->iInputLen = iBytesRead > 0 ? iBytesRead : 0;
+  ulBytesIn += cn->iInputLen;
+  // Before the login, bytes are charged as they are stepped through
+  if (cn->bAuthorized) ChargeBytes(cn, cn->iInputLen);
+  if (cn->iInputLen == 0) ReleaseInput(cn);
+
+#ifdef UNIXWIN
+  if (lastRet == CSockio::WOULDBLOCK) {
+    WSASetLastError(0);
+  }
+  else if (lastRet != CSockio::OKAY || WSAGetLastError()) {
+    if (lastRet == -2) {
+      cn->lastReadError = -1;
+    }
+    else {
+      CSockio::vPrintSockErr();
+      cn->lastReadError = WSAGetLastError();
+    }
+    WSASetLastError(0);
+    return -1;
+  }
+#else
+  if (lastRet != CSockio::OKAY && lastRet != CSockio::WOULDBLOCK) {
+    cn->lastReadError = 1;
+    return -1;
+  }
+#endif
+  return cn->iInputLen;
+}
+
+// ---------------------------------------------------------------------
+// Write what the socket takes of a client's output.  Returns the bytes
+// written, 0 if the socket is full, -1 if the connection failed.
+// ---------------------------------------------------------------------
+int CEqbcs::SendOutput(CClientNode *cn)
+{
+  char writeBuf[512];
+  int bufUsed;
+  int iBytesWrote = 0;
+  int lastRet;
+  CCharBuf *wire = cn->zDeflate ? cn->wireOut : cn->batchOut ? cn->batchOut : cn->outBuf;
+
+#ifdef UNIXWIN
+  WSASetLastError(0);
+#else
+  if (cn->sendRing && cn->sendRing->iClosing) {
+    // Kept for a resume: what it holds goes first, once its writer
+    // lets go
+    return 0;
+  }
+  if (cn->sendRing && cn->sendRing->iError) {
+    cn->closeMe = 1;
+    cn->lastWriteError = cn->sendRing->iError;
+    return -1;
+  }
+#endif
+  if ((bufUsed = wire->peek(writeBuf, sizeof(writeBuf))) == 0) return 0;
+  lastRet = SendWire(cn, writeBuf, bufUsed, &iBytesWrote);
+  wire->skip(iBytesWrote);
+  if (lastRet == CSockio::WOULDBLOCK) {
+    // Socket is full, the rest waits for select to say writable, or
+    // its ring is and the writer will say when there's room
+    return iBytesWrote > 0 ? iBytesWrote : 0;
+  }
+#ifdef UNIXWIN
+  if (iBytesWrote < 1 && WSAGetLastError()) {
+    cn->closeMe = 1;
+    cn->lastWriteError = WSAGetLastError();
+    WSASetLastError(0);
+    return -1;
+  }
+  WSASetLastError(0);
+#else
+  if (iBytesWrote < 1) {
+    // Nonzero even with no errno, so a RESUME session is held
+    cn->closeMe = 1;
+    cn->lastWriteError = 1;
+    return -1;
+  }
+#endif
+  return iBytesWrote;
+}
+
+// ---------------------------------------------------------------------
+// Bring a client's queued output up to its socket: lanes drained to
+// outBuf, through its batch window and zlib.  Returns what goes next.
+// ---------------------------------------------------------------------
+CCharBuf *CEqbcs::WireFor(CClientNode *cn)
+{
+  CCharBuf *wire;
+
+  DrainConflated(cn);
+  cn->DrainLanes(iOverloadLevel >= OVERLOAD_HOLD_CHAT, tune.iLaneWireBytes);
+  wire = cn->outBuf;
+  if (cn->batchOut) {
+    // Hold output until the window that opened with it is over
+    if (cn->bBatchOpen == false && cn->outBuf->hasWaiting()) {
+      cn->bBatchOpen = true;
+      cn->ulBatchStart = CClock::msecs();
+    }
+    if (cn->batchMsecsLeft() == 0) cn->ReleaseBatch();
+    wire = cn->batchOut;
+  }
+  if (cn->zDeflate) {
+    cn->CompressOut();
+    wire = cn->wireOut;
+  }
+  return wire;
+}
+
+// ---------------------------------------------------------------------
+// Hand what select found to the handlers waiting for it
+// ---------------------------------------------------------------------
+void CEqbcs::PostEvents(fd_set *fds, fd_set *wfds)
+{
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->iWant == 0 || cn->iSocketHandle == -1) continue;
+    if (FD_ISSET(cn->iSocketHandle, fds)) reactor->post(cn, CReactor::EV_READ);
+    if (FD_ISSET(cn->iSocketHandle, wfds)) reactor->post(cn, CReactor::EV_WRITE);
+  }
+}
+
+// ---------------------------------------------------------------------
+// Go on through a client's input block.  Stops early, the rest still
+// held, when what it sent puts it over its rate limit.
+// ---------------------------------------------------------------------
+void CEqbcs::StepInput(CClientNode *cn)
+{
+  bool bDone;
+
+  while (cn->iInputPos < cn->iInputLen && cn->closeMe == 0) {
+    if (cn->bAuthorized == false) {
+      // Charged a byte at a time, up to the end of the login
+      ChargeBytes(cn, 1);
+      bDone = StepLine(cn, cn->pInput[cn->iInputPos++]);
+      if (cn->bAuthorized) LoginDone(cn);
+    }
+    else if (cn->uiCaps & CClientNode::CAP_V2) {
+      bDone = StepFrame(cn);
+    }
+    else {
+      bDone = StepLine(cn, cn->pInput[cn->iInputPos++]);
+    }
+    if (bDone) ulMsgsIn++;
+    if (bDone && ReadBlocked(cn)) return;
+  }
+}
+
+// ---------------------------------------------------------------------
+// One character of v1 input, or of a login.  Returns true when it
+// completed a line or command.
+// ---------------------------------------------------------------------
+bool CEqbcs::StepLine(CClientNode *cn, char ch)
+{
+  if (cn->bAuthorized && cn->bCmdMode == false) {
+    if (ch == '\t' && cn->inBuf->hasWaiting() == 0) {
+      cn->bCmdMode = true;
+    }
+    else if (ch == '\n') {
+      cn->ulLastActive = CClock::msecs();
+      cn->lastChar = ' '; // force to no spaces at start of next line
+      HandleLine(cn);
+      return true;
+    }
+    else if (cn->lastChar != ' ' || ch != ' ') {
+      cn->inBuf->writeChar(ch);
+      cn->lastChar = ch;
+    }
+  }
+  else if (cn->cmdBufUsed < (CClientNode::CMD_BUFSIZE-1)) {
+    if (ch == '\n' && cn->bCmdMode) {
+      cn->cmdBuf[cn->cmdBufUsed] = 0;
+      // A whole block is read at once: what it said before the command
+      // goes out ahead of the reply
+      cn->DrainLanes(iOverloadLevel >= OVERLOAD_HOLD_CHAT, tune.iLaneWireBytes);
+      DoCommand(cn);
+      cn->lastChar = ' ';
+      return true;
+    }
+    else if (ch != '\r') {
+      cn->cmdBuf[cn->cmdBufUsed] = ch;
+      cn->cmdBufUsed++;
+      if (ch == ';' && cn->bAuthorized == false) {
+        AuthorizeClient(cn);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// ---------------------------------------------------------------------
+// Take what the block has of a v2 frame, and dispatch it once
+// complete.  Returns true when one was dispatched.
+// ---------------------------------------------------------------------
+bool CEqbcs::StepFrame(CClientNode *cn)
+{
+  int iLen;
+  int iTake;
+
+  if (cn->frameHdrUsed < 3) {
+    cn->frameHdr[cn->frameHdrUsed++] = (unsigned char)cn->pInput[cn->iInputPos++];
+    if (cn->frameHdrUsed < 3) return false;
+  }
+  iLen = (cn->frameHdr[1] << 8) | cn->frameHdr[2];
+  iTake = iLen - cn->frameIn->length();
+  if (iTake > cn->iInputLen - cn->iInputPos) iTake = cn->iInputLen - cn->iInputPos;
+  cn->frameIn->append(&cn->pInput[cn->iInputPos], iTake);
+  cn->iInputPos += iTake;
+  if (cn->frameIn->length() < iLen) return false;
+
+  DispatchFrame(cn, cn->frameHdr[0], cn->frameIn->getsz(), iLen);
+  cn->frameHdrUsed = 0;
+  cn->frameIn->clear();
+  return true;
+}
+
+// ---------------------------------------------------------------------
+// The login went through partway into a block: the rest of it is the
+// session's.  DEFLATE's goes through zlib, anything else is charged
+// now as if just read.
+// ---------------------------------------------------------------------
+void CEqbcs::LoginDone(CClientNode *cn)
+{
+  int iLeft = cn->iInputLen - cn->iInputPos;
+
+  if (cn->pInput == NULL || iLeft <= 0) return;
+  if (cn->zInflate == NULL) {
+    ChargeBytes(cn, iLeft);
+    return;
+  }
+  if (InflateInput(cn, &cn->pInput[cn->iInputPos], iLeft) == false) {
+    cn->lastReadError = 1;
+    cn->closeMe = 1;
+  }
+  ReleaseInput(cn);
+}
+
+// ---------------------------------------------------------------------
+// Give a client's input block back, whatever is left in it unread
+// ---------------------------------------------------------------------
+void CEqbcs::ReleaseInput(CClientNode *cn)
+{
+  if (cn->pInput == NULL) return;
+  inputPool->release(cn->pInput);
+  cn->pInput = NULL;
+  cn->iInputPos = cn->iInputLen = 0;
+}
+
+// ---------------------------------------------------------------------
+// Route a v2 frame.  pData is NUL terminated after iLen bytes.
+// ---------------------------------------------------------------------
+void CEqbcs::DispatchFrame(CClientNode *cn, unsigned char ucType, const char *pData, int iLen)
+{
+  char szName[256];
+  int iNameLen;
+
+  // v1 clients get these as text lines, where a CR, LF or NUL would end
+  // the line early or start a protocol line of the sender's making.
+  if (ucType != CClientNode::FRAME_TELL && ucType != CClientNode::FRAME_CHANNEL &&
+    ucType != CClientNode::FRAME_BCI && FrameTextOk(pData, iLen) == false)
+    {
+    cn->writesz("-- Bad frame.\n");
+    return;
+  }
+  // Anything but a PONG counts against -t
+  if (ucType != CClientNode::FRAME_CONTROL || strcmp(*pData == '\t' ? &pData[1] : pData, "PONG") != 0) {
+    cn->ulLastActive = CClock::msecs();
+  }
+
+  if (ucType == CClientNode::FRAME_BROADCAST) {
+    if (AdmitMessage(cn, CClientNode::RATE_CHAT)) {
+      RelayBroadcast(cn, CClientNode::MSG_TYPE_NORMAL, pData);
+    }
+  }
+  else if (ucType == CClientNode::FRAME_NBPKT) {
+    if (AdmitMessage(cn, CClientNode::RATE_NBMSG)) {
+      RelayNetBotPacket(cn, pData, iLen);
+    }
+  }
+  else if (ucType == CClientNode::FRAME_TELL || ucType == CClientNode::FRAME_CHANNEL ||
+    ucType == CClientNode::FRAME_BCI)
+    {
+    // [length][name or channel][message]
+    iNameLen = (iLen > 0) ? (unsigned char)pData[0] : 0;
+    if (iLen < 1 || 1 + iNameLen > iLen || FrameTextOk(&pData[1], iLen-1) == false) {
+      cn->writesz("-- Bad frame.\n");
+      return;
+    }
+    if (AdmitMessage(cn, CClientNode::RATE_TELL) == false) return;
+    memcpy(szName, &pData[1], iNameLen);
+    szName[iNameLen] = 0;
+    RouteTell(cn, szName, &pData[1+iNameLen],
+      (ucType == CClientNode::FRAME_BCI) ? CClientNode::MSG_TYPE_BCI : CClientNode::MSG_TYPE_TELL,
+      ucType == CClientNode::FRAME_CHANNEL);
+  }
+  else if (ucType == CClientNode::FRAME_CONTROL) {
+    if (*pData == '\t') pData++;
+    if (strncmp("MSGALL ", pData, 7) == 0) {
+      if (AdmitMessage(cn, CClientNode::RATE_CHAT)) {
+        RelayBroadcast(cn, CClientNode::MSG_TYPE_MSGALL, &pData[7]);
+      }
+    }
+    else if (strncmp("CHANNELS", pData, 8) == 0 && (pData[8] == ' ' || pData[8] == 0)) {
+      SetChannels(cn, pData[8] ? &pData[9] : "");
+    }
+    else if (strcmp("NBMSG", pData) == 0 || strcmp("TELL", pData) == 0 ||
+      strcmp("BCI", pData) == 0 || strcmp("MSGALL", pData) == 0)
+      {
+      // These take the next line in v1; v2 has frames for them
+      cn->writesz("-- Use a frame for: ");
+      cn->writesz(pData);
+      cn->writesz(".\n");
+    }
+    else {
+      strncpy(cn->cmdBuf, pData, CClientNode::CMD_BUFSIZE-1);
+      cn->cmdBuf[CClientNode::CMD_BUFSIZE-1] = 0;
+      DoCommand(cn);
+    }
+  }
+  else {
+    cn->writesz("-- Unknown frame type.\n");
+  }
+}
+
+// ---------------------------------------------------------------------
+// True when a frame's text has no CR, LF or NUL to break a v1 line
+// ---------------------------------------------------------------------
+bool CEqbcs::FrameTextOk(const char *pData, int iLen)
+{
+  int i;
+
+  for (i = 0; i < iLen; i++) {
+    if (pData[i] == '\n' || pData[i] == '\r' || pData[i] == 0) return false;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------
+// Clean dead clients
+// ---------------------------------------------------------------------
+void CEqbcs::CleanDeadClients(void)
+{
+  CClientNode *cn = clientList;
+  CClientNode *cn_last = NULL;
+  CClientNode *cn_temp = NULL;
+
+  while (cn != NULL) {
+    if (cn->iSocketHandle == -1 && cn->closeMe == 1) {
+      SetNetBotFields(cn, "");
+      StopHandler(cn);
+      ReleaseInput(cn);
+      ReleaseRings(cn);
+      if (cn_last == NULL) // It's the head.
+        {
+        clientList = clientList->next;
+        delete cn;
+        cn = clientList;
+        bNBSubsDirty = true;
+      }
+      else {
+        cn_temp = cn;
+        cn_last->next = cn->next;
+        cn = cn->next;
+        delete cn_temp;
+        bNBSubsDirty = true;
+      }
+    }
+    else {
+      cn_last = cn;
+      cn = cn->next;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------
+// Close socket handles for dead clients
+// ---------------------------------------------------------------------
+void CEqbcs::CloseDeadClients(void)
+{
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->closeMe == 1 && (cn->iSocketHandle != -1 || cn->bDetached)) {
+      if (cn->iSocketHandle != -1) {
+        StopHandler(cn);
+        // A session that may be resumed keeps what its writer held
+        ReleaseRings(cn, cn->bAuthorized && cn->szResumeToken);
+        CSockio::iCloseSock(cn->iSocketHandle, 1, 1, EQBCS_TraceSockets);
+        cn->iSocketHandle = -1;
+        if (DetachClient(cn)) continue;
+      }
+      cn->bDetached = false;
+      cn->liveTimer->cancel();
+      if (cn->bAuthorized) NotifyClientQuit(cn->szCharName);
+      WriteLocalString("-- ");
+      WriteLocalString(cn->szCharName);
+      WriteLocalString(" has left the server.\n");
+      if (cn->bAuthorized) NoteRosterChange('-', cn->szCharName);
+      if (cn->iCheckpointSlot != -1) {
+        checkpoint->release(cn->iCheckpointSlot);
+        cn->iCheckpointSlot = -1;
+      }
+      ForgetNetBotSender(cn->uiIDNum);
+      bNBSubsDirty = true;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------
+// A RESUME session that lost its connection (not one that quit or was
+// kicked) is held quietly for RESUME_GRACE_SECS.  Its queued output
+// stays; nothing new is sent to it meanwhile.
+// ---------------------------------------------------------------------
+bool CEqbcs::DetachClient(CClientNode *cn)
+{
+  if (cn->bAuthorized == false || cn->szResumeToken == NULL) return false;
+  if (cn->lastReadError == 0 && cn->lastWriteError == 0) return false;
+
+  cn->bDetached = true;
+  timers->add(cn->liveTimer, CClientNode::TIMER_GRACE, CClientNode::RESUME_GRACE_SECS*1000);
+  cn->idleTimer->cancel();
+  cn->closeMe = 0;
+  cn->lastReadError = 0;
+  cn->lastWriteError = 0;
+  WriteLocalString("-- ");
+  WriteLocalString(cn->szCharName);
+  WriteLocalString(" lost its connection, holding the session.\n");
+  return true;
+}
+
+// ---------------------------------------------------------------------
+// Close all sockets - call before exit
+// ---------------------------------------------------------------------
+void CEqbcs::CloseAllSockets()
+{
+  if (iServerHandle != -1) {
+    CSockio::iCloseSock(iServerHandle, 1, 1, EQBCS_TraceSockets);
+    iServerHandle = -1;
+  }
+
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    ReleaseRings(cn);
+    if (cn->iSocketHandle != -1) {
+      CSockio::iCloseSock(cn->iSocketHandle, 1, 1, EQBCS_TraceSockets);
+      cn->iSocketHandle = -1;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------
+// A client finished a line: queue it up for whoever it is going to
+// ---------------------------------------------------------------------
+void CEqbcs::HandleLine(CClientNode *cn)
+{
+  // MsgTypes are handled by DoCommand inserting \t<msgtype> into the
+  // input buffer before the line read from the socket.  A line without
+  // one is MSG_TYPE_NORMAL.
+
+  int iMsgType;
+  int iClass;
+  char ch;
+
+  if (cn->inBuf->hasWaiting()) {
+    lineIn->clear();
+    iMsgType = CClientNode::MSG_TYPE_NORMAL;
+    ch = cn->inBuf->readChar();
+    if (ch == '\t') {
+      iMsgType = (unsigned char)cn->inBuf->readChar();
+    }
+    else {
+      lineIn->appendChar(ch);
+    }
+
+    if (iMsgType == CClientNode::MSG_TYPE_TELL || iMsgType == CClientNode::MSG_TYPE_BCI) {
+      iClass = CClientNode::RATE_TELL;
+    }
+    else if (iMsgType == CClientNode::MSG_TYPE_NBMSG) {
+      iClass = CClientNode::RATE_NBMSG;
+    }
+    else {
+      iClass = CClientNode::RATE_CHAT;
+    }
+
+    if (iMsgType != CClientNode::MSG_TYPE_CHANNELS && AdmitMessage(cn, iClass) == false) {
+      while (cn->inBuf->hasWaiting()) cn->inBuf->readChar();
+    }
+    else if (iMsgType == CClientNode::MSG_TYPE_TELL || iMsgType == CClientNode::MSG_TYPE_BCI) {
+      HandleTell(cn, iMsgType);
+    }
+    else {
+      while (cn->inBuf->hasWaiting()) {
+        lineIn->appendChar(cn->inBuf->readChar());
+      }
+      if (iMsgType == CClientNode::MSG_TYPE_CHANNELS) {
+        SetChannels(cn, lineIn->getsz());
+      }
+      // NBMSG is not displayed locally.
+      else if (iMsgType == CClientNode::MSG_TYPE_NBMSG) {
+        RelayNetBotPacket(cn, lineIn->getsz(), lineIn->length());
+      }
+      else {
+        RelayBroadcast(cn, iMsgType, lineIn->getsz());
+      }
+    }
+  }
+  listenBufOn = true;
+}
+
+// ---------------------------------------------------------------------
+// Kick off same name - when authorized comes, remove any other with
+// same name */
+// ---------------------------------------------------------------------
+void CEqbcs::KickOffSameName(CClientNode *cnCheck)
+{
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next)  {
+    if (cn != cnCheck && strcmp(cn->szCharName, cnCheck->szCharName) == 0) {
+      cn->closeMe = true;
+      WriteLocalString("-- Kicking off connection the same as: ");
+      WriteLocalString(cn->szCharName);
+      WriteLocalString(".\n");
+      if (strlen(cn->szCharName) < CClientNode::MAX_CHARNAMELEN-5) {
+        strcat(cn->szCharName, "-old");
+      }
+    }
+  }
+}
+
+// ---------------------------------------------------------------------
+// Login options - LOGIN=name[:OPT[:OPT...]];
+// ---------------------------------------------------------------------
+void CEqbcs::ParseLoginOptions(CClientNode *cn, const char *szOpts)
+{
+  char szOpt[256];
+  int i;
+
+  while (*szOpts == ':') {
+    szOpts++;
+    for (i=0; *szOpts != 0 && *szOpts != ':' && *szOpts != ';'; szOpts++) {
+      if (i < (int)sizeof(szOpt)-1) szOpt[i++] = *szOpts;
+    }
+    szOpt[i] = 0;
+    if (strcasecmp(szOpt, "ROSTER") == 0) {
+      cn->uiCaps |= CClientNode::CAP_ROSTER;
+    }
+    else if (strcasecmp(szOpt, "NBBATCH") == 0) {
+      cn->uiCaps |= CClientNode::CAP_NBBATCH;
+    }
+    else if (strcasecmp(szOpt, "NBID") == 0) {
+      cn->uiCaps |= CClientNode::CAP_NBID;
+    }
+    else if (strcasecmp(szOpt, "NBDELTA") == 0) {
+      cn->uiCaps |= CClientNode::CAP_NBDELTA;
+    }
+    else if (strcasecmp(szOpt, "DEFLATE") == 0) {
+      // Compressed from the byte after ';' on
+      if (cn->StartDeflate()) cn->uiCaps |= CClientNode::CAP_DEFLATE;
+    }
+    else if (strcasecmp(szOpt, "BATCH") == 0 || strncasecmp(szOpt, "BATCH=", 6) == 0) {
+      cn->iBatchMsecs = szOpt[5] ? atoi(&szOpt[6]) : CClientNode::BATCH_MSECS;
+      if (cn->iBatchMsecs < 1) cn->iBatchMsecs = 1;
+      if (cn->iBatchMsecs > CClientNode::BATCH_MSECS_MAX) {
+        cn->iBatchMsecs = CClientNode::BATCH_MSECS_MAX;
+      }
+      if (cn->batchOut == NULL) cn->batchOut = new CCharBuf();
+    }
+    else if (strcasecmp(szOpt, "V2") == 0) {
+      // Framed from the byte after ';' on
+      cn->uiCaps |= CClientNode::CAP_V2;
+    }
+    else if (strncasecmp(szOpt, "NBFIELDS=", 9) == 0) {
+      SetNetBotFields(cn, &szOpt[9]);
+    }
+    else if (strcasecmp(szOpt, "RESUME") == 0 || strncasecmp(szOpt, "RESUME=", 7) == 0) {
+      // The token to resume with until AuthorizeClient looks it up
+      if (cn->szResumeToken) delete [] cn->szResumeToken;
+      cn->szResumeToken = new char[CClientNode::RESUME_TOKEN_LEN+1];
+      strncpy(cn->szResumeToken, szOpt[6] ? &szOpt[7] : "", CClientNode::RESUME_TOKEN_LEN);
+      cn->szResumeToken[CClientNode::RESUME_TOKEN_LEN] = 0;
+    }
+  }
+}
+
+// ---------------------------------------------------------------------
+// Give a RESUME session a fresh token and tell the client
+// ---------------------------------------------------------------------
+void CEqbcs::NewResumeToken(CClientNode *cn)
+{
+  static const char *szHex = "0123456789abcdef";
+  unsigned char bytes[CClientNode::RESUME_TOKEN_LEN/2];
+  int i;
+
+  for (i=0; i < (int)sizeof(bytes); i++) bytes[i] = (unsigned char)rand();
+#ifndef UNIXWIN
+  FILE *fp = fopen("/dev/urandom", "rb");
+  if (fp) {
+    if (fread(bytes, 1, sizeof(bytes), fp) != sizeof(bytes)) {
+      for (i=0; i < (int)sizeof(bytes); i++) bytes[i] ^= (unsigned char)random();
+    }
+    fclose(fp);
+  }
+#endif
+  for (i=0; i < (int)sizeof(bytes); i++) {
+    cn->szResumeToken[i*2] = szHex[bytes[i] >> 4];
+    cn->szResumeToken[i*2+1] = szHex[bytes[i] & 15];
+  }
+  cn->szResumeToken[CClientNode::RESUME_TOKEN_LEN] = 0;
+  cn->writesz("\tRESUME=");
+  cn->writesz(cn->szResumeToken);
+  cn->writesz("\n");
+}
+
+// ---------------------------------------------------------------------
+// LOGIN=name:RESUME=token; - hand the connection to the session with
+// that name and token, if it is still held.  No join or quit goes out:
+// channels, subscriptions, NBID and unsent output carry on as they were.
+// ---------------------------------------------------------------------
+bool CEqbcs::ResumeSession(CClientNode *cn)
+{
+  CClientNode *cnOld;
+
+  for (cnOld = clientList; cnOld != NULL; cnOld = cnOld->next) {
+    if (cnOld != cn && cnOld->bAuthorized && cnOld->szResumeToken &&
+      strcmp(cnOld->szCharName, cn->szCharName) == 0 &&
+      strcmp(cnOld->szResumeToken, cn->szResumeToken) == 0 &&
+      ((cnOld->uiCaps ^ cn->uiCaps) & CClientNode::CAP_V2) == 0 &&
+      (cnOld->closeMe == 0 || cnOld->lastReadError || cnOld->lastWriteError))
+      {
+      break;
+    }
+  }
+  if (cnOld == NULL) return false;
+
+  // Its handler, if the old connection was still up, starts over on the
+  // new.  Its threads let go of the old; what the writer had not sent
+  // comes back once it has.
+  StopHandler(cnOld);
+  ReleaseRings(cnOld, true);
+  cnOld->TakeConnection(cn);
+  cnOld->cmdBufUsed = 0;
+  cnOld->ulLastActive = CClock::msecs();
+  ArmPing(cnOld);
+  ArmIdle(cnOld);
+  if (cn->iSocketHandle != -1) {
+    // The old connection had not been noticed as gone yet
+    CSockio::iCloseSock(cn->iSocketHandle, 1, 1, EQBCS_TraceSockets);
+    cn->iSocketHandle = -1;
+  }
+  cn->cmdBufUsed = 0;
+  cn->closeMe = 1;
+  WriteLocalString("-- ");
+  WriteLocalString(cnOld->szCharName);
+  WriteLocalString(" resumed its session.\n");
+  cnOld->writesz("\tRESUMED\n");
+  // The rest of the block the login came in is the session's
+  LoginDone(cnOld);
+  StartHandler(cnOld);
+  return true;
+}
+
+// ---------------------------------------------------------------------
+// Checkpoint (-k): give a logged in client its slot, and if the last
+// run left one under its name, set it up again as it was.  Whatever
+// the login itself asked for wins.
+// ---------------------------------------------------------------------
+void CEqbcs::RestoreCheckpoint(CClientNode *cn)
+{
+  const char *p;
+  int iSlot;
+
+  if (checkpoint == NULL) return;
+  if ((iSlot = checkpoint->claim(cn->szCharName)) != -1) {
+    p = checkpoint->field(iSlot, 1);
+    if (*p && cn->chanList == NULL) SetChannels(cn, p);
+    p = checkpoint->field(iSlot, 2);
+    if (*p && cn->nbSubList == NULL) {
+      cn->nbSubList = new char[strlen(p)+1];
+      strcpy(cn->nbSubList, p);
+    }
+    p = checkpoint->field(iSlot, 3);
+    if (*p && cn->nbMask == NULL) SetNetBotFields(cn, p);
+    WriteLocalString("-- ");
+    WriteLocalString(cn->szCharName);
+    WriteLocalString(" restored from checkpoint.\n");
+  }
+  else if ((iSlot = checkpoint->alloc()) == -1) {
+    WriteLocalString("-- No checkpoint slot for ");
+    WriteLocalString(cn->szCharName);
+    WriteLocalString(", it will not be restored.\n");
+  }
+  cn->iCheckpointSlot = iSlot;
+  MarkCheckpoint(cn);
+}
+
+void CEqbcs::MarkCheckpoint(CClientNode *cn)
+{
+  if (checkpoint == NULL) return;
+  cn->bCheckpointDirty = true;
+  bCheckpointDirty = true;
+}
+
+// ---------------------------------------------------------------------
+// Milliseconds until changed clients are due to be written, -1 if none
+// ---------------------------------------------------------------------
+int CEqbcs::CheckpointMsecsLeft()
+{
+  unsigned long ulSince;
+
+  if (checkpoint == NULL || bCheckpointDirty == false) return -1;
+  ulSince = CClock::msecs() - ulCheckpointLast;
+  return ulSince >= (unsigned long)CHECKPOINT_MSECS ? 0 : CHECKPOINT_MSECS - (int)ulSince;
+}
+
+// ---------------------------------------------------------------------
+// Write the clients changed since the last pass.  Each pass is timed so
+// its cost can be seen against the loop's.
+// ---------------------------------------------------------------------
+void CEqbcs::SaveCheckpoint(bool bNow)
+{
+  const char *fields[4];
+  char szLine[200];
+  unsigned long ulStart;
+  unsigned long ulSpent;
+  int iWrote = 0;
+
+  if (bNow == false && CheckpointMsecsLeft() != 0) return;
+  if (checkpoint == NULL || bCheckpointDirty == false) return;
+  ulStart = CClock::usecs();
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->bCheckpointDirty == false) continue;
+    cn->bCheckpointDirty = false;
+    if (cn->iCheckpointSlot == -1 || cn->bAuthorized == false || cn->closeMe) continue;
+    fields[0] = cn->szCharName;
+    fields[1] = cn->chanList ? cn->chanList : "";
+    fields[2] = cn->nbSubList ? cn->nbSubList : "";
+    fields[3] = cn->nbMask ? cn->nbMask->szKeys : "";
+    if (checkpoint->store(cn->iCheckpointSlot, fields)) {
+      iWrote++;
+    }
+    else {
+      WriteLocalString("-- ");
+      WriteLocalString(cn->szCharName);
+      WriteLocalString(" has too much set up to checkpoint.\n");
+    }
+  }
+  ulSpent = CClock::usecs() - ulStart;
+  bCheckpointDirty = false;
+  ulCheckpointLast = CClock::msecs();
+
+  checkpoint->uiWrites += iWrote;
+  checkpoint->ulTotalUsecs += ulSpent;
+  if (ulSpent > checkpoint->ulMaxUsecs) checkpoint->ulMaxUsecs = ulSpent;
+  if (ulSpent > (unsigned long)CHECKPOINT_WARN_USECS) {
+    sprintf(szLine, "-- Checkpoint of %d clients took %luus.\n", iWrote, ulSpent);
+    WriteLocalString(szLine);
+  }
+}
+
+// ---------------------------------------------------------------------
+// Authorize a client once a ';' shows its login may be complete
+// ---------------------------------------------------------------------
+void CEqbcs::AuthorizeClient(CClientNode *cn)
+{
+  static const char *loginTest = LOGIN_START_TOKEN;
+  char *p;
+  char szID[16];
+  int copied;
+
+  if (cn->bAuthorized || cn->closeMe) return;
+  // Looked at again when the next ';' comes in
+  if ((unsigned)cn->cmdBufUsed>strlen(loginTest) &&
+    strrchr(&cn->cmdBuf[strlen(loginTest)+1], ';'))
+    {
+    copied = 0;
+    for (p = &cn->cmdBuf[strlen(loginTest)];
+      *p != ';' && *p != ':' && copied < CClientNode::MAX_CHARNAMELEN-1; p++)
+      {
+      cn->szCharName[copied] = *p;
+      copied++;
+    }
+    cn->szCharName[copied] = 0;
+    ParseLoginOptions(cn, p);
+    if (cn->szResumeToken && cn->szResumeToken[0] && ResumeSession(cn)) {
+      return;
+    }
+    cn->iFairWeight = getWeight(cn->szCharName);
+    for (int i=0; i < CClientNode::RATE_CLASSES; i++) {
+      cn->rateLimits[i].setRate(tune.iRates[i]);
+    }
+    if (cn->szResumeToken) NewResumeToken(cn);
+    SetNetBotPrefixes(cn);
+    cn->bAuthorized = 1;
+    cn->cmdBufUsed=0;
+    ArmPing(cn);
+    ArmIdle(cn);
+    RestoreCheckpoint(cn);
+    sprintf(szID, "%u ", cn->uiIDNum);
+    idLines->appendsz("\tNBID=");
+    idLines->appendsz(szID);
+    idLines->appendsz(cn->szCharName);
+    idLines->appendsz("\n");
+    if (cn->uiCaps & CClientNode::CAP_NBID) {
+      SendNetBotIDs(cn);
+    }
+    NotifyClientJoin(cn->szCharName);
+    WriteLocalString("-- ");
+    WriteLocalString(cn->szCharName);
+    WriteLocalString(" has joined the server.\n");
+    NoteRosterChange('+', cn->szCharName);
+    bNBSubsDirty = true;
+    KickOffSameName(cn);
+  }
+}
+
+// ---------------------------------------------------------------------
+// Handle flushing local output
+// ---------------------------------------------------------------------
+void CEqbcs::HandleLocal()
+{
+  char ch;
+
+  if (listenBuf) {
+#ifndef UNIXWIN
+    // Realms may share the log, keep their lines whole
+    flockfile(LogFile);
+#endif
+    while (listenBuf->hasWaiting()) {
+      ch = listenBuf->readChar();
+      if (bLogLineStart && szRealmName) fprintf(LogFile, "[%s] ", szRealmName);
+			fprintf(LogFile, "%c", ch);
+      bLogLineStart = (ch == '\n');
+    }
+		fflush(LogFile);
+#ifndef UNIXWIN
+    funlockfile(LogFile);
+#endif
+	}
+	// Here, add remote handlers, callbacks, etc.
+}
+
+// ---------------------------------------------------------------------
+// Write to a client like CSockio::iWriteSock, or into its ring when
+// writer threads send for us.  A full ring is WOULDBLOCK; its writer
+// wakes the loop once there is room again.  Clients get a ring once
+// logged in, login replies and rejections go out from the loop.
+// ---------------------------------------------------------------------
+int CEqbcs::SendWire(CClientNode *cn, const char *pData, int iLen, int *piBytesWrote)
+{
+  int lastRet;
+
+#ifndef UNIXWIN
+  if (writers && cn->bAuthorized && cn->sendRing == NULL) {
+    CWriter *writer = writers;
+    int iDup;
+
+    for (CWriter *w = writers->next; w != NULL; w = w->next) {
+      if (w->iRings < writer->iRings) writer = w;
+    }
+    if ((iDup = dup(cn->iSocketHandle)) != -1) {
+      cn->sendRing = new CSendRing(iDup);
+      cn->sendRing->owner = cn;
+      if (cn->zDeflate == NULL) {
+        // The writer notes what it sends; the loop has it back with the ring
+        cn->sentUnit->bFrames = (cn->uiCaps & CClientNode::CAP_V2) != 0;
+        cn->sentUnit->bBatch = cn->batchOut != NULL;
+        cn->sendRing->sentUnit = cn->sentUnit;
+        cn->sentUnit = NULL;
+      }
+      writer->add(cn->sendRing);
+    }
+  }
+  if (cn->sendRing) {
+    *piBytesWrote = cn->sendRing->put(pData, iLen);
+    if (*piBytesWrote < iLen) {
+      // Then look again, in case the writer emptied it in between
+      cn->sendRing->iWaiting = 1;
+      __sync_synchronize();
+      *piBytesWrote += cn->sendRing->put(&pData[*piBytesWrote], iLen - *piBytesWrote);
+    }
+    cn->sendRing->writer->bNudge = true;
+    ulBytesOut += *piBytesWrote;
+    return (*piBytesWrote < iLen) ? CSockio::WOULDBLOCK : CSockio::OKAY;
+  }
+#endif
+  lastRet = CSockio::iWriteSock(cn->iSocketHandle, (void *)pData, iLen, piBytesWrote);
+  if (*piBytesWrote > 0) {
+    ulBytesOut += *piBytesWrote;
+    if (cn->zDeflate == NULL) {
+      // Where its messages end depends on the session's options
+      cn->sentUnit->bFrames = (cn->uiCaps & CClientNode::CAP_V2) != 0;
+      cn->sentUnit->bBatch = cn->batchOut != NULL;
+      cn->sentUnit->note(pData, *piBytesWrote);
+    }
+  }
+  return lastRet;
+}
+
+// ---------------------------------------------------------------------
+// A block of whole messages from the client's reader, into a pooled
+// block as RecvInput would read it.  -1 once the reader found the
+// connection ended and everything before that was taken.
+// ---------------------------------------------------------------------
+int CEqbcs::TakeInput(CClientNode *cn)
+{
+#ifndef UNIXWIN
+  CRecvRing *ring = cn->recvRing;
+  int iError = ring->iError;
+
+  // What came in before the end is in the ring by now
+  __sync_synchronize();
+  cn->pInput = inputPool->alloc();
+  cn->iInputPos = 0;
+  cn->iInputLen = ring->take(cn->pInput, INPUT_BLOCK_BYTES);
+  if (ring->iFull && __sync_bool_compare_and_swap(&ring->iFull, 1, 0)) {
+    // It stopped reading for want of room
+    ring->reader->nudge();
+  }
+  if (cn->iInputLen > 0) {
+    cn->ulLastHeard = CClock::msecs();
+    ChargeBytes(cn, cn->iInputLen);
+    ulBytesIn += cn->iInputLen;
+    return cn->iInputLen;
+  }
+  ReleaseInput(cn);
+  if (iError) {
+    cn->lastReadError = 1;
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+// ---------------------------------------------------------------------
+// Input there is no need to wait for a socket to get: inflated and not
+// stepped through yet, or handed over by a reader
+// ---------------------------------------------------------------------
+bool CEqbcs::InputWaiting(CClientNode *cn)
+{
+  if (cn->zIn && cn->zIn->hasWaiting()) return true;
+#ifndef UNIXWIN
+  if (cn->recvRing && (cn->recvRing->used() > 0 || cn->recvRing->iError)) return true;
+#endif
+  return false;
+}
+
+// ---------------------------------------------------------------------
+// Readers and writers (-f "readers", "writers"): receiving and sending
+// move off the loop onto threads of their own, and the loop only
+// routes.  Only when starting, and not on Windows.
+// ---------------------------------------------------------------------
+void CEqbcs::StartStages()
+{
+#ifndef UNIXWIN
+  char szLine[100];
+
+  // The threads wake the loop through it
+  if (iWakeFds[1] == -1) return;
+  for (int i=0; i < tune.iReaders; i++) {
+    readers = new CReader(iWakeFds[1], &recvQueue, readers);
+    if (readers->start() == false) {
+      WriteLocalString("-- Cannot start reader threads, receiving on the loop.\n");
+      StopStages();
+      return;
+    }
+  }
+  for (int i=0; i < tune.iWriters; i++) {
+    writers = new CWriter(iWakeFds[1], &sendQueue, writers);
+    if (writers->start() == false) {
+      WriteLocalString("-- Cannot start writer threads, sending from the loop.\n");
+      StopStages();
+      return;
+    }
+  }
+  if (readers) {
+    sprintf(szLine, "-- Receiving on %d reader thread%s.\n", tune.iReaders,
+      tune.iReaders == 1 ? "" : "s");
+    WriteLocalString(szLine);
+  }
+  if (writers) {
+    sprintf(szLine, "-- Sending on %d writer thread%s.\n", tune.iWriters,
+      tune.iWriters == 1 ? "" : "s");
+    WriteLocalString(szLine);
+  }
+#endif
+}
+
+// ---------------------------------------------------------------------
+// Stop the threads and take their rings back: unsent output in front
+// of what the loop still holds, input not taken yet after what it has,
+// so the loop can carry on without them
+// ---------------------------------------------------------------------
+void CEqbcs::StopStages()
+{
+#ifndef UNIXWIN
+  CReader *reader;
+  CWriter *writer;
+  CRecvRing *recvRing;
+  CSendRing *sendRing;
+
+  if (readers == NULL && writers == NULL) return;
+  for (reader = readers; reader != NULL; reader = reader->next) reader->stop();
+  for (writer = writers; writer != NULL; writer = writer->next) writer->stop();
+
+  // Joined, so everything they did to the rings is seen
+  while ((sendRing = retiredSend) != NULL) {
+    retiredSend = sendRing->nextRetired;
+    if (sendRing->owner) TakeRingBack(sendRing->owner);
+    else delete sendRing;
+  }
+  while ((recvRing = retiredRecv) != NULL) {
+    retiredRecv = recvRing->nextRetired;
+    delete recvRing;
+  }
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->sendRing) {
+      TakeRingBack(cn);
+      reactor->post(cn, CReactor::EV_WRITE);
+    }
+    if (cn->recvRing) TakeInputBack(cn);
+  }
+  recvQueue = NULL;
+  sendQueue = NULL;
+  while ((reader = readers) != NULL) {
+    readers = reader->next;
+    delete reader;
+  }
+  while ((writer = writers) != NULL) {
+    writers = writer->next;
+    delete writer;
+  }
+#endif
+}
+
+// ---------------------------------------------------------------------
+// A logged in client's input goes to the reader with the fewest
+// connections.  DEFLATE's stays on the loop, where zlib is.
+// ---------------------------------------------------------------------
+void CEqbcs::GiveToReader(CClientNode *cn)
+{
+#ifndef UNIXWIN
+  CReader *reader = readers;
+  CRecvRing *ring;
+  int iDup;
+
+  if (readers == NULL || cn->recvRing || cn->bAuthorized == false || cn->zInflate ||
+    cn->iSocketHandle == -1 || cn->closeMe)
+    {
+    return;
+  }
+  for (CReader *r = readers->next; r != NULL; r = r->next) {
+    if (r->iRings < reader->iRings) reader = r;
+  }
+  if ((iDup = dup(cn->iSocketHandle)) == -1) return;
+  ring = new CRecvRing(iDup);
+  ring->bFrames = (cn->uiCaps & CClientNode::CAP_V2) != 0;
+  // Partway through a frame, the reader carries on from there
+  ring->iHdrUsed = cn->frameHdrUsed;
+  memcpy(ring->hdr, cn->frameHdr, 3);
+  if (ring->iHdrUsed == 3) {
+    ring->iFrameLeft = ((ring->hdr[1] << 8) | ring->hdr[2]) - cn->frameIn->length();
+  }
+  ring->owner = cn;
+  cn->recvRing = ring;
+  reader->add(ring);
+#endif
+}
+
+// ---------------------------------------------------------------------
+// The client's connection is going: its threads let go of its rings,
+// which are freed once they have.  Nothing waits for them.  With
+// bKeepOutput, for a session that may be resumed, the send ring stays
+// the client's and what it had not sent comes back to it then.
+// ---------------------------------------------------------------------
+void CEqbcs::ReleaseRings(CClientNode *cn, bool bKeepOutput)
+{
+#ifndef UNIXWIN
+  CRecvRing *recvRing = cn->recvRing;
+  CSendRing *sendRing = cn->sendRing;
+
+  if (recvRing) {
+    cn->recvRing = NULL;
+    recvRing->owner = NULL;
+    recvRing->reader->iRings--;
+    recvRing->iClosing = 1;
+    recvRing->reader->nudge();
+    recvRing->nextRetired = retiredRecv;
+    retiredRecv = recvRing;
+  }
+  if (sendRing == NULL) return;
+  if (sendRing->iClosing == 0) {
+    sendRing->writer->iRings--;
+    sendRing->iClosing = 1;
+    sendRing->writer->nudge();
+    sendRing->nextRetired = retiredSend;
+    retiredSend = sendRing;
+  }
+  if (bKeepOutput == false) {
+    sendRing->owner = NULL;
+    cn->sendRing = NULL;
+  }
+#endif
+}
+
+// ---------------------------------------------------------------------
+// Unsent bytes of a send ring its writer is done with go back in front
+// of the client's output, and the ring is freed.  If the session was
+// resumed on a new connection meanwhile, the message the writer was
+// partway through goes again whole; DEFLATE's bytes, compressed for
+// the old stream, can't.
+// ---------------------------------------------------------------------
+void CEqbcs::TakeRingBack(CClientNode *cn)
+{
+#ifndef UNIXWIN
+  CSendRing *ring = cn->sendRing;
+  CCharBuf *unsent = new CCharBuf();
+
+  if (ring->bMoved) {
+    if (ring->sentUnit) {
+      unsent->write(ring->sentUnit->sent->getsz(), ring->sentUnit->sent->length());
+      ring->copyOut(unsent);
+      cn->PutBack(unsent, true);
+    }
+    else {
+      delete unsent;
+    }
+  }
+  else {
+    ring->copyOut(unsent);
+    cn->PutBack(unsent);
+    if (ring->sentUnit) {
+      delete cn->sentUnit;
+      cn->sentUnit = ring->sentUnit;
+      ring->sentUnit = NULL;
+    }
+  }
+  delete ring;
+  cn->sendRing = NULL;
+#endif
+}
+
+// ---------------------------------------------------------------------
+// Its reader is stopped: what it read and the loop had not taken, a
+// partial message too, goes after what the loop holds
+// ---------------------------------------------------------------------
+void CEqbcs::TakeInputBack(CClientNode *cn)
+{
+#ifndef UNIXWIN
+  CRecvRing *ring = cn->recvRing;
+  int iLeft = cn->iInputLen - cn->iInputPos;
+  int iRing = (int)(ring->uiRecvd - ring->uiTail);
+
+  if (iRing > 0) {
+    if (cn->pInput == NULL) {
+      cn->pInput = inputPool->alloc();
+      iLeft = 0;
+    }
+    else {
+      memmove(cn->pInput, &cn->pInput[cn->iInputPos], iLeft);
+    }
+    ring->copyOut(&cn->pInput[iLeft]);
+    cn->iInputPos = 0;
+    cn->iInputLen = iLeft + iRing;
+    ChargeBytes(cn, iRing);
+    ulBytesIn += iRing;
+  }
+  delete ring;
+  cn->recvRing = NULL;
+  reactor->post(cn, CReactor::EV_READ);
+#endif
+}
+
+// ---------------------------------------------------------------------
+// Rings the threads queued while the loop was in select: input for a
+// handler, room it was waiting for, or an error.  Each queue is taken
+// whole.
+// ---------------------------------------------------------------------
+void CEqbcs::PostRingEvents()
+{
+#ifndef UNIXWIN
+  CRecvRing *recvRing = __sync_lock_test_and_set(&recvQueue, (CRecvRing *)NULL);
+  CSendRing *sendRing = __sync_lock_test_and_set(&sendQueue, (CSendRing *)NULL);
+  CRecvRing *recvNext;
+  CSendRing *sendNext;
+  CClientNode *cn;
+
+  while (recvRing != NULL) {
+    recvNext = recvRing->nextQueued;
+    // From here on it may be queued again
+    recvRing->iQueued = 0;
+    __sync_synchronize();
+    if (recvRing->owner) reactor->post(recvRing->owner, CReactor::EV_READ);
+    recvRing = recvNext;
+  }
+  while (sendRing != NULL) {
+    sendNext = sendRing->nextQueued;
+    sendRing->iQueued = 0;
+    __sync_synchronize();
+    if ((cn = sendRing->owner) != NULL && sendRing->iClosing == 0) {
+      if (sendRing->iError && cn->lastWriteError == 0) {
+        cn->closeMe = 1;
+        cn->lastWriteError = sendRing->iError;
+      }
+      reactor->post(cn, CReactor::EV_WRITE);
+    }
+    sendRing = sendNext;
+  }
+#endif
+}
+
+// ---------------------------------------------------------------------
+// Free the rings their threads have let go of and the loop no longer
+// has queued.  A send ring kept for a session gives it its output back.
+// ---------------------------------------------------------------------
+void CEqbcs::FreeRetiredRings()
+{
+#ifndef UNIXWIN
+  CRecvRing **pRecv = &retiredRecv;
+  CSendRing **pSend = &retiredSend;
+  CRecvRing *recvRing;
+  CSendRing *sendRing;
+  CClientNode *cn;
+
+  while ((recvRing = *pRecv) != NULL) {
+    if (recvRing->iReleased) {
+      // Everything its reader did to it is seen before we look
+      __sync_synchronize();
+      if (recvRing->iQueued == 0) {
+        *pRecv = recvRing->nextRetired;
+        delete recvRing;
+        continue;
+      }
+    }
+    pRecv = &recvRing->nextRetired;
+  }
+  while ((sendRing = *pSend) != NULL) {
+    if (sendRing->iReleased) {
+      __sync_synchronize();
+      if (sendRing->iQueued == 0) {
+        *pSend = sendRing->nextRetired;
+        if ((cn = sendRing->owner) != NULL) {
+          TakeRingBack(cn);
+          reactor->post(cn, CReactor::EV_WRITE | CReactor::EV_OUT);
+        }
+        else {
+          delete sendRing;
+        }
+        continue;
+      }
+    }
+    pSend = &sendRing->nextRetired;
+  }
+#endif
+}
+
+// ---------------------------------------------------------------------
+// Milliseconds until the next stats line is due, -1 if they are off
+// ---------------------------------------------------------------------
+int CEqbcs::StatsMsecsLeft()
+{
+  unsigned long ulSince = CClock::msecs() - ulStatsStart;
+
+  if (tune.iStatsSecs <= 0) return -1;
+  if (ulSince >= (unsigned long)tune.iStatsSecs*1000) return 0;
+  return (int)(tune.iStatsSecs*1000 - ulSince);
+}
+
+// ---------------------------------------------------------------------
+// Stats (-f "stats"): what each stage got through since the last line,
+// and what waits in front of it.  Readers queue whole messages in their
+// rings, full ones until the loop takes some; the loop holds input back
+// for clients over their rate limit, and output the socket or ring has
+// no room for; the rings queue for the writers.
+// ---------------------------------------------------------------------
+void CEqbcs::LogStats()
+{
+  char szLine[300];
+  unsigned long ulNow = CClock::msecs();
+  unsigned long ulMsecs = ulNow - ulStatsStart;
+  long lWaiting = 0;
+  int iHeld = 0;
+
+  if (ulMsecs == 0) ulMsecs = 1;
+  WriteLocalString("-- Stages: ");
+#ifndef UNIXWIN
+  int iReader = 1;
+
+  for (CReader *reader = readers; reader != NULL; reader = reader->next, iReader++) {
+    unsigned long ulBytes = reader->ulBytes;
+    unsigned long ulMsgs = reader->ulMsgs;
+    long lQueued = 0;
+    int iFull = 0;
+
+    for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+      if (cn->recvRing && cn->recvRing->reader == reader) {
+        lQueued += cn->recvRing->used();
+        if (cn->recvRing->iFull) iFull++;
+      }
+    }
+    sprintf(szLine, "reader %d %lu msgs/s, %lu bytes/s, %d full, %ld queued; ",
+      iReader, (ulMsgs - reader->ulStatsMsgs)*1000/ulMsecs,
+      (ulBytes - reader->ulStatsBytes)*1000/ulMsecs, iFull, lQueued);
+    WriteLocalString(szLine);
+    reader->ulStatsBytes = ulBytes;
+    reader->ulStatsMsgs = ulMsgs;
+  }
+  if (readers == NULL)
+#endif
+  {
+    sprintf(szLine, "read %lu bytes/s; ", ulBytesIn*1000/ulMsecs);
+    WriteLocalString(szLine);
+  }
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->pInput) iHeld++;
+    lWaiting += cn->pendingOut();
+#ifndef UNIXWIN
+    if (cn->sendRing) lWaiting -= cn->sendRing->used();
+#endif
+  }
+  sprintf(szLine, "route %lu msgs/s, %d held, %lu passes/s, %lu%% busy, "
+    "%lu bytes/s out, %ld waiting",
+    ulMsgsIn*1000/ulMsecs, iHeld, ulPasses*1000/ulMsecs,
+    ulBusyMsecs*100/ulMsecs, ulBytesOut*1000/ulMsecs, lWaiting);
+  WriteLocalString(szLine);
+#ifndef UNIXWIN
+  int iWriter = 1;
+
+  for (CWriter *writer = writers; writer != NULL; writer = writer->next, iWriter++) {
+    unsigned long ulBytes = writer->ulBytes;
+    unsigned long ulSends = writer->ulSends;
+    unsigned long ulStalls = writer->ulStalls;
+    long lQueued = 0;
+
+    for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+      if (cn->sendRing && cn->sendRing->writer == writer) lQueued += cn->sendRing->used();
+    }
+    sprintf(szLine, "; writer %d %lu bytes/s, %lu sends/s, %lu stalls, %ld queued",
+      iWriter, (ulBytes - writer->ulStatsBytes)*1000/ulMsecs,
+      (ulSends - writer->ulStatsSends)*1000/ulMsecs, ulStalls - writer->ulStatsStalls, lQueued);
+    WriteLocalString(szLine);
+    writer->ulStatsBytes = ulBytes;
+    writer->ulStatsSends = ulSends;
+    writer->ulStatsStalls = ulStalls;
+  }
+#endif
+  WriteLocalString(".\n");
+  ulStatsStart = ulNow;
+  ulBytesIn = ulMsgsIn = 0;
+  ulPasses = ulBusyMsecs = 0;
+  ulBytesOut = 0;
+}
+
+// ---------------------------------------------------------------------
+// Check Clients: remove dead connections, and send what the server
+// queued itself
+// ---------------------------------------------------------------------
+int CEqbcs::CheckClients(void)
+{
+  int iRetCode = 0;
+
+  CloseDeadClients();
+  CleanDeadClients();
+  FreeRetiredRings();
+  HandleLocal();
+  NotifyNetBotChanges();
+  SaveCheckpoint();
+
+  if (listenBuf) {
+    while (listenBuf->hasWaiting()) {
+      iRetCode = 1;
+      WriteLocalChar(listenBuf->readChar());
+    }
+  }
+  // Only the handlers that got output run
+  reactor->run();
+  return iRetCode;
+}
+
+// ---------------------------------------------------------------------
+// Setup which sockets to listen on
+// ---------------------------------------------------------------------
+void CEqbcs::SetupSelect(fd_set *fds, fd_set *wfds)
+{
+  FD_ZERO(fds);
+  FD_ZERO(wfds);
+
+  // setup which sockets to listen on
+  FD_SET((unsigned)iServerHandle, fds);
+  if (iWakeFds[0] != -1) FD_SET((unsigned)iWakeFds[0], fds);
+
+  // Whatever each handler is suspended for.  A client's reader and
+  // writer wake us themselves.
+  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+    if (cn->iSocketHandle != -1 && cn->closeMe != 1) {
+      if ((cn->iWant & CReactor::EV_READ) && cn->recvRing == NULL) {
+        FD_SET((unsigned)cn->iSocketHandle, fds);
+      }
+      if ((cn->iWant & CReactor::EV_WRITE) && cn->sendRing == NULL) {
+        FD_SET((unsigned)cn->iSocketHandle, wfds);
+      }
+    }
+  }
+}
+
+// ---------------------------------------------------------------------
+// Print Welcome
+// ---------------------------------------------------------------------
+void CEqbcs::PrintWelcome(void)
+{
+  char szPort[10];
+  sprintf(szPort, "%d", iPort);
+
+  WriteLocalString(Title);
+  WriteLocalString(" ");
+  WriteLocalString(Version);
+  WriteLocalString("\nWaiting for connections on port: ");
+  WriteLocalString(szPort);
+  WriteLocalString("...\n");
+}
+
+// ---------------------------------------------------------------------
+// One pass of the loop: relay what is ready, then wait for sockets or
+// the next deadline, at most iMaxWaitMsecs unless that is -1 (0 just
+// polls).  Returns 1 once the server has been told to stop.
+// ---------------------------------------------------------------------
+int CEqbcs::runOnce(int iMaxWaitMsecs)
+{
+  int iPending;
+  //int iExtraHandles=5;
+  // Extra handles for select (STDIN, OUT, ERR..)
+  // Not supposed to matter, but it has before
+  fd_set fds;
+  fd_set wfds;
+  fd_set empty_fds2;
+  // Not worrying about FD_SETSIZE - if too small, then fix/recompile
+  struct timeval timeOut;
+  int selectMax;
+  int iMsecsLeft;
+  int iOtherLeft;
+
+  if (iExitNow || amRunning == 0) return 1;
+  FD_ZERO(&empty_fds2);
+
+  ulLoopMsecs = ulWorkStart;
+  CheckClients();
+  // Only sent while the loop is turning
+  if (WatchdogMsecsLeft() == 0) {
+    NotifyServiceManager("WATCHDOG=1");
+    ulWatchdogLast = CClock::msecs();
+  }
+#ifndef UNIXWIN
+  // Between reads: input held back by a rate limit goes along too
+  if (iUpgradeCaught) {
+    iUpgradeCaught = 0;
+    HotUpgrade();
+    if (iExitNow) return 1;
+  }
+  if (iSigHupCaught) {
+    iSigHupCaught = 0;
+    if (szConfigFile) ReadConfig();
+    else WriteLocalString("-- SIGHUP: no config file (-f) to reload.\n");
+    HandleLocal();
+  }
+  // Once a pass, not for every put
+  for (CWriter *writer = writers; writer != NULL; writer = writer->next) {
+    if (writer->bNudge) writer->nudge();
+  }
+#endif
+  if (StatsMsecsLeft() == 0) LogStats();
+  ulPasses++;
+  ulBusyMsecs += CClock::msecs() - ulWorkStart;
+  UpdateOverload((int)(CClock::msecs() - ulWorkStart));
+  SetupSelect(&fds, &wfds);
+
+#ifdef UNIXWIN
+  selectMax = getMaxFD();
+#else
+  selectMax = getdtablesize();
+#endif
+
+  try {
+    // Sleep until the nearest deadline
+    if ((iMsecsLeft = timers->msecsLeft(CClock::msecs())) < 0) {
+      iMsecsLeft = tune.iIdleWakeMsecs;
+    }
+    if ((iOtherLeft = NotifyMsecsLeft()) >= 0 && iOtherLeft < iMsecsLeft) {
+      iMsecsLeft = iOtherLeft;
+    }
+    // Batches, rate limits and inflated input left over
+    if ((iOtherLeft = reactor->msecsLeft(CClock::msecs())) >= 0 && iOtherLeft < iMsecsLeft) {
+      iMsecsLeft = iOtherLeft;
+    }
+    if ((iOtherLeft = OverloadMsecsLeft()) >= 0 && iOtherLeft < iMsecsLeft) {
+      iMsecsLeft = iOtherLeft;
+    }
+    if ((iOtherLeft = CheckpointMsecsLeft()) >= 0 && iOtherLeft < iMsecsLeft) {
+      iMsecsLeft = iOtherLeft;
+    }
+    if ((iOtherLeft = WatchdogMsecsLeft()) >= 0 && iOtherLeft < iMsecsLeft) {
+      iMsecsLeft = iOtherLeft;
+    }
+    if ((iOtherLeft = StatsMsecsLeft()) >= 0 && iOtherLeft < iMsecsLeft) {
+      iMsecsLeft = iOtherLeft;
+    }
+    if (iMaxWaitMsecs >= 0 && iMaxWaitMsecs < iMsecsLeft) {
+      iMsecsLeft = iMaxWaitMsecs;
+    }
+    timeOut.tv_sec = iMsecsLeft/1000;
+    timeOut.tv_usec = (iMsecsLeft%1000)*1000 + (iMsecsLeft ? 50 : 0);
+    iPending=select(selectMax, &fds, &wfds, &empty_fds2, &timeOut);
+    ulWorkStart = CClock::msecs();
+#ifndef UNIXWIN
+    if (iPending > 0 && iWakeFds[0] != -1 && FD_ISSET(iWakeFds[0], &fds)) {
+      char szDrain[64];
+
+      while (read(iWakeFds[0], szDrain, sizeof(szDrain)) > 0);
+    }
+#endif
+  }
+  catch(char * str) {
+    CTrace::dbg("Exception: %s", str);
+  }
+
+  if ((iPending<0) && (errno!=EINTR)) { // there was an error with select()
+#ifdef UNIXWIN
+    CSockio::vPrintSockErr();
+    WSASetLastError(0);
+#else
+    perror("select() error");
+#endif
+  }
+  PostRingEvents();
+  if (iPending >= 0 && iExitNow == 0) {
+    if (iPending > 0 && FD_ISSET(iServerHandle, &fds)) {
+      HandleNewClient(&sockAddress);
+    }
+    if (iPending > 0) PostEvents(&fds, &wfds);
+  }
+  RunTimers();
+  reactor->expire(CClock::msecs());
+  reactor->run();
+  return iExitNow ? 1 : 0;
+}
+
+// ---------------------------------------------------------------------
+// Close down after the last runOnce: everyone is disconnected, the log
+// closed if it is ours.  start() may be called again afterwards.
+// ---------------------------------------------------------------------
+void CEqbcs::shutdown()
+{
+  CClientNode *cn_next;
+
+  if (amRunning == 0) return;
+  StopStages();
+  // After a hot upgrade the service carries on in the new process
+  if (iServerHandle != -1 && szRealmName == NULL) NotifyServiceManager("STOPPING=1");
+  if (realms == NULL) {
+    char szLine[200];
+
+    sprintf(szLine, "-- Served %u connections, %u rejected, %d at once at most.\n",
+      uiAccepted, uiLoginsRejected, iPeakClients);
+    WriteLocalString(szLine);
+    HandleLocal();
+  }
+  if (checkpoint) {
+    char szLine[200];
+
+    SaveCheckpoint(true);
+    sprintf(szLine, "-- Checkpoint: %u client writes, %luus in all, %luus at most, %u not given a slot.\n",
+      checkpoint->uiWrites, checkpoint->ulTotalUsecs, checkpoint->ulMaxUsecs,
+      checkpoint->uiAllocFailures);
+    WriteLocalString(szLine);
+    HandleLocal();
+    delete checkpoint;
+    checkpoint = NULL;
+  }
+  for (CClientNode *cn = clientList; cn != NULL; cn = cn->next) {
+    cn->closeMe = 1;
+  }
+  CloseAllSockets();
+  CSockio::vShutdownSockets();
+  for (CClientNode *cn = clientList; cn != NULL; cn = cn_next) {
+    cn_next = cn->next;
+    StopHandler(cn);
+    ReleaseInput(cn);
+    delete cn;
+  }
+  clientList = NULL;
+  iServerHandle = -1;
+#ifndef UNIXWIN
+  if (iWakeFds[0] != -1) {
+    close(iWakeFds[0]);
+    close(iWakeFds[1]);
+    iWakeFds[0] = iWakeFds[1] = -1;
+  }
+#endif
+  if (LogFile!=stdout && bLogShared == false) {
+    fclose(LogFile);
+    LogFile = stdout;
+  }
+  amRunning = 0;
+}
+
+#ifndef UNIXWIN
+// ---------------------------------------------------------------------
+// Hot upgrade.  SIGUSR2 execs the binary again with -U <fd>, sends it
+// the listening socket, every connection and its state over a Unix
+// socket, and exits once the new process has taken them.  Clients see
+// no disconnect.  DEFLATE connections can't carry their zlib state over
+// and are closed, and the new process tells the others they left.
+// Sessions held for a RESUME go over as they are.
+// ---------------------------------------------------------------------
+void CEqbcs::HotUpgrade()
+{
+  int sv[2];
+  int i;
+  int iArgs;
+  pid_t pid;
+  char szFd[32];
+  char **newArgv;
+  struct timeval tvWait;
+
+  WriteLocalString("-- Upgrade requested.\n");
+  HandleLocal();
+  if (upgradeArgv == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    WriteLocalString("-- Upgrade failed: no socket pair.\n");
+    return;
+  }
+  // Quits not announced yet, and notifications still in their window,
+  // go out first so they are part of the output that goes over
+  CloseDeadClients();
+  NotifyNetBotChanges(true);
+  FlushNetBotIDs();
+  // What the threads hold goes over with the rest, and none run across
+  // the fork
+  StopStages();
+  // A new process that stops reading is not waited on forever
+  tvWait.tv_sec = UPGRADE_WAIT_MSECS / 1000;
+  tvWait.tv_usec = (UPGRADE_WAIT_MSECS % 1000) * 1000;
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tvWait, sizeof(tvWait));
+
+  pid = fork();
+  if (pid == 0) {
+    // Only the pair goes over the exec, the rest comes through it
+    for (i=3; i < getdtablesize(); i++) {
+      if (i != sv[1]) close(i);
+    }
+    for (iArgs=0; upgradeArgv[iArgs]; iArgs++);
+    newArgv = new char*[iArgs+3];
+    for (i=0, iArgs=0; upgradeArgv[i]; i++) {
+      if (strcmp(upgradeArgv[i], "-U") == 0 && upgradeArgv[i+1]) i++;
+      else newArgv[iArgs++] = upgradeArgv[i];
+    }
+    sprintf(szFd, "%d", sv[1]);
+    newArgv[iArgs++] = (char *)"-U";
+    newArgv[iArgs++] = szFd;
+    newArgv[iArgs] = NULL;
+    execvp(newArgv[0], newArgv);
+    perror("Upgrade exec");
+    _exit(127);
+  }
+  close(sv[1]);
+
+  if (pid > 0 && SendUpgrade(sv[0]) && UpgradeTaken(sv[0])) {
+    // The new process has everything: close our copies without a
+    // shutdown, which would end the connections for it too
+    for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
+      if (cn->iSocketHandle != -1 && (cn->uiCaps & CClientNode::CAP_DEFLATE) == 0) {
+        close(cn->iSocketHandle);
+        cn->iSocketHandle = -1;
+      }
+    }
+    close(iServerHandle);
+    iServerHandle = -1;
+    close(sv[0]);
+    sprintf(szFd, "%d", (int)pid);
+    WriteLocalString("-- Upgrade handed over to process ");
+    WriteLocalString(szFd);
+    WriteLocalString(".\n");
+    HandleLocal();
+    iExitNow = 1;
+    return;
+  }
+
+  close(sv[0]);
+  if (pid > 0) {
+    // It may be alive but stuck, and must not take over later
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    // It may have told the service manager it was the main process
+    sprintf(szFd, "MAINPID=%d\n", (int)getpid());
+    NotifyServiceManager(szFd);
+  }
+  WriteLocalString("-- Upgrade failed, carrying on.\n");
+  StartStages();
+}
+
+// ---------------------------------------------------------------------
+// The new process answers "OK" once it has everything
+// ---------------------------------------------------------------------
+bool CEqbcs::UpgradeTaken(int iSock)
+{
+  struct pollfd pfd;
+  char szOk[2];
+  int iGot = 0;
+  int iLen;
+  int iLeft;
+  unsigned long ulStart = CClock::msecs();
+
+  pfd.fd = iSock;
+  pfd.events = POLLIN;
+  while (iGot < 2) {
+    if ((iLeft = UPGRADE_WAIT_MSECS - (int)(CClock::msecs() - ulStart)) <= 0) return false;
+    pfd.revents = 0;
+    if ((iLen = poll(&pfd, 1, iLeft)) < 0 && errno == EINTR) continue;
+    if (iLen <= 0) return false;
+    if ((iLen = (int)read(iSock, &szOk[iGot], 2 - iGot)) <= 0) return false;
+    iGot += iLen;
+  }
+  return memcmp(szOk, "OK", 2) == 0;
+}
+
+// ---------------------------------------------------------------------
+// Records are [tag byte + handle] then a 4 byte length and the fields,
+// each a 4 byte length and its bytes; numbers go as decimal text.
+// ---------------------------------------------------------------------
+void CEqbcs::PackField(CStrBuf *rec, const char *pData, int iLen)
+{
+  unsigned char len[4];
+
+  len[0] = (unsigned char)(iLen >> 24);
+  len[1] = (unsigned char)(iLen >> 16);
+  len[2] = (unsigned char)(iLen >> 8);
+  len[3] = (unsigned char)iLen;
+  rec->append((const char *)len, 4);
+  rec->append(pData, iLen);
+}
+
+void CEqbcs::PackNum(CStrBuf *rec, unsigned uiNum)
+{
+  char szNum[16];
+
+  sprintf(szNum, "%u", uiNum);
+  PackField(rec, szNum, (int)strlen(szNum));
+}
+
+void CEqbcs::PackBuf(CStrBuf *rec, CCharBuf *buf)
+{
+  CStrBuf *data = new CStrBuf();
+
+  CopyBuf(data, buf);
+  PackField(rec, data->getsz(), data->length());
+  delete data;
+}
+
+// Append what is waiting in buf without consuming it
+void CEqbcs::CopyBuf(CStrBuf *out, CCharBuf *buf)
+{
+  int iLen = buf ? buf->waiting() : 0;
+  char *pData = new char[iLen+1];
+
+  if (buf) buf->peek(pData, iLen);
+  out->append(pData, iLen);
+  delete [] pData;
+}
+
+const char *CEqbcs::UnpackField(CStrBuf *rec, int *piPos, int *piLen)
+{
+  const unsigned char *p = (const unsigned char *)rec->getsz() + *piPos;
+
+  if (*piPos + 4 > rec->length()) {
+    *piLen = 0;
+    return "";
+  }
+  *piLen = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  if (*piLen < 0 || *piPos + 4 + *piLen > rec->length()) *piLen = 0;
+  *piPos += 4 + *piLen;
+  return (const char *)p + 4;
+}
+
+unsigned CEqbcs::UnpackNum(CStrBuf *rec, int *piPos)
+{
+  char szNum[16];
+  int iLen;
+  const char *p = UnpackField(rec, piPos, &iLen);
+
+  if (iLen > (int)sizeof(szNum)-1) iLen = sizeof(szNum)-1;
+  memcpy(szNum, p, iLen);
+  szNum[iLen] = 0;
+  return (unsigned)strtoul(szNum, NULL, 10);
+}
+
+bool CEqbcs::SendHandle(int iSock, char chTag, int iHandle, CStrBuf *rec)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  char cmsgBuf[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmsg;
+  unsigned char len[4];
+  int iLen = rec->length();
+  int iSent;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &chTag;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (iHandle >= 0) {
+    msg.msg_control = cmsgBuf;
+    msg.msg_controllen = sizeof(cmsgBuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &iHandle, sizeof(int));
+  }
+  if (sendmsg(iSock, &msg, 0) != 1) return false;
+
+  len[0] = (unsigned char)(iLen >> 24);
+  len[1] = (unsigned char)(iLen >> 16);
+  len[2] = (unsigned char)(iLen >> 8);
+  len[3] = (unsigned char)iLen;
+  if (write(iSock, len, 4) != 4) return false;
+  for (int iDone=0; iDone < iLen; iDone += iSent) {
+    if ((iSent = (int)write(iSock, rec->getsz() + iDone, iLen - iDone)) <= 0) return false;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------
+// Returns the handle sent with the record, -1 for none, -2 on error
+// ---------------------------------------------------------------------
+int CEqbcs::RecvHandle(int iSock, char *pchTag, CStrBuf *rec)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  char cmsgBuf[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmsg;
+  unsigned char len[4];
+  char buf[4096];
+  int iHandle = -1;
+  int iLen;
+  int iGot;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = pchTag;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgBuf;
+  msg.msg_controllen = sizeof(cmsgBuf);
+  if (recvmsg(iSock, &msg, 0) != 1) return -2;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(&iHandle, CMSG_DATA(cmsg), sizeof(int));
+  }
+
+  for (iGot=0; iGot < 4; iGot += iLen) {
+    if ((iLen = (int)read(iSock, &len[iGot], 4 - iGot)) <= 0) return -2;
+  }
+  iLen = (len[0] << 24) | (len[1] << 16) | (len[2] << 8) | len[3];
+  rec->clear();
+  while (iLen > 0) {
+    if ((iGot = (int)read(iSock, buf, iLen < (int)sizeof(buf) ? iLen : (int)sizeof(buf))) <= 0) {
+      return -2;
+    }
+    rec->append(buf, iGot);
+    iLen -= iGot;
+  }
+  return iHandle;
+}
+
+// ---------------------------------------------------------------------
+// Old process: the server record, one per connection (C) or session
+// held for a RESUME (D), the names of DEFLATE clients that can't go
+// over (Q), then the end
+// ---------------------------------------------------------------------
+bool CEqbcs::SendUpgrade(int iSock)
+{
+  CStrBuf *rec = new CStrBuf();
+  CSenderQueue *queue;
+  CStrBuf *out = new CStrBuf();
+  bool bOk;
+
+  PackNum(rec, uiRosterVersion);
+  PackNum(rec, uiNextIDNum);
+  // The environment still names this process as the watchdog's
+  PackNum(rec, (unsigned)iWatchdogMsecs);
+  bOk = SendHandle(iSock, 'S', iServerHandle, rec);
+
+  for (CClientNode *cn=clientList; bOk && cn != NULL; cn = cn->next) {
+    if (cn->closeMe) continue;
+    if (cn->bDetached == false &&
+      (cn->iSocketHandle == -1 || (cn->uiCaps & CClientNode::CAP_DEFLATE)))
+      {
+      if (cn->iSocketHandle != -1 && cn->bAuthorized) {
+        rec->clear();
+        PackField(rec, cn->szCharName, (int)strlen(cn->szCharName));
+        bOk = SendHandle(iSock, 'Q', -1, rec);
+      }
+      continue;
+    }
+    rec->clear();
+    PackField(rec, cn->szCharName, (int)strlen(cn->szCharName));
+    PackNum(rec, cn->bAuthorized ? 1 : 0);
+    PackNum(rec, cn->uiIDNum);
+    // A held session's next connection brings its own DEFLATE
+    PackNum(rec, cn->uiCaps & ~CClientNode::CAP_DEFLATE);
+    PackNum(rec, cn->uiRosterVersion);
+    PackNum(rec, cn->bLocalEcho ? 1 : 0);
+    PackNum(rec, cn->bCmdMode ? 1 : 0);
+    PackNum(rec, (unsigned char)cn->lastChar);
+    PackNum(rec, (unsigned)cn->iBatchMsecs);
+    PackField(rec, cn->chanList ? cn->chanList : "", cn->chanList ? (int)strlen(cn->chanList) : 0);
+    PackField(rec, cn->nbSubList ? cn->nbSubList : "", cn->nbSubList ? (int)strlen(cn->nbSubList) : 0);
+    PackField(rec, cn->nbMask ? cn->nbMask->szKeys : "", cn->nbMask ? (int)strlen(cn->nbMask->szKeys) : 0);
+    PackField(rec, cn->szResumeToken ? cn->szResumeToken : "",
+      cn->szResumeToken ? (int)strlen(cn->szResumeToken) : 0);
+    PackField(rec, cn->cmdBuf, cn->cmdBufUsed);
+    PackBuf(rec, cn->inBuf);
+    PackField(rec, (const char *)cn->frameHdr, cn->frameHdrUsed);
+    PackField(rec, cn->frameIn->getsz(), cn->frameIn->length());
+    PackField(rec, cn->pInput ? &cn->pInput[cn->iInputPos] : "", cn->iInputLen - cn->iInputPos);
+    PackField(rec, cn->nbLast->getsz(), cn->nbLast->length());
+    PackField(rec, cn->textOut->getsz(), cn->textOut->length());
+    PackBuf(rec, cn->batchOut);
+    // Unsent output in the order it would have gone out
+    out->clear();
+    CopyBuf(out, cn->outBuf);
+    for (int iLane=0; iLane < CClientNode::LANE_COUNT; iLane++) {
+      for (queue = cn->lanes[iLane]; queue != NULL; queue = queue->next) {
+        CopyBuf(out, queue->buf);
+      }
+    }
+    PackField(rec, out->getsz(), out->length());
+    PackField(rec, cn->sentUnit->sent->getsz(), cn->sentUnit->sent->length());
+    bOk = SendHandle(iSock, cn->bDetached ? 'D' : 'C', cn->iSocketHandle, rec);
+  }
+
+  rec->clear();
+  bOk = bOk && SendHandle(iSock, 'E', -1, rec);
+  delete rec;
+  delete out;
+  return bOk;
+}
+
+// ---------------------------------------------------------------------
+// New process: rebuild the server from SendUpgrade's records
+// ---------------------------------------------------------------------
+bool CEqbcs::ReceiveUpgrade(int iSock)
+{
+  CStrBuf *rec = new CStrBuf();
+  CClientNode *cn;
+  CClientNode *tail = NULL;
+  const char *p;
+  char chTag = 0;
+  char szKeys[1024];
+  char szName[256];
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  int iHandle;
+  int iPos;
+  int iLen;
+
+  iServerHandle = RecvHandle(iSock, &chTag, rec);
+  if (chTag != 'S' || iServerHandle < 0) {
+    delete rec;
+    return false;
+  }
+  if (getsockname(iServerHandle, (struct sockaddr *)&addr, &addrlen) == 0) {
+    iPort = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+  }
+  iPos = 0;
+  uiRosterVersion = UnpackNum(rec, &iPos);
+  uiNextIDNum = UnpackNum(rec, &iPos);
+  iWatchdogMsecs = (int)UnpackNum(rec, &iPos);
+  // Due now: the old process stopped sending while it waited for us
+  ulWatchdogLast = CClock::msecs() - iWatchdogMsecs;
+
+  while ((iHandle = RecvHandle(iSock, &chTag, rec)) != -2 && chTag != 'E') {
+    iPos = 0;
+    p = UnpackField(rec, &iPos, &iLen);
+    if (iLen > (int)sizeof(szName)-1) iLen = sizeof(szName)-1;
+    memcpy(szName, p, iLen);
+    szName[iLen] = 0;
+    if (chTag == 'Q' && iHandle == -1) {
+      // Closed with the old process: as far as the rest know, it left
+      NotifyClientQuit(szName);
+      WriteLocalString("-- ");
+      WriteLocalString(szName);
+      WriteLocalString(" has left the server (DEFLATE is not carried over).\n");
+      NoteRosterChange('-', szName);
+      if (checkpoint && (iLen = checkpoint->claim(szName)) != -1) checkpoint->release(iLen);
+      continue;
+    }
+    if ((chTag != 'C' || iHandle < 0) && (chTag != 'D' || iHandle != -1)) break;
+    cn = new CClientNode(szName, iHandle, NULL);
+    cn->bAuthorized = UnpackNum(rec, &iPos) != 0;
+    cn->uiIDNum = UnpackNum(rec, &iPos);
+    cn->uiCaps = UnpackNum(rec, &iPos);
+    cn->uiRosterVersion = UnpackNum(rec, &iPos);
+    cn->bLocalEcho = UnpackNum(rec, &iPos) != 0;
+    cn->bCmdMode = UnpackNum(rec, &iPos) != 0;
+    cn->lastChar = (char)UnpackNum(rec, &iPos);
+    cn->iBatchMsecs = (int)UnpackNum(rec, &iPos);
+    if (cn->iBatchMsecs) cn->batchOut = new CCharBuf();
+    p = UnpackField(rec, &iPos, &iLen);
+    if (iLen) {
+      cn->chanList = new char[iLen+1];
+      memcpy(cn->chanList, p, iLen);
+      cn->chanList[iLen] = 0;
+    }
+    p = UnpackField(rec, &iPos, &iLen);
+    if (iLen) {
+      cn->nbSubList = new char[iLen+1];
+      memcpy(cn->nbSubList, p, iLen);
+      cn->nbSubList[iLen] = 0;
+    }
+    p = UnpackField(rec, &iPos, &iLen);
+    if (iLen && iLen < (int)sizeof(szKeys)) {
+      memcpy(szKeys, p, iLen);
+      szKeys[iLen] = 0;
+      SetNetBotFields(cn, szKeys);
+    }
+    p = UnpackField(rec, &iPos, &iLen);
+    if (iLen) {
+      cn->szResumeToken = new char[CClientNode::RESUME_TOKEN_LEN+1];
+      if (iLen > CClientNode::RESUME_TOKEN_LEN) iLen = CClientNode::RESUME_TOKEN_LEN;
+      memcpy(cn->szResumeToken, p, iLen);
+      cn->szResumeToken[iLen] = 0;
+    }
+    p = UnpackField(rec, &iPos, &iLen);
+    if (iLen > CClientNode::CMD_BUFSIZE-1) iLen = CClientNode::CMD_BUFSIZE-1;
+    memcpy(cn->cmdBuf, p, iLen);
+    cn->cmdBufUsed = iLen;
+    p = UnpackField(rec, &iPos, &iLen);
+    cn->inBuf->write(p, iLen);
+    p = UnpackField(rec, &iPos, &iLen);
+    memcpy(cn->frameHdr, p, iLen > 3 ? 3 : iLen);
+    cn->frameHdrUsed = iLen > 3 ? 3 : iLen;
+    p = UnpackField(rec, &iPos, &iLen);
+    cn->frameIn->append(p, iLen);
+    p = UnpackField(rec, &iPos, &iLen);
+    if (iLen > 0 && iLen <= INPUT_BLOCK_BYTES) {
+      cn->pInput = inputPool->alloc();
+      memcpy(cn->pInput, p, iLen);
+      cn->iInputLen = iLen;
+    }
+    p = UnpackField(rec, &iPos, &iLen);
+    if (iLen) {
+      cn->nbLast->append(p, iLen);
+      cn->nbLastParsed->parse(cn->nbLast->getsz());
+      cn->uiNBSerial = ++uiNBSerial;
+    }
+    p = UnpackField(rec, &iPos, &iLen);
+    cn->textOut->append(p, iLen);
+    p = UnpackField(rec, &iPos, &iLen);
+    if (cn->batchOut) cn->batchOut->write(p, iLen);
+    p = UnpackField(rec, &iPos, &iLen);
+    cn->outBuf->write(p, iLen);
+    // Going through the part written again puts us where the old was
+    p = UnpackField(rec, &iPos, &iLen);
+    cn->sentUnit->bFrames = (cn->uiCaps & CClientNode::CAP_V2) != 0;
+    cn->sentUnit->bBatch = cn->batchOut != NULL;
+    cn->sentUnit->note(p, iLen);
+
+    cn->iFairWeight = getWeight(cn->szCharName);
+    for (int i=0; i < CClientNode::RATE_CLASSES; i++) {
+      cn->rateLimits[i].setRate(tune.iRates[i]);
+    }
+    if (cn->bAuthorized) {
+      SetNetBotPrefixes(cn);
+      if (chTag == 'D') {
+        // Held for a RESUME, from now on
+        cn->bDetached = true;
+        timers->add(cn->liveTimer, CClientNode::TIMER_GRACE, CClientNode::RESUME_GRACE_SECS*1000);
+      }
+      else {
+        ArmPing(cn);
+        ArmIdle(cn);
+      }
+      if (checkpoint && (cn->iCheckpointSlot = checkpoint->claim(cn->szCharName)) == -1) {
+        cn->iCheckpointSlot = checkpoint->alloc();
+        MarkCheckpoint(cn);
+      }
+    }
+    else if (tune.iLoginSecs > 0) {
+      timers->add(cn->liveTimer, CClientNode::TIMER_LOGIN, tune.iLoginSecs*1000);
+    }
+    // Keep the old order
+    if (tail) tail->next = cn;
+    else clientList = cn;
+    tail = cn;
+    if (cn->iSocketHandle != -1) StartHandler(cn);
+  }
+  delete rec;
+  bNBSubsDirty = true;
+  if (iHandle != -1 || chTag != 'E') return false;
+  // The service manager must know us before the old process exits
+  sprintf(szKeys, "MAINPID=%d\n", (int)getpid());
+  NotifyServiceManager(szKeys);
+  return write(iSock, "OK", 2) == 2;
+}
+
+// ---------------------------------------------------------------------
+// Hot upgrade setup (call before processMain): argv to exec again, and
+// -U's handle when this process is the one taking over
+// ---------------------------------------------------------------------
+void CEqbcs::setUpgrade(char **argv, int iUpgradeFd)
+{
+  upgradeArgv = argv;
+  this->iUpgradeFd = iUpgradeFd;
+}
+#endif
+
+// ---------------------------------------------------------------------
+void CEqbcs::setExitFlag()
+{
+  iExitNow = 1;
+  Wake();
+}
+
+// ---------------------------------------------------------------------
+// Reread the -f file, or hand over to a new binary, at the top of the
+// next loop.  Safe from a signal handler or another thread.
+// ---------------------------------------------------------------------
+void CEqbcs::setReloadFlag()
+{
+  iSigHupCaught = 1;
+  Wake();
+}
+
+void CEqbcs::setUpgradeFlag()
+{
+  iUpgradeCaught = 1;
+  Wake();
+}
+
+// ---------------------------------------------------------------------
+// Port setup (call before processMain)
+// ---------------------------------------------------------------------
+void CEqbcs::setPort(int newPort)
+{
+  this->iPort = newPort;
+}
+
+// ---------------------------------------------------------------------
+// Bind to address setup
+// ---------------------------------------------------------------------
+in_addr_t CEqbcs::setAddr(const char* newAddr)
+{
+  this->iAddr = inet_addr(newAddr);
+  return(this->iAddr);
+}
+
+// ---------------------------------------------------------------------
+// Logfile setup
+// ---------------------------------------------------------------------
+int CEqbcs::setLogfile(const char* szLogfile)
+{
+  if((this->LogFile=fopen(szLogfile,"a"))==NULL) {
+    fprintf(stderr, "ERROR: Could not open file %s for write.\n\n", szLogfile);
+    return(1);
+  }
+  return(0);
+}
+
+// ---------------------------------------------------------------------
+// Join/quit batch window in milliseconds (call before processMain)
+// ---------------------------------------------------------------------
+int CEqbcs::setNotifyBatch(const char* szMsecs)
+{
+  if (atoi(szMsecs) < 1) {
+    fprintf(stderr, "ERROR: Bad batch window %s.\n\n", szMsecs);
+    return(1);
+  }
+  tune.iNotifyMsecs = atoi(szMsecs);
+  return(0);
+}
+
+// ---------------------------------------------------------------------
+// Idle timeout in seconds (call before processMain)
+// ---------------------------------------------------------------------
+int CEqbcs::setIdleTimeout(const char* szSecs)
+{
+  if (atoi(szSecs) < 1) {
+    fprintf(stderr, "ERROR: Bad idle timeout %s.\n\n", szSecs);
+    return(1);
+  }
+  tune.iIdleSecs = atoi(szSecs);
+  return(0);
+}
+// ---------------------------------------------------------------------
+// Sender weight setup - name=weight, -w's here and -f's in their own
+// list so a reload can replace them
+// ---------------------------------------------------------------------
+int CEqbcs::setWeight(const char* szNameWeight)
+{
+  return AddWeight(&senderWeights, szNameWeight);
+}
+int CEqbcs::AddWeight(CSenderWeight **list, const char* szNameWeight)
+{
+  const char *pEquals = strchr(szNameWeight, '=');
+  CSenderWeight *weight;
+
+  if (pEquals == NULL || pEquals == szNameWeight || atoi(pEquals+1) < 1) {
+    fprintf(stderr, "ERROR: Weight must be name=weight, not %s.\n\n", szNameWeight);
+    return(1);
+  }
+  weight = new CSenderWeight;
+  weight->szName = new char[pEquals - szNameWeight + 1];
+  strncpy(weight->szName, szNameWeight, pEquals - szNameWeight);
+  weight->szName[pEquals - szNameWeight] = 0;
+  weight->iWeight = atoi(pEquals+1);
+  weight->next = *list;
+  *list = weight;
+  return(0);
+}
+void CEqbcs::FreeWeights(CSenderWeight *list)
+{
+  while (list) {
+    CSenderWeight *weight = list->next;
+    delete [] list->szName;
+    delete list;
+    list = weight;
   }
 }
 
-// ---------------------------------------------------------------------
-// Close all sockets - call before exit
-// ---------------------------------------------------------------------
-void CEqbcs::CloseAllSockets()
+int CEqbcs::getWeight(const char* szName)
 {
-  if (iServerHandle != -1) {
-    CSockio::iCloseSock(iServerHandle, 1, 1, EQBCS_TraceSockets);
-    iServerHandle = -1;
-  }
+  CSenderWeight *weight;
 
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-    if (cn->iSocketHandle != -1) {
-      CSockio::iCloseSock(cn->iSocketHandle, 1, 1, EQBCS_TraceSockets);
-      cn->iSocketHandle = -1;
-    }
+  for (weight = configWeights; weight != NULL; weight = weight->next) {
+    if (strcasecmp(weight->szName, szName) == 0) return weight->iWeight;
+  }
+  for (weight = senderWeights; weight != NULL; weight = weight->next) {
+    if (strcasecmp(weight->szName, szName) == 0) return weight->iWeight;
   }
+  return 1;
 }
 
 // ---------------------------------------------------------------------
-// Grab the data for the people we are ready to send from, and queue it up
+// Config file, read once processMain starts and again on SIGHUP
 // ---------------------------------------------------------------------
-void CEqbcs::HandleReadyToSend(void)
+void CEqbcs::setConfigFile(const char* szFile)
 {
-  // MsgTypes are handled by inserting \t<msgtype> into the output buffer
-  // before the string read from the socket.  These MsgTypes are only
-  // inserted when there is a message type other than MSG_TYPE_NORMAL.
-
-  int iMsgType=0;
-  int ch;
-
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-    if (cn->readyToSend && cn->iSocketHandle != -1 && cn->closeMe == 0) {
-      if (cn->inBuf->hasWaiting()) {
-        ch = cn->inBuf->readChar();
-        if (ch == '\t') // check for msgtype
-          {
-            iMsgType = cn->inBuf->readChar();
-            if (iMsgType!=CClientNode::MSG_TYPE_TELL && iMsgType!=CClientNode::MSG_TYPE_BCI &&
-              iMsgType!=CClientNode::MSG_TYPE_CHANNELS) ch=cn->inBuf->readChar();
-          }
-          else {
-            iMsgType = CClientNode::MSG_TYPE_NORMAL;
-          }
-          if (iMsgType == CClientNode::MSG_TYPE_MSGALL) {
-            cn->bTempWriteBlock = true;
-          }
-          if (iMsgType == CClientNode::MSG_TYPE_BCI) {
-            HandleBciMessage(cn);
-            cn->readyToSend = 0;
-            cn->bTempWriteBlock = false;
-            listenBufOn = true;
-            return;
-          }
-          if (iMsgType == CClientNode::MSG_TYPE_TELL) {
-            HandleTell(cn);
-            cn->readyToSend = 0;
-            cn->bTempWriteBlock = false;
-            listenBufOn = true;
-            return;
-          }
-          if (iMsgType == CClientNode::MSG_TYPE_CHANNELS) {
-            HandleUpdateChannels(cn);
-            cn->readyToSend = 0;
-            cn->bTempWriteBlock = false;
-            listenBufOn = true;
-            return;
-          }
-          // Turn off local display if it is NBMSG.
-          if (iMsgType == CClientNode::MSG_TYPE_NBMSG) {
-            listenBufOn = false;
-          }
-          SendMyNameToAll(cn, iMsgType);
-          if (iMsgType == CClientNode::MSG_TYPE_MSGALL) {
-            WriteOwnNames();
-          }
-          AppendCharToAll(ch);
-          while (cn->inBuf->hasWaiting()) {
-            AppendCharToAll(cn->inBuf->readChar());
-          }
-          AppendCharToAll('\n');
-      }
-      cn->readyToSend = 0;
-      cn->bTempWriteBlock = false;
-      listenBufOn = true;
-    }
-  }
+  szConfigFile = szFile;
 }
 
 // ---------------------------------------------------------------------
-// Kick off same name - when authorized comes, remove any other with
-// same name */
+// Read the -f file: "key value" lines, '#' to the end of a line is a
+// comment.  Values start from the command line's each time, so taking
+// a line out puts that setting back.  Nothing is changed unless the
+// whole file is good.
 // ---------------------------------------------------------------------
-void CEqbcs::KickOffSameName(CClientNode *cnCheck)
+int CEqbcs::ReadConfig()
 {
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next)  {
-    if (cn != cnCheck && strcmp(cn->szCharName, cnCheck->szCharName) == 0) {
-      cn->closeMe = true;
-      WriteLocalString("-- Kicking off connection the same as: ");
-      WriteLocalString(cn->szCharName);
-      WriteLocalString(".\n");
-      if (strlen(cn->szCharName) < CClientNode::MAX_CHARNAMELEN-5) {
-        strcat(cn->szCharName, "-old");
+  CTunables saved = tune;
+  CSenderWeight *weights = NULL;
+  CRealm *realmList = NULL;
+  CRealm *realm;
+  FILE *f;
+  char szLine[512];
+  char szOurs[512] = "";
+  char *pKey;
+  char *pValue;
+  char *p;
+  int *piCount;
+  int iLine = 0;
+  int iBad = 0;
+
+  if ((f = fopen(szConfigFile, "r")) == NULL) {
+    sprintf(szLine, "-- Cannot read config %.400s: %s.\n", szConfigFile, strerror(errno));
+    WriteLocalString(szLine);
+    return 1;
+  }
+  tune = tuneBase;
+  while (iBad == 0 && fgets(szLine, sizeof(szLine), f) != NULL) {
+    iLine++;
+    if ((p = strchr(szLine, '#')) != NULL) *p = 0;
+    for (p = szLine + strlen(szLine); p > szLine && strchr(" \t\r\n", p[-1]); p--);
+    *p = 0;
+    for (pKey = szLine; *pKey == ' ' || *pKey == '\t'; pKey++);
+    if (*pKey == 0) continue;
+    for (pValue = pKey; *pValue && *pValue != ' ' && *pValue != '\t'; pValue++);
+    if (*pValue) *pValue++ = 0;
+    while (*pValue == ' ' || *pValue == '\t') pValue++;
+
+    if ((piCount = TuneCount(pKey)) != NULL) {
+      if ((*piCount = atoi(pValue)) < 1) iBad = iLine;
+    }
+    else if (strcasecmp(pKey, "login") == 0) {
+      if (setLoginLimits(pValue)) iBad = iLine;
+    }
+    else if (strcasecmp(pKey, "rate") == 0) {
+      if (setRateLimits(pValue)) iBad = iLine;
+    }
+    else if (strcasecmp(pKey, "overload") == 0) {
+      if (setOverload(pValue)) iBad = iLine;
+    }
+    else if (strcasecmp(pKey, "weight") == 0) {
+      if (AddWeight(&weights, pValue)) iBad = iLine;
+    }
+    else if (strcasecmp(pKey, "realm") == 0) {
+      // realm <name> <options>: a realm's own line is applied last
+      for (p = pValue; *p && *p != ' ' && *p != '\t'; p++);
+      if (*p) *p++ = 0;
+      while (*p == ' ' || *p == '\t') p++;
+      for (realm = realmList; realm != NULL && strcmp(realm->szName, pValue) != 0 &&
+        realm->next != NULL; realm = realm->next);
+      if (*pValue == 0 || (realm != NULL && strcmp(realm->szName, pValue) == 0)) {
+        iBad = iLine;
+        continue;
       }
+      // Kept in the file's order
+      if (realm) realm = realm->next = new CRealm(pValue, NULL);
+      else realm = realmList = new CRealm(pValue, NULL);
+      if (RealmOptions(p, realm, false)) iBad = iLine;
+      if (szRealmName && strcmp(pValue, szRealmName) == 0) strcpy(szOurs, p);
+    }
+    else {
+      iBad = iLine;
+    }
+  }
+  fclose(f);
+  if (iBad == 0 && szOurs[0]) RealmOptions(szOurs, NULL, true);
+
+  if (iBad) {
+    tune = saved;
+    FreeWeights(weights);
+    while ((realm = realmList) != NULL) {
+      realmList = realm->next;
+      delete realm;
     }
+    sprintf(szLine, "-- Config %.400s not applied, line %d is bad.\n", szConfigFile, iBad);
+    WriteLocalString(szLine);
+    return 1;
+  }
+  FreeWeights(configWeights);
+  configWeights = weights;
+  // Realms are only set up when starting
+  if (realms == NULL && szRealmName == NULL && amRunning == 1) {
+    realms = realmList;
+    realmList = NULL;
   }
+  while ((realm = realmList) != NULL) {
+    realmList = realm->next;
+    delete realm;
+  }
+  ApplyConfig(&saved);
+  sprintf(szLine, "-- Config %.400s loaded.\n", szConfigFile);
+  WriteLocalString(szLine);
+  return 0;
 }
 
 // ---------------------------------------------------------------------
-// Authorize Clients
+// Bring connected clients up to date after ReadConfig.  PINGs, logins
+// and the select() wait pick new values up as they next come round;
+// idle checks are armed again, as -t may have been turned on or off.
 // ---------------------------------------------------------------------
-void CEqbcs::AuthorizeClients(void)
+void CEqbcs::ApplyConfig(CTunables *old)
 {
-  static const char *loginTest = LOGIN_START_TOKEN;
-  char *p;
-  int copied=0;
+  CClientNode *cn;
+  CClientNode *cnFrom;
+  CSenderQueue *q;
 
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-    if (cn->bAuthorized==0 && (unsigned)cn->cmdBufUsed>strlen(loginTest) &&
-      strrchr(&cn->cmdBuf[strlen(loginTest)+1], ';'))
-      {
-      for (p = &cn->cmdBuf[strlen(loginTest)];
-        *p != ';' && copied < CClientNode::MAX_CHARNAMELEN-1; p++)
-        {
-        cn->szCharName[copied] = *p;
-        copied++;
+  for (cn = clientList; cn != NULL; cn = cn->next) {
+    if (cn->bAuthorized == false) continue;
+    cn->iFairWeight = getWeight(cn->szCharName);
+    // setRate refills the bucket: only for a rate that changed, or a
+    // reload would pay off every client's debt
+    for (int i=0; i < CClientNode::RATE_CLASSES; i++) {
+      if (tune.iRates[i] != old->iRates[i]) cn->rateLimits[i].setRate(tune.iRates[i]);
+    }
+    if (cn->bDetached == false) ArmIdle(cn);
+  }
+  // Weights already queued under
+  for (cn = clientList; cn != NULL; cn = cn->next) {
+    for (int i=0; i < CClientNode::LANE_COUNT; i++) {
+      for (q = cn->lanes[i]; q != NULL; q = q->next) {
+        for (cnFrom = clientList; cnFrom != NULL && cnFrom->uiIDNum != q->uiSenderID;
+          cnFrom = cnFrom->next);
+        if (cnFrom) q->iWeight = cnFrom->iFairWeight;
       }
-      cn->szCharName[copied] = 0;
-      cn->bAuthorized = 1;
-      cn->cmdBufUsed=0;
-      NotifyClientJoin(cn->szCharName);
-      WriteLocalString("-- ");
-      WriteLocalString(cn->szCharName);
-      WriteLocalString(" has joined the server.\n");
-      bNetBotChanges = true;
-      KickOffSameName(cn);
     }
   }
+  if (iServerHandle != -1 && tune.iBacklog != old->iBacklog) {
+    listen(iServerHandle, tune.iBacklog);
+  }
 }
 
 // ---------------------------------------------------------------------
-// Handle flushing local output
+// The -f settings that are plain counts
 // ---------------------------------------------------------------------
-void CEqbcs::HandleLocal()
+int *CEqbcs::TuneCount(const char *szKey)
 {
-  if (listenBuf) {
-    while (listenBuf->hasWaiting()) {
-			fprintf(LogFile, "%c", listenBuf->readChar());
-    }
-		fflush(LogFile);
-	}
-	// Here, add remote handlers, callbacks, etc.
+  if (strcasecmp(szKey, "max_clients") == 0) return &tune.iMaxClients;
+  if (strcasecmp(szKey, "backlog") == 0) return &tune.iBacklog;
+  if (strcasecmp(szKey, "idle_wake") == 0) return &tune.iIdleWakeMsecs;
+  if (strcasecmp(szKey, "ping") == 0) return &tune.iPingSecs;
+  if (strcasecmp(szKey, "pong_timeout") == 0) return &tune.iPongTimeoutSecs;
+  if (strcasecmp(szKey, "notify_batch") == 0) return &tune.iNotifyMsecs;
+  if (strcasecmp(szKey, "idle_timeout") == 0) return &tune.iIdleSecs;
+  if (strcasecmp(szKey, "nb_conflate") == 0) return &tune.iNBConflateBytes;
+  if (strcasecmp(szKey, "lane_wire") == 0) return &tune.iLaneWireBytes;
+  if (strcasecmp(szKey, "readers") == 0) return &tune.iReaders;
+  if (strcasecmp(szKey, "writers") == 0) return &tune.iWriters;
+  if (strcasecmp(szKey, "stats") == 0) return &tune.iStatsSecs;
+  return NULL;
 }
 
 // ---------------------------------------------------------------------
-// Check Clients: login or write pending or  remove dead connections
+// A realm's options, key=value,...: port, addr, cpu, log and checkpoint
+// set it up (into realm when not NULL), and any count ReadConfig knows
+// overrides that for the realm (into tune when bTune).
 // ---------------------------------------------------------------------
-int CEqbcs::CheckClients(void)
+int CEqbcs::RealmOptions(const char *szOpts, CRealm *realm, bool bTune)
 {
-  char writeBuf[512];
-  int bufUsed;
-  int maxBuf = sizeof(writeBuf);
-  int iRetCode = 0;
-  int iBytesWrote = 0;
-
-  AuthorizeClients();
-  CloseDeadClients();
-  CleanDeadClients();
-  HandleReadyToSend();
-  HandleLocal();
-  NotifyNetBotChanges();
-
-#ifdef UNIXWIN
-  WSASetLastError(0);
-#endif
-
-  if (listenBuf) {
-    while (listenBuf->hasWaiting()) {
-      iRetCode = 1;
-      WriteLocalChar(listenBuf->readChar());
+  char szTemp[512];
+  char *token;
+  char *tokNext;
+  char *pValue;
+  int *piCount;
+  bool bPort = false;
+
+  strncpy(szTemp, szOpts, sizeof(szTemp)-1);
+  szTemp[sizeof(szTemp)-1] = 0;
+  for (token = strtok_r(szTemp, ",", &tokNext); token != NULL;
+    token = strtok_r(NULL, ",", &tokNext))
+    {
+    if ((pValue = strchr(token, '=')) == NULL || pValue[1] == 0) break;
+    *pValue++ = 0;
+    if ((piCount = TuneCount(token)) != NULL) {
+      if (atoi(pValue) < 1) break;
+      if (bTune) *piCount = atoi(pValue);
     }
-  }
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-    while (cn->outBuf->hasWaiting() && cn->lastWriteError == 0) {
-      iRetCode = 1; // Any written to will be 1;
-      for (bufUsed=0; bufUsed<maxBuf && cn->outBuf->hasWaiting(); bufUsed++) {
-        writeBuf[bufUsed] = cn->outBuf->readChar();
-      }
-      if (bufUsed > 0) {
-        CSockio::iWriteSock(cn->iSocketHandle, writeBuf, bufUsed, &iBytesWrote);
-      }
-#ifdef UNIXWIN
-      if (iBytesWrote < 1 && WSAGetLastError()) {
-        cn->closeMe = 1;
-        cn->lastWriteError = WSAGetLastError();
-      }
-      WSASetLastError(0);
-#else
-      if (iBytesWrote < 1) {
-        cn->closeMe = 1;
-        cn->lastWriteError = iBytesWrote;
-      }
-#endif
+    else if (strcasecmp(token, "port") == 0) {
+      if (atoi(pValue) < 1) break;
+      if (realm) realm->iPort = atoi(pValue);
+      bPort = true;
+    }
+    else if (strcasecmp(token, "cpu") == 0) {
+      if (atoi(pValue) < 0) break;
+      if (realm) realm->iCpu = atoi(pValue);
+    }
+    else if (strcasecmp(token, "addr") == 0) {
+      if (realm) realm->szAddr = strcpy(new char[strlen(pValue)+1], pValue);
+    }
+    else if (strcasecmp(token, "log") == 0) {
+      if (realm) realm->szLog = strcpy(new char[strlen(pValue)+1], pValue);
     }
+    else if (strcasecmp(token, "checkpoint") == 0) {
+      if (realm) realm->szCheckpoint = strcpy(new char[strlen(pValue)+1], pValue);
+    }
+    else break;
   }
-  return iRetCode;
+  return (token != NULL || bPort == false) ? 1 : 0;
 }
 
 // ---------------------------------------------------------------------
-// Setup which sockets to listen on
+// Checkpoint file, mapped once processMain starts
 // ---------------------------------------------------------------------
-void CEqbcs::SetupSelect(fd_set *fds)
+void CEqbcs::setCheckpoint(const char* szFile)
 {
-  FD_ZERO(fds);
+  szCheckpointFile = szFile;
+}
 
-  // setup which sockets to listen on
-  FD_SET((unsigned)iServerHandle, fds);
+// ---------------------------------------------------------------------
+// Login limits - timeout=secs,pending=n,bytes=n: how long a connection
+// has to log in, how many may be waiting to, and how much each may send
+// before it has.  0 turns any of them off.
+// ---------------------------------------------------------------------
+int CEqbcs::setLoginLimits(const char* szLimits)
+{
+  char szTemp[256];
+  char *token;
+  char *tokNext;
+  char *pValue;
 
-  for (CClientNode *cn=clientList; cn != NULL; cn = cn->next) {
-    if (cn->iSocketHandle != -1 && cn->closeMe != 1) {
-      FD_SET((unsigned)cn->iSocketHandle, fds);
-    }
+  strncpy(szTemp, szLimits, sizeof(szTemp)-1);
+  szTemp[sizeof(szTemp)-1] = 0;
+  for (token = strtok_r(szTemp, ",", &tokNext); token != NULL;
+    token = strtok_r(NULL, ",", &tokNext))
+    {
+    if ((pValue = strchr(token, '=')) == NULL || atoi(pValue+1) < 0) break;
+    *pValue++ = 0;
+    if (strcasecmp(token, "timeout") == 0) tune.iLoginSecs = atoi(pValue);
+    else if (strcasecmp(token, "pending") == 0) tune.iMaxPending = atoi(pValue);
+    else if (strcasecmp(token, "bytes") == 0) tune.iMaxPreAuthBytes = atoi(pValue);
+    else break;
+  }
+  if (token != NULL) {
+    fprintf(stderr, "ERROR: Bad login limit %s.\n\n", szLimits);
+    return(1);
   }
+  return(0);
 }
 
 // ---------------------------------------------------------------------
-// Print Welcome
+// Overload thresholds - lag=msecs,queue=bytes for OVERLOAD_CONFLATE,
+// later levels at twice the one before.  0 turns either off.
 // ---------------------------------------------------------------------
-void CEqbcs::PrintWelcome(void)
+int CEqbcs::setOverload(const char* szLimits)
 {
-  char szPort[10];
-  sprintf(szPort, "%d", iPort);
+  char szTemp[256];
+  char *token;
+  char *tokNext;
+  char *pValue;
 
-  WriteLocalString(Title);
-  WriteLocalString(" ");
-  WriteLocalString(Version);
-  WriteLocalString("\nWaiting for connections on port: ");
-  WriteLocalString(szPort);
-  WriteLocalString("...\n");
+  strncpy(szTemp, szLimits, sizeof(szTemp)-1);
+  szTemp[sizeof(szTemp)-1] = 0;
+  for (token = strtok_r(szTemp, ",", &tokNext); token != NULL;
+    token = strtok_r(NULL, ",", &tokNext))
+    {
+    if ((pValue = strchr(token, '=')) == NULL || atoi(pValue+1) < 0) break;
+    *pValue++ = 0;
+    if (strcasecmp(token, "lag") == 0) tune.iOverloadLagMsecs = atoi(pValue);
+    else if (strcasecmp(token, "queue") == 0) tune.iOverloadQueueBytes = atoi(pValue);
+    else break;
+  }
+  if (token != NULL) {
+    fprintf(stderr, "ERROR: Bad overload limit %s.\n\n", szLimits);
+    return(1);
+  }
+  return(0);
 }
 
 // ---------------------------------------------------------------------
-// Never ending looping
+// Inbound rate limits - key=value,...  Keys are bytes, msgs, chat, nbmsg
+// and tell (per second, 0 for none) and mode=delay|drop|disconnect.
 // ---------------------------------------------------------------------
-void CEqbcs::ProcessLoop(struct sockaddr_in *sockAddress)
+int CEqbcs::setRateLimits(const char* szLimits)
 {
-  int iPending;
-  //int iExtraHandles=5;
-  // Extra handles for select (STDIN, OUT, ERR..)
-  // Not supposed to matter, but it has before
-  fd_set fds;
-  fd_set empty_fds1;
-  fd_set empty_fds2;
-  // Not worrying about FD_SETSIZE - if too small, then fix/recompile
-  struct timeval timeOut;
-  int selectMax;
-
-  FD_ZERO(&empty_fds1);
-  FD_ZERO(&empty_fds2);
-
-  PrintWelcome();
-
-  while (iExitNow == 0) {
-    CheckClients();
-    SetupSelect(&fds);
-
-#ifdef UNIXWIN
-    selectMax = getMaxFD();
-#else
-    selectMax = getdtablesize();
-#endif
-
-    try {
-      timeOut.tv_sec = 5;
-      timeOut.tv_usec = 50;
-      iPending=select(selectMax, &fds, &empty_fds1, &empty_fds2, &timeOut);
-    }
-    catch(char * str) {
-      CTrace::dbg("Exception: %s", str);
-    }
-
-    if ((iPending<0) && (errno!=EINTR)) { // there was an error with select()
-#ifdef UNIXWIN
-      CSockio::vPrintSockErr();
-      WSASetLastError(0);
-#else
-      perror("select() error");
-#endif
-    }
-    if (iPending > 0 && iExitNow == 0) {
-      if (FD_ISSET(iServerHandle, &fds)) {
-        HandleNewClient(sockAddress);
-      }
-      ReadAllClients(&fds);
+  static const char *szKeys[] = { "bytes", "msgs", "chat", "nbmsg", "tell" };
+  char szTemp[256];
+  char *token;
+  char *tokNext;
+  char *pValue;
+  int i;
+
+  strncpy(szTemp, szLimits, sizeof(szTemp)-1);
+  szTemp[sizeof(szTemp)-1] = 0;
+  for (token = strtok_r(szTemp, ",", &tokNext); token != NULL;
+    token = strtok_r(NULL, ",", &tokNext))
+    {
+    if ((pValue = strchr(token, '=')) == NULL) break;
+    *pValue++ = 0;
+    if (strcasecmp(token, "mode") == 0) {
+      if (strcasecmp(pValue, "delay") == 0) tune.iRateMode = RATE_DELAY;
+      else if (strcasecmp(pValue, "drop") == 0) tune.iRateMode = RATE_DROP;
+      else if (strcasecmp(pValue, "disconnect") == 0) tune.iRateMode = RATE_DISCONNECT;
+      else break;
+      continue;
     }
-   PingAllClients( time( NULL ) );
+    for (i=0; i < CClientNode::RATE_CLASSES && strcasecmp(token, szKeys[i]) != 0; i++);
+    if (i == CClientNode::RATE_CLASSES || atoi(pValue) < 0) break;
+    tune.iRates[i] = atoi(pValue);
   }
-  CloseAllSockets();
-  CSockio::vShutdownSockets();
+  if (token != NULL) {
+    fprintf(stderr, "ERROR: Bad rate limit %s.\n\n", szLimits);
+    return(1);
+  }
+  return(0);
 }
 
 // ---------------------------------------------------------------------
-// Signal Support
+// Realms
 // ---------------------------------------------------------------------
-void CEqbcs::vCtrlCHandler(int iValue)
+CRealm::CRealm(const char *szName, CRealm *newNext)
 {
-  // CtrlCHandler
-  CTrace::iTracef("Got Ctrl-C (%d): Exiting", iValue);
-  if (EQBCS_iDebugMode) fflush(stdout);
-  if (runInstance) runInstance->setExitFlag();
+  this->szName = strcpy(new char[strlen(szName)+1], szName);
+  szAddr = NULL;
+  szLog = NULL;
+  szCheckpoint = NULL;
+  iPort = 0;
+  iCpu = -1;
+  server = NULL;
+  bDone = false;
+  next = newNext;
 }
 
-void CEqbcs::vBrokenHandler(int iValue)
+CRealm::~CRealm()
 {
-#ifndef UNIXWIN
-  signal(SIGPIPE, vBrokenHandler);
-#endif
+  delete [] szName;
+  if (szAddr) delete [] szAddr;
+  if (szLog) delete [] szLog;
+  if (szCheckpoint) delete [] szCheckpoint;
 }
 
 // ---------------------------------------------------------------------
-void CEqbcs::setExitFlag()
+// Have the loop look at its flags now rather than at its next wake up
+// ---------------------------------------------------------------------
+void CEqbcs::Wake()
 {
-  iExitNow = 1;
+#ifndef UNIXWIN
+  if (iWakeFds[1] != -1 && write(iWakeFds[1], "", 1) < 0) {
+    // Full already, it will wake
+  }
+#endif
 }
 
-// ---------------------------------------------------------------------
-// Port setup (call before processMain)
-// ---------------------------------------------------------------------
-void CEqbcs::setPort(int newPort)
+#ifndef UNIXWIN
+void *CEqbcs::RealmThread(void *pRealm)
 {
-  this->iPort = newPort;
+  CRealm *realm = (CRealm *)pRealm;
+
+#ifdef __linux__
+  if (realm->iCpu >= 0) {
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(realm->iCpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+      fprintf(stderr, "WARNING: Could not pin realm %s to CPU %d.\n",
+        realm->szName, realm->iCpu);
+    }
+  }
+#endif
+  realm->server->processMain();
+  realm->bDone = true;
+  return NULL;
 }
 
 // ---------------------------------------------------------------------
-// Bind to address setup
+// Run each realm's server on a thread of its own.  This thread takes
+// the signals for all of them, says READY=1 once every realm is going
+// round its loop, and only sends WATCHDOG=1 while they all still are.
 // ---------------------------------------------------------------------
-in_addr_t CEqbcs::setAddr(const char* newAddr)
+int CEqbcs::RunRealms()
 {
-  this->iAddr = inet_addr(newAddr);
-  return(this->iAddr);
+  sigset_t sigs;
+  struct timespec ts;
+  CRealm *realm;
+  CSenderWeight *weight;
+  char szLine[300];
+  bool bReady = false;
+  bool bAlive;
+  int iRunning;
+  int iSig;
+
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGHUP);
+  sigaddset(&sigs, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  for (realm = realms; realm != NULL; realm = realm->next) {
+    realm->server = new CEqbcs();
+    realm->server->szRealmName = realm->szName;
+    realm->server->szConfigFile = szConfigFile;
+    realm->server->tune = tuneBase;
+    realm->server->iPort = realm->iPort;
+    realm->server->iAddr = realm->szAddr ? inet_addr(realm->szAddr) : iAddr;
+    for (weight = senderWeights; weight != NULL; weight = weight->next) {
+      sprintf(szLine, "%.200s=%d", weight->szName, weight->iWeight);
+      realm->server->AddWeight(&realm->server->senderWeights, szLine);
+    }
+    if (realm->szCheckpoint) realm->server->setCheckpoint(realm->szCheckpoint);
+    if (realm->szLog == NULL || realm->server->setLogfile(realm->szLog) != 0) {
+      realm->server->LogFile = LogFile;
+      realm->server->bLogShared = true;
+    }
+    sprintf(szLine, "-- Realm %.200s on port %d%s.\n", realm->szName, realm->iPort,
+      realm->iCpu >= 0 ? ", pinned" : "");
+    WriteLocalString(szLine);
+    if (pthread_create(&realm->thread, NULL, RealmThread, realm) != 0) {
+      perror("Realm thread");
+      delete realm->server;
+      realm->server = NULL;
+      realm->bDone = true;
+    }
+  }
+  HandleLocal();
+
+  while (iExitNow == 0) {
+    ts.tv_sec = 0;
+    ts.tv_nsec = (bReady ? 100 : 10) * 1000000L;
+    iSig = sigtimedwait(&sigs, NULL, &ts);
+    if (iSig == SIGINT) {
+      CTrace::iTracef("Got Ctrl-C (%d): Exiting", iSig);
+      break;
+    }
+    for (realm = realms; realm != NULL; realm = realm->next) {
+      if (realm->server == NULL || realm->bDone) continue;
+      if (iSig == SIGHUP) {
+        realm->server->iSigHupCaught = 1;
+        realm->server->Wake();
+      }
+    }
+    if (iSig == SIGUSR2) {
+      WriteLocalString("-- Hot upgrade is not available with realms.\n");
+    }
+
+    iRunning = 0;
+    bAlive = true;
+    for (realm = realms; realm != NULL; realm = realm->next) {
+      if (realm->bDone) {
+        bAlive = false;
+        continue;
+      }
+      iRunning++;
+      if (realm->server->ulLoopMsecs == 0) bAlive = false;
+      else if ((long)(realm->server->ulLoopMsecs - ulWatchdogLast) < 0) bAlive = false;
+    }
+    if (iRunning == 0) {
+      WriteLocalString("-- No realm is running.\n");
+      break;
+    }
+    if (bReady == false) {
+      for (realm = realms; realm != NULL; realm = realm->next) {
+        if (realm->bDone == false && realm->server->ulLoopMsecs == 0) break;
+      }
+      if (realm == NULL) {
+        bReady = true;
+        ServiceReady();
+        for (realm = realms; realm != NULL; realm = realm->next) {
+          if (realm->bDone == false) realm->server->Wake();
+        }
+      }
+    }
+    else if (WatchdogMsecsLeft() == 0) {
+      // Each realm was woken last time round and should have looped since
+      if (bAlive) NotifyServiceManager("WATCHDOG=1");
+      else WriteLocalString("-- A realm has stopped, not answering the watchdog.\n");
+      ulWatchdogLast = CClock::msecs();
+      for (realm = realms; realm != NULL; realm = realm->next) {
+        if (realm->bDone == false) realm->server->Wake();
+      }
+    }
+    HandleLocal();
+  }
+
+  NotifyServiceManager("STOPPING=1");
+  for (realm = realms; realm != NULL; realm = realm->next) {
+    if (realm->server == NULL) continue;
+    realm->server->setExitFlag();
+    realm->server->Wake();
+  }
+  for (realm = realms; realm != NULL; realm = realm->next) {
+    if (realm->server == NULL) continue;
+    pthread_join(realm->thread, NULL);
+    delete realm->server;
+    realm->server = NULL;
+  }
+  shutdown();
+  return 0;
 }
+#endif
 
 // ---------------------------------------------------------------------
-// Logfile setup
+// Process Main - For UI Threading - publicly accessible.  -1 when the
+// server could not start; what to do then is up to the caller.
 // ---------------------------------------------------------------------
-int CEqbcs::setLogfile(const char* szLogfile)
+int CEqbcs::processMain()
 {
-  if((this->LogFile=fopen(szLogfile,"a"))==NULL) {
-    fprintf(stderr, "ERROR: Could not open file %s for write.\n\n", szLogfile);
-    return(1);
-  }
-  return(0);
+  if (start() != 0) return -1;
+#ifndef UNIXWIN
+  if (realms) return RunRealms();
+#endif
+  while (runOnce(-1) == 0);
+  shutdown();
+  return 0;
 }
+
 // ---------------------------------------------------------------------
-// Process Main - For UI Threading - publicly accessible
+// Get ready to serve: settings, checkpoint, then the listening socket
+// or a hot upgrade's connections.  0 when runOnce can be called, -1 on
+// failure.  Nothing here or in runOnce exits the process or touches
+// signal handlers; that is left to whoever runs us.
 // ---------------------------------------------------------------------
-int CEqbcs::processMain(int exitOnFail)
+int CEqbcs::start()
 {
-  struct sockaddr_in sockAddress;
-
-  runInstance = this;
-  signal(SIGINT, vCtrlCHandler);
+  if (amRunning) return 0;
 #ifndef UNIXWIN
-  signal(SIGPIPE, vBrokenHandler);
   srandom(time(NULL));
+  // So setExitFlag and friends can wake the loop from another thread
+  if (pipe(iWakeFds) == 0) {
+    fcntl(iWakeFds[0], F_SETFL, O_NONBLOCK);
+    fcntl(iWakeFds[1], F_SETFL, O_NONBLOCK);
+  }
 #endif
 
-  listenBuf = new CCharBuf();
+  if (listenBuf == NULL) listenBuf = new CCharBuf();
   clientList = NULL;
 
   amRunning = 1;
 
-  if ((iServerHandle = NET_initServer(iPort, &sockAddress)) == -1) {
-    if (exitOnFail) {
-      exit(EXIT_FAILURE);
+  tuneBase = tune;
+  if (szConfigFile && ReadConfig() != 0) return StartFailed();
+  // processMain runs them, each realm starting a server of its own
+  if (realms) return 0;
+
+  if (szCheckpointFile) {
+    char szLine[200];
+    int iKept;
+
+    checkpoint = new CCheckpoint();
+    if ((iKept = checkpoint->load(szCheckpointFile)) < 0) return StartFailed();
+    if (iKept > 0) {
+      sprintf(szLine, "-- Checkpoint holds %d clients from the last run.\n", iKept);
+      WriteLocalString(szLine);
     }
   }
-  else {
-    ProcessLoop(&sockAddress);
+
+#ifndef UNIXWIN
+  if (iUpgradeFd >= 0) {
+    // Taking over from the process that exec'd us
+    memset(&sockAddress, 0, sizeof(sockAddress));
+    if (ReceiveUpgrade(iUpgradeFd) == false) {
+      fprintf(stderr, "ERROR: Upgrade hand over failed.\n");
+      return StartFailed();
+    }
+    close(iUpgradeFd);
+    iUpgradeFd = -1;
+    WriteLocalString("-- Upgraded, carrying on.\n");
+  }
+  else
+#endif
+  if ((iServerHandle = NET_initServer(iPort, &sockAddress)) == -1) {
+    return StartFailed();
   }
 
-  if (LogFile!=stdout) fclose(LogFile);
-  amRunning = 0;
+  PrintWelcome();
+  StartStages();
+  ServiceReady();
+  HandleLocal();
+  ulWorkStart = CClock::msecs();
+  ulStatsStart = ulWorkStart;
   return 0;
 }
+
+int CEqbcs::StartFailed()
+{
+  HandleLocal();
+  if (checkpoint) {
+    delete checkpoint;
+    checkpoint = NULL;
+  }
+#ifndef UNIXWIN
+  if (iWakeFds[0] != -1) {
+    close(iWakeFds[0]);
+    close(iWakeFds[1]);
+    iWakeFds[0] = iWakeFds[1] = -1;
+  }
+#endif
+  amRunning = 0;
+  return -1;
+}
@@ -1,6 +1,8 @@
 // Windows Service functions
 #include "EQBCS.h"
 
+extern CEqbcs bcs;
+
 #ifdef UNIXWIN
 SERVICE_STATUS m_ServiceStatus;
 SERVICE_STATUS_HANDLE m_ServiceStatusHandle;
@@ -31,7 +33,7 @@ void WINAPI ServiceMain(DWORD argc, LPTSTR *argv)
   bRunning=true;
   while(bRunning)
   {
-    bcs.processMain(1);
+    if (bcs.processMain() != 0) exit(EXIT_FAILURE);
   }
   return;
 }
@@ -54,6 +56,7 @@ void WINAPI ServiceCtrlHandler(DWORD Opcode)
 
       SetServiceStatus (m_ServiceStatusHandle,&m_ServiceStatus);
       bRunning=false;
+      bcs.setExitFlag();
       break;
     case SERVICE_CONTROL_INTERROGATE:
       break; 
@@ -11,6 +11,30 @@
 
 CEqbcs bcs;
 
+// ---------------------------------------------------------------------
+// Signals, passed on to the server
+// ---------------------------------------------------------------------
+static void vCtrlCHandler(int iValue)
+{
+  CTrace::iTracef("Got Ctrl-C (%d): Exiting", iValue);
+  fflush(stdout);
+  bcs.setExitFlag();
+}
+
+#ifndef UNIXWIN
+static void vUpgradeHandler(int)
+{
+  signal(SIGUSR2, vUpgradeHandler);
+  bcs.setUpgradeFlag();
+}
+
+static void vHupHandler(int)
+{
+  signal(SIGHUP, vHupHandler);
+  bcs.setReloadFlag();
+}
+#endif
+
 int main(int argc, char* argv[])
 {
 #ifdef UNIXWIN
@@ -22,6 +46,7 @@ int main(int argc, char* argv[])
 #endif
 	int giveusage=0;
 	int dofork=0;
+	int upgradefd=-1;
 	int i;
 
 	fflush(stdout);
@@ -50,6 +75,71 @@ int main(int argc, char* argv[])
         i=argc+1;
       }
     }
+    else if (strncmp("-n", argv[i],2)==0) {
+      if (argv[i+1]==NULL || bcs.setNotifyBatch(argv[++i])==1) {
+        giveusage=1;
+        i=argc+1;
+      }
+    }
+    else if (strncmp("-t", argv[i],2)==0) {
+      if (argv[i+1]==NULL || bcs.setIdleTimeout(argv[++i])==1) {
+        giveusage=1;
+        i=argc+1;
+      }
+    }
+    else if (strncmp("-r", argv[i],2)==0) {
+      if (argv[i+1]==NULL || bcs.setRateLimits(argv[++i])==1) {
+        giveusage=1;
+        i=argc+1;
+      }
+    }
+    else if (strncmp("-o", argv[i],2)==0) {
+      if (argv[i+1]==NULL || bcs.setOverload(argv[++i])==1) {
+        giveusage=1;
+        i=argc+1;
+      }
+    }
+    else if (strncmp("-a", argv[i],2)==0) {
+      if (argv[i+1]==NULL || bcs.setLoginLimits(argv[++i])==1) {
+        giveusage=1;
+        i=argc+1;
+      }
+    }
+    else if (strncmp("-f", argv[i],2)==0) {
+      if (argv[i+1]==NULL) {
+        giveusage=1;
+        i=argc+1;
+      }
+      else {
+        bcs.setConfigFile(argv[++i]);
+      }
+    }
+#ifndef UNIXWIN
+    else if (strncmp("-k", argv[i],2)==0) {
+      if (argv[i+1]==NULL) {
+        giveusage=1;
+        i=argc+1;
+      }
+      else {
+        bcs.setCheckpoint(argv[++i]);
+      }
+    }
+    else if (strncmp("-U", argv[i],2)==0) {
+      if (argv[i+1]==NULL) {
+        giveusage=1;
+        i=argc+1;
+      }
+      else {
+        upgradefd=atoi(argv[++i]);
+      }
+    }
+#endif
+    else if (strncmp("-w", argv[i],2)==0) {
+      if (argv[i+1]==NULL || bcs.setWeight(argv[++i])==1) {
+        giveusage=1;
+        i=argc+1;
+      }
+    }
 #ifdef UNIXWIN
 		else if(strncmp(argv[i],"-c",2)==0) {
       loadservice=1;
@@ -95,6 +185,14 @@ int main(int argc, char* argv[])
 		fprintf(stderr, "  -p <port>\tPort to listen on.\n");
 		fprintf(stderr, "  -i <addr>\tAddress to bind to.\n");
 		fprintf(stderr, "  -l <file>\tOutput to logfile rather than STDOUT.\n");
+		fprintf(stderr, "  -n <ms>  \tCollect joins and quits this long (default 200).\n");
+		fprintf(stderr, "  -t <secs>\tDrop clients that only answer PINGs this long (default off).\n");
+		fprintf(stderr, "  -w <name>=<weight>\tOutput share for a sender (default 1).\n");
+		fprintf(stderr, "  -r <key>=<n>,...\tInbound limits per client and second: bytes, msgs,\n");
+		fprintf(stderr, "           \tchat, nbmsg, tell; mode=delay|drop|disconnect.\n");
+		fprintf(stderr, "  -o lag=<ms>,queue=<bytes>\tStart shedding load (default off).\n");
+		fprintf(stderr, "  -a timeout=<s>,pending=<n>,bytes=<n>\tLogin limits (default off).\n");
+		fprintf(stderr, "  -f <file>\tRead settings from file, again on SIGHUP (see README).\n");
 #ifdef UNIXWIN
 		fprintf(stderr, "  -c       \tCreate Windows Service.\n");
 		fprintf(stderr, "  -d       \tDelete Windows Service.\n");
@@ -102,6 +200,8 @@ int main(int argc, char* argv[])
 #ifndef UNIXWIN
 		fprintf(stderr, "  -d       \tRun as background daemon.\n");
 		fprintf(stderr, "  -u       \tUsername to execute as.\n");
+		fprintf(stderr, "  -k <file>\tCheckpoint clients' setup to file, restored on return.\n");
+		fprintf(stderr, "  SIGUSR2 re-executes the binary, handing over every connection.\n");
 #endif
 		fflush(stderr);
 		exit(1);
@@ -164,5 +264,12 @@ int main(int argc, char* argv[])
 	}
 #endif
 
-  return bcs.processMain(1);
+  signal(SIGINT, vCtrlCHandler);
+#ifndef UNIXWIN
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGUSR2, vUpgradeHandler);
+  signal(SIGHUP, vHupHandler);
+  bcs.setUpgrade(argv, upgradefd);
+#endif
+  return bcs.processMain() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
\ No newline at end of file
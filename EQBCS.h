@@ -34,6 +34,8 @@
 
 #define socklen_t int
 #define strcasecmp _stricmp
+#define strtok_r strtok_s
+#define strncasecmp _strnicmp
 #pragma comment(lib,"wsock32.lib")
 #include <windows.h>
 #include <winsvc.h>
@@ -56,6 +58,13 @@ typedef unsigned long in_addr_t;
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #endif
 
 #if defined (_SC_LOGIN_NAME_MAX) && !defined (LOGIN_NAME_MAX) && !defined (UNIXWIN)
@@ -69,6 +78,18 @@ typedef unsigned long in_addr_t;
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <coroutine>
+
+// DEFLATE needs zlib.  Unix builds link it; a Windows build that has it
+// can define EQBCS_ZLIB, otherwise the server refuses DEFLATE logins.
+#if !defined (UNIXWIN) && !defined (EQBCS_NO_ZLIB) && !defined (EQBCS_ZLIB)
+  #define EQBCS_ZLIB
+#endif
+#ifdef EQBCS_ZLIB
+#include <zlib.h>
+#else
+typedef struct z_stream_s z_stream;
+#endif
 
 // Windows service crap
 #ifdef UNIXWIN
@@ -91,6 +112,13 @@ public:
   static int dbg(const char *fmt,...);
 };
 
+class CClock
+{
+public:
+  static unsigned long msecs();
+  static unsigned long usecs();
+};
+
 class CCharBufNode
 {
 private:
@@ -106,6 +134,9 @@ public:
   void reset();
   int isFull();
   int allRead();
+  int unread();
+  const char *readPtr();
+  void advance(int n);
   char readch();
   void writech(char ch);
   CCharBufNode *getNext();
@@ -116,7 +147,9 @@ class CCharBuf
 {
 private:
   CCharBufNode *head;
+  CCharBufNode *tail;
   int nextReadPos;
+  int iWaiting;
 private: // Internal
   void IncreaseBuf();
   CCharBufNode *DequeueHead();
@@ -124,10 +157,488 @@ public:
   CCharBuf();
   ~CCharBuf();
   int hasWaiting();
+  int waiting();
   void writeChar(char ch);
   void writesz(const char *szStr);
+  void write(const char *pData, int iLen);
 //    char peekChar();
   char readChar();
+  int peek(char *pBuffer, int iMax);
+  void skip(int n);
+  int lineLength();
+};
+
+class CStrBuf
+{
+private:
+  char *buffer;
+  int used;
+  int allocated;
+private: // Internal
+  void Grow(int needed);
+public:
+  CStrBuf();
+  ~CStrBuf();
+  void clear();
+  int length();
+  const char *getsz();
+  void appendChar(char ch);
+  void appendsz(const char *szStr);
+  void append(const char *pData, int iLen);
+};
+
+class CNBPacket
+{
+  // A NetBots packet split at '|' into fields.  Points into the
+  // parsed string, which must not change while this is in use.
+public:
+  static const int MAX_FIELDS;
+public:
+  int iFields;
+  bool bOverflow;
+  const char **fieldStart;
+  int *fieldLen;
+  int *keyLen;  // chars before '=', -1 if the field has none
+public:
+  CNBPacket();
+  ~CNBPacket();
+  void parse(const char *szBody);
+};
+
+class CNBFieldMask
+{
+  // A distinct NBFIELDS key list, shared by every client that asked for
+  // it.  The filtered packet is cached for the sender's current packet.
+public:
+  char *szKeys;         // comma separated
+  int iRefs;
+  unsigned uiCachedSerial;
+  CStrBuf *filtered;
+  CNBPacket *filteredParsed;
+  CNBFieldMask *next;
+public:
+  CNBFieldMask(const char *szKeys, CNBFieldMask *newNext);
+  ~CNBFieldMask();
+  bool hasKey(const char *pKey, int iKeyLen);
+  void filter(CNBPacket *pPacket);
+};
+
+class CNBSentState
+{
+  // What one client was last sent from one sender, for NBDELTA
+public:
+  unsigned uiSenderID;
+  int iSinceKey;
+  CStrBuf *last;
+  CNBPacket *parsed;
+  CNBSentState *next;
+public:
+  CNBSentState(unsigned uiSenderID, CNBSentState *newNext);
+  ~CNBSentState();
+};
+
+class CNBPending
+{
+public:
+  unsigned uiSenderID;
+  CNBPending *next;
+};
+
+class CSenderQueue
+{
+  // One sender's messages in one output lane, served by deficit round
+  // robin against the other senders in that lane.
+public:
+  unsigned uiSenderID;
+  int iWeight;
+  int iDeficit;
+  CCharBuf *buf;
+  CSenderQueue *next;
+public:
+  CSenderQueue(unsigned uiSenderID, int iWeight, CSenderQueue *newNext);
+  ~CSenderQueue();
+};
+
+class CTokenBucket
+{
+  // Refills at iRate per second, holding at most one second's worth.
+  // Kept in thousandths of a token; a debt goes negative.  iRate 0 is
+  // no limit.
+public:
+  int iRate;
+  long lTokens;
+  unsigned long ulLast;
+public:
+  CTokenBucket();
+  void setRate(int iRate);
+  void refill(unsigned long ulNow);
+  bool canTake(int n);
+  void take(int n);
+  int msecsUntilClear();
+};
+
+class CBlockPool
+{
+  // Same-sized blocks kept on a free list once given back, so busy
+  // connections reuse them instead of going to the heap.  A free
+  // block's first bytes point at the next one.
+public:
+  int iBlockBytes;
+  unsigned uiMade;
+  unsigned uiInUse;
+  unsigned uiPeakInUse;
+private:
+  char *pFree;
+public:
+  CBlockPool(int iBlockBytes);
+  ~CBlockPool();
+  char *alloc();
+  void release(char *pBlock);
+};
+
+class CSentUnit
+{
+  // The message a connection is partway through writing, kept until it
+  // is all written so a RESUME can send it whole on the new connection.
+  // A message is a v1 line, a v2 frame, or with BATCH a whole batch.
+public:
+  bool bFrames;          // V2
+  bool bBatch;
+  CStrBuf *sent;         // written so far, from the start of the message
+  unsigned char hdr[3];  // V2: the current frame's header
+  int iHdrUsed;
+  int iLeft;             // bytes of the frame, or v1 batch, still to go
+public:
+  CSentUnit();
+  ~CSentUnit();
+  void note(const char *pData, int iLen);
+  void clear();
+};
+
+class CClientNode;
+class CTimerWheel;
+class CEqbcs;
+class CSendRing;
+class CRecvRing;
+
+#ifndef UNIXWIN
+class CWriter;
+class CReader;
+
+class CSendRing
+{
+  // Output on its way to one connection: the loop puts bytes in, a
+  // writer thread sends them on its own dup() of the socket, so the
+  // loop may close its handle whenever it likes.  One producer, one
+  // consumer: the loop alone moves uiHead and the writer alone uiTail,
+  // each after a barrier, so neither takes a lock.
+public:
+  static const int BYTES;  // a power of 2
+  char *pData;
+  volatile unsigned uiHead;
+  volatile unsigned uiTail;
+  int iSocket;
+  volatile int iError;     // errno of a failed send, from the writer
+  volatile int iWaiting;   // the loop has more once there is room
+  volatile int iClosing;   // the loop is done with it
+  volatile int iReleased;  // and the writer has let go of it
+  volatile int iQueued;    // on the loop's list of rings to look at
+  bool bWantWrite;         // writer only: the socket is full
+  CSentUnit *sentUnit;     // while it is in the ring, not DEFLATE
+  CClientNode *owner;      // loop only: gets the unsent bytes back
+  bool bMoved;             // loop only: owner resumed on a new connection
+  CWriter *writer;
+  CSendRing *next;         // writer only: its rings
+  CSendRing *nextAdded;    // on its way to the writer
+  CSendRing *nextQueued;   // on its way to the loop
+  CSendRing *nextRetired;  // loop only: waiting to be let go
+public:
+  CSendRing(int iSocket);
+  ~CSendRing();
+  int used();
+  int put(const char *pData, int iLen);
+  void copyOut(CCharBuf *out);
+};
+
+class CRecvRing
+{
+  // Input from one connection on its way to the loop: a reader thread
+  // recv()s into it on its own dup() of the socket and moves uiHead
+  // past whole lines or frames only, so the loop is handed complete
+  // messages.  A message longer than the ring goes over in pieces.
+  // One producer, one consumer, as CSendRing.
+public:
+  static const int BYTES;  // a power of 2
+  char *pData;
+  volatile unsigned uiHead; // whole messages, for the loop
+  volatile unsigned uiTail;
+  unsigned uiRecvd;        // reader only: read so far
+  int iSocket;
+  bool bFrames;            // V2: split at frames, not lines
+  unsigned char hdr[3];    // reader only: the frame coming in
+  int iHdrUsed;
+  int iFrameLeft;
+  volatile int iError;     // the connection ended, after what is in
+  volatile int iFull;      // the reader waits for the loop to take some
+  volatile int iClosing;
+  volatile int iReleased;
+  volatile int iQueued;
+  CClientNode *owner;      // loop only
+  CReader *reader;
+  CRecvRing *next;
+  CRecvRing *nextAdded;
+  CRecvRing *nextQueued;
+  CRecvRing *nextRetired;
+public:
+  CRecvRing(int iSocket);
+  ~CRecvRing();
+  int used();
+  int take(char *pOut, int iMax);
+  void copyOut(char *pOut);
+};
+
+class CWriter
+{
+  // A writer thread, sending what the loop puts in the rings it was
+  // given.  New rings come in on a lock-free list; it sleeps in poll()
+  // when nothing can be sent, until the loop or a socket wakes it.
+public:
+  pthread_t thread;
+  bool bStarted;
+  int iWakeFds[2];
+  int iLoopWakeFd;         // the loop's, for room in a ring or an error
+  CSendRing * volatile *loopQueue; // where rings for the loop go
+  CSendRing *rings;
+  CSendRing * volatile added;
+  volatile int iSleeping;
+  volatile int iStop;
+  int iRings;              // loop only: how many it has
+  bool bNudge;             // loop only: given bytes this pass
+  unsigned long ulBytes;    // writer only, read for stats
+  unsigned long ulSends;
+  unsigned long ulStalls;
+  unsigned long ulStatsBytes; // loop only: the above at the last stats
+  unsigned long ulStatsSends;
+  unsigned long ulStatsStalls;
+  CWriter *next;
+public:
+  CWriter(int iLoopWakeFd, CSendRing * volatile *loopQueue, CWriter *newNext);
+  ~CWriter();
+  bool start();
+  void stop();
+  void add(CSendRing *ring);
+  void nudge();
+  static void *Run(void *pWriter);
+private:
+  void loop();
+  bool hasWork();
+  void sendSome(CSendRing *ring);
+  void tellLoop(CSendRing *ring);
+};
+
+class CReader
+{
+  // A reader thread: recv() on the connections it was given, and each
+  // whole line or frame on to the loop through the connection's ring.
+  // A full ring is not read from until the loop takes some, so a client
+  // over its rate limit is held back by its own socket.
+public:
+  pthread_t thread;
+  bool bStarted;
+  int iWakeFds[2];
+  int iLoopWakeFd;         // the loop's, for input or a closed connection
+  CRecvRing * volatile *loopQueue;
+  CRecvRing *rings;
+  CRecvRing * volatile added;
+  volatile int iSleeping;
+  volatile int iStop;
+  int iRings;              // loop only
+  unsigned long ulBytes;    // reader only, read for stats
+  unsigned long ulMsgs;
+  unsigned long ulStatsBytes; // loop only
+  unsigned long ulStatsMsgs;
+  CReader *next;
+public:
+  CReader(int iLoopWakeFd, CRecvRing * volatile *loopQueue, CReader *newNext);
+  ~CReader();
+  bool start();
+  void stop();
+  void add(CRecvRing *ring);
+  void nudge();
+  static void *Run(void *pReader);
+private:
+  void loop();
+  bool hasWork();
+  void recvSome(CRecvRing *ring);
+  unsigned split(CRecvRing *ring, unsigned uiFrom, unsigned uiTo);
+  void tellLoop(CRecvRing *ring);
+};
+#endif
+
+class CConnTask
+{
+  // What CEqbcs::ConnHandler returns: the handle of a connection's
+  // coroutine, which starts suspended until the reactor runs it.  Its
+  // frame comes from the reactor's pool.
+public:
+  class promise_type
+  {
+  public:
+    void *operator new(size_t n, CEqbcs &server, CClientNode *cn);
+    void operator delete(void *p, size_t n);
+    CConnTask get_return_object();
+    std::suspend_always initial_suspend() noexcept;
+    std::suspend_always final_suspend() noexcept;
+    void return_void();
+    void unhandled_exception();
+  };
+  std::coroutine_handle<promise_type> handle;
+};
+
+class CReactor
+{
+  // Runs the connection handlers.  A handler suspended in a co_await
+  // says which events it waits for, and until when; post() hands out
+  // events as they happen and run() resumes only the handlers that got
+  // one they wait for.  Ready and timed handlers are linked through
+  // their CClientNode.
+public:
+  static const int EV_READ;      // select: the socket is readable
+  static const int EV_WRITE;     // select: the socket is writable
+  static const int EV_OUT;       // output was queued for it
+  static const int EV_WAKE;      // its deadline passed
+  static const int FRAME_BLOCK_BYTES;
+  static const int FRAME_HEADER_BYTES;
+  CBlockPool *framePool;
+  unsigned uiResumes;
+private:
+  CClientNode *readyHead;
+  CClientNode *readyTail;
+  CClientNode *timedHead;
+  void unlinkTimed(CClientNode *cn);
+public:
+  CReactor();
+  ~CReactor();
+  void wait(CClientNode *cn, int iWant, int iMsecs);
+  void post(CClientNode *cn, int iEvents);
+  void cancel(CClientNode *cn);
+  void expire(unsigned long ulNow);
+  int msecsLeft(unsigned long ulNow);
+  void run();
+};
+
+class CIoAwait
+{
+  // What a connection handler co_awaits: CEqbcs::Recv, Send or Wait.
+  // Recv reads into the client's input block once its socket is
+  // readable, Send writes its output, trying the socket first; both give
+  // back the bytes moved, 0 when resumed for something else, or -1 when
+  // the connection failed.  Wait only waits.
+public:
+  static const int OP_WAIT;
+  static const int OP_RECV;
+  static const int OP_SEND;
+  CEqbcs *server;
+  CClientNode *cn;
+  int iOp;
+  int iWant;             // CReactor::EV_* that resume it
+  int iMsecs;            // its deadline, -1 for none
+  int iResult;
+  bool bDone;            // Send managed without waiting
+public:
+  CIoAwait(CEqbcs *server, CClientNode *cn, int iOp, int iWant, int iMsecs);
+  bool await_ready();
+  void await_suspend(std::coroutine_handle<> h);
+  int await_resume();
+};
+
+class CTimer
+{
+  // A client's next deadline, linked into a CTimerWheel slot while
+  // armed.  iKind says what it is for, see CClientNode::TIMER_*.
+public:
+  int iKind;
+  CClientNode *cn;
+  unsigned long ulTick;
+  int iSlot;
+  CTimerWheel *wheel;    // NULL when not armed
+  CTimer *next;
+  CTimer *prev;
+public:
+  CTimer(CClientNode *cn);
+  ~CTimer();
+  void cancel();
+};
+
+class CTimerWheel
+{
+  // Hierarchical timing wheel.  A level 0 slot is TICK_MSECS, each level
+  // up is SLOTS times the one below; timers cascade down a level as its
+  // slot comes round.  Time is only ever taken as differences.
+public:
+  static const int TICK_MSECS;
+  static const int SLOT_BITS;
+  static const int SLOTS;
+  static const int LEVELS;
+private:
+  CTimer **slots;        // LEVELS*SLOTS list heads
+  unsigned long ulCurTick;
+  unsigned long ulTickMsecs; // CClock::msecs() when ulCurTick began
+  int iCount;
+  void place(CTimer *t);
+  void unlink(CTimer *t);
+  void cascade(int iLevel);
+public:
+  CTimerWheel();
+  ~CTimerWheel();
+  void add(CTimer *t, int iKind, int iMsecs);
+  void remove(CTimer *t);
+  CTimer *expired(unsigned long ulNow);
+  int msecsLeft(unsigned long ulNow);
+};
+
+class CCheckpoint
+{
+  // What a client set up (channels, NBSUB, NBFIELDS) kept in a file
+  // mapped shared, one slot per client, so it outlives a crash.  The
+  // file starts at SLOTS slots and doubles when they are all taken.
+  // A slot is marked unused while it is rewritten and carries a
+  // checksum.  Slots found at load are orphans until their name logs in.
+public:
+  static const char * const MAGIC;
+  static const int HEADER_BYTES;
+  static const int SLOTS;
+  static const int SLOT_BYTES;
+  static const int FIELD_COUNT;
+private:
+  int iFd;
+  char *map;
+  int iSlots;
+  bool *orphan;
+  char *slotBody(int iSlot);
+  bool grow();
+public:
+  unsigned uiWrites;
+  unsigned uiAllocFailures;
+  unsigned long ulTotalUsecs;
+  unsigned long ulMaxUsecs;
+public:
+  CCheckpoint();
+  ~CCheckpoint();
+  int load(const char *szFile);
+  int claim(const char *szName);
+  int alloc();
+  bool store(int iSlot, const char **fields);
+  void release(int iSlot);
+  const char *field(int iSlot, int iField);
+};
+
+class CSenderWeight
+{
+public:
+  char *szName;
+  int iWeight;
+  CSenderWeight *next;
 };
 
 class CClientNode
@@ -136,37 +647,149 @@ public: // Constants
   static const int MAX_CHARNAMELEN;
   static const int CMD_BUFSIZE;
   static const int PING_SECONDS;
+  static const int RESUME_GRACE_SECS;
+  static const int RESUME_TOKEN_LEN;
+  static const int PONG_TIMEOUT_SECS;
+  static const int TIMER_PING;
+  static const int TIMER_PONG;
+  static const int TIMER_GRACE;
+  static const int TIMER_LOGIN;
+  static const int TIMER_IDLE;
+  static const int NB_CONFLATE_BYTES;
+  static const int NB_KEYFRAME_EVERY;
+  static const int BATCH_MSECS;
+  static const int BATCH_MSECS_MAX;
+  static const int LANE_CONTROL;
+  static const int LANE_DIRECT;
+  static const int LANE_CHAT;
+  static const int LANE_BULK;
+  static const int LANE_COUNT;
+  static const int LANE_WEIGHTS[];
+  static const int LANE_WIRE_BYTES;
+  static const int DRR_QUANTUM;
+  static const int RATE_BYTES;
+  static const int RATE_MSGS;
+  static const int RATE_CHAT;
+  static const int RATE_NBMSG;
+  static const int RATE_TELL;
+  static const int RATE_CLASSES;
   static const unsigned char MSG_TYPE_NORMAL;
   static const unsigned char MSG_TYPE_NBMSG;
   static const unsigned char MSG_TYPE_MSGALL;
   static const unsigned char MSG_TYPE_TELL;
   static const unsigned char MSG_TYPE_CHANNELS;
   static const unsigned char MSG_TYPE_BCI;
-  static unsigned int suiNextIDNum;
+  static const unsigned int CAP_ROSTER;
+  static const unsigned int CAP_NBBATCH;
+  static const unsigned int CAP_NBID;
+  static const unsigned int CAP_NBDELTA;
+  static const unsigned int CAP_V2;
+  static const unsigned int CAP_DEFLATE;
+  static const unsigned char FRAME_CONTROL;
+  static const unsigned char FRAME_BROADCAST;
+  static const unsigned char FRAME_NBPKT;
+  static const unsigned char FRAME_TELL;
+  static const unsigned char FRAME_CHANNEL;
+  static const unsigned char FRAME_BCI;
+  static const unsigned char FRAME_NBDELTA;
+  static const unsigned char FRAME_BATCH;
+  static const int FRAME_MAXLEN;
 public: // Vars
   int iSocketHandle;
   bool bAuthorized;
   int lastWriteError;
   int lastReadError;
   bool closeMe;
-  int readyToSend;
   char lastChar;
   char *szCharName;
+  char *szNBPrefix;
+  char *szNBIDPrefix;
+  char *szNBDeltaPrefix;
+  char *szNBDeltaIDPrefix;
   char *cmdBuf;
   char *chanList;
   bool bLocalEcho;
   int cmdBufUsed;
   bool bCmdMode;
   unsigned uiIDNum;
-  bool bTempWriteBlock;
-  CCharBuf *outBuf;
+  unsigned uiCaps;
+  unsigned uiRosterVersion;
+  CSenderQueue **lanes;  // queued messages by priority and sender
+  CSenderQueue **laneCursor;
+  int iFairWeight;       // this client's share as a sender
+  CTokenBucket *rateLimits; // inbound, indexed by RATE_*
+  unsigned uiRateDrops;
+  unsigned long ulRateLogged;
+  CCharBuf *outBuf;      // drained in order, next for the socket
   CCharBuf *inBuf;
+  CStrBuf *textOut;      // v2: text waiting for its '\n' to become a frame
+  z_stream *zDeflate;    // DEFLATE: outBuf is compressed into wireOut
+  z_stream *zInflate;
+  CCharBuf *wireOut;
+  CCharBuf *zIn;         // DEFLATE: inflated input not read yet
+  int iBatchMsecs;       // BATCH window, 0 when off
+  bool bBatchOpen;
+  unsigned long ulBatchStart;
+  CCharBuf *batchOut;    // BATCH: released batches, ahead of compression
+  unsigned char frameHdr[3];
+  int frameHdrUsed;
+  CStrBuf *frameIn;
+  CStrBuf *nbLast;
+  CNBPacket *nbLastParsed;
+  unsigned uiNBSerial;   // identifies nbLast for CNBFieldMask caches
+  CNBFieldMask *nbMask;  // NBFIELDS, NULL for every field
+  CNBPending *nbPending;
+  CNBSentState *nbSent;
+  char *nbSubList;       // NBSUB names/channels, NULL for everyone
+  CClientNode **nbSubscribers;
+  int nbSubscriberCount;
+  int nbSubscriberSize;
+  char *szResumeToken;   // RESUME: this session's token, NULL when off
+  bool bDetached;        // connection lost, session held for a RESUME
+  CSentUnit *sentUnit;   // not fed with DEFLATE, the wire is compressed
   CClientNode *next;
-  time_t lastPingSecs;
-  int lastPingReponseTimeSecs;
+  CTimer *liveTimer;     // next PING, PONG deadline or end of grace
+  unsigned long ulLastHeard; // any input counts as an answer to PING
+  CTimer *idleTimer;     // -t check, armed only when that is given
+  unsigned long ulLastActive; // last message that wasn't a PONG
+  unsigned long ulPingSent;
+  int iPreAuthBytes;     // read before LOGIN=...; was complete
+  char *pInput;          // read, not stepped through yet; a pool block
+  int iInputPos;
+  int iInputLen;
+  CReactor *reactor;
+  std::coroutine_handle<> handler; // its ConnHandler, while connected
+  int iWant;             // CReactor::EV_* its handler is suspended for
+  int iEvents;           // posted and not taken by the handler yet
+  bool bReady;           // on the reactor's ready list
+  CClientNode *nextReady;
+  unsigned long ulWakeAt; // with a deadline: on the reactor's timed list
+  CClientNode *nextTimed;
+  CClientNode *prevTimed;
+  CSendRing *sendRing;   // writers: where output goes instead of the socket
+  CRecvRing *recvRing;   // readers: where input comes from instead
+  int iCheckpointSlot;   // -k slot holding this client, -1 for none
+  bool bCheckpointDirty;
 public:
   CClientNode(const char *szCharName, int iSocketHandle, CClientNode *newNext);
   ~CClientNode();
+  void writeChar(char ch, int iLane = LANE_CONTROL, CClientNode *cnFrom = NULL);
+  void writesz(const char *szStr, int iLane = LANE_CONTROL, CClientNode *cnFrom = NULL);
+  void writeFrame(unsigned char ucType, const char *szFrom, const char *szChannel,
+    const char *pData, int iLen, int iLane = LANE_CONTROL, CClientNode *cnFrom = NULL);
+  CCharBuf *laneBuf(int iLane, CClientNode *cnFrom);
+  int lanesWaiting(bool bHoldChat=false);
+  int messageLength(CCharBuf *src);
+  bool MoveFairMessage(int iLane);
+  void DrainLanes(bool bHoldChat=false, int iWireBytes=LANE_WIRE_BYTES);
+  bool StartDeflate();
+  void CompressOut();
+  int pendingOut(bool bHoldChat=false);
+  bool hasWireOut(bool bHoldChat=false);
+  int batchMsecsLeft();
+  void ReleaseBatch();
+  void PutBack(CCharBuf *front, bool bPlain=false);
+  void TakeConnection(CClientNode *cn);
 };
 
 class CSockio
@@ -180,10 +803,13 @@ public:
   static const int BADPARM;
   static const int NOSOCK;
   static const int NOCONN;
+  static const int WOULDBLOCK;
 
 public:
   static void vPrintSockErr(void);
   static void vShutdownSockets(void);
+  static int iWouldBlock(void);
+  static int iSetNonBlocking(int iSocketHandle);
   static int iStartupSockets(int iVerbose);
   static int iReadSock(int iSocketHandle, void *pBuffer, int iSize, int *piBytesRead);
   static int iWriteSock(int iSocketHandle, void *pBuffer, int iSize, int *piBytesWritten);
@@ -191,11 +817,75 @@ public:
   static int iOpenSock(int *piSockHandle, char *pszSocketAddr, int iSocketPort, int iTrace);
 };
 
+class CTunables
+{
+  // What the -f file can set, and a SIGHUP reload change, while
+  // running.  Copied whole, so a reload applies entirely or not at all.
+public:
+  int iMaxClients;
+  int iBacklog;
+  int iIdleWakeMsecs;    // longest select() wait when no timer is armed
+  int iPingSecs;
+  int iPongTimeoutSecs;
+  int iLoginSecs;        // -a limits on connections not logged in yet
+  int iMaxPending;
+  int iMaxPreAuthBytes;
+  int iRates[5];         // -r limits by CClientNode::RATE_*
+  int iRateMode;
+  int iOverloadLagMsecs; // -o thresholds for OVERLOAD_CONFLATE, 0 is off
+  int iOverloadQueueBytes;
+  int iNotifyMsecs;      // -n, NOTIFY_BATCH_MSECS unless set
+  int iIdleSecs;         // -t, drop clients sending only PONGs, 0 for never
+  int iNBConflateBytes;  // CClientNode::NB_CONFLATE_BYTES unless set
+  int iLaneWireBytes;    // CClientNode::LANE_WIRE_BYTES unless set
+  int iReaders;          // recv on this many threads, 0 for the loop's
+  int iWriters;          // send on this many threads, 0 for the loop's
+  int iStatsSecs;        // log the stages this often, 0 for never
+};
+
+class CRealm
+{
+  // A "realm" line of the -f file: a server of its own, with its own
+  // listener and names, run on its own thread
+public:
+  char *szName;
+  char *szAddr;
+  char *szLog;
+  char *szCheckpoint;
+  int iPort;
+  int iCpu;              // -1 for any
+  CEqbcs *server;
+#ifndef UNIXWIN
+  pthread_t thread;
+#endif
+  volatile bool bDone;   // its server has returned
+  CRealm *next;
+public:
+  CRealm(const char *szName, CRealm *newNext);
+  ~CRealm();
+};
+
 class CEqbcs
 {
+  friend class CIoAwait;
 private:
   static const int MAX_CLIENTS;
+  static const int LISTEN_BACKLOG;
   static const int DEFAULT_PORT;
+  static const int NOTIFY_BATCH_MSECS;
+  static const int IDLE_WAKE_MSECS;
+  static const int RATE_DELAY;
+  static const int RATE_DROP;
+  static const int RATE_DISCONNECT;
+  static const int OVERLOAD_NONE;
+  static const int OVERLOAD_CONFLATE;
+  static const int OVERLOAD_DROP_NB;
+  static const int OVERLOAD_HOLD_CHAT;
+  static const int OVERLOAD_STEP_MSECS;
+  static const int UPGRADE_WAIT_MSECS;
+  static const int CHECKPOINT_MSECS;
+  static const int CHECKPOINT_WARN_USECS;
+  static const int INPUT_BLOCK_BYTES;
 
   bool listenBufOn;
   CCharBuf *listenBuf;
@@ -204,59 +894,232 @@ private:
   int iServerHandle;
   int iExitNow;
   int iSigHupCaught;
+  int iUpgradeCaught;
+  int iUpgradeFd;        // -U: state of the process being replaced
+  char **upgradeArgv;
   int iPort;
   in_addr_t iAddr;
   FILE *LogFile;
   bool bNetBotChanges;
+  unsigned uiRosterVersion;
+  bool bRosterCacheValid;
+  CStrBuf *rosterNames;
+  CStrBuf *rosterDelta;
+  CStrBuf *notifyLines;
+  bool bNotifyPending;
+  unsigned long ulNotifyStart;
+  CStrBuf *idLines;
+  CStrBuf *lineIn;
+  CStrBuf *nbDelta;
+  bool bNBSubsDirty;
+  unsigned uiNBSerial;
+  CNBFieldMask *fieldMasks;
+  CSenderWeight *senderWeights;
+  CSenderWeight *configWeights; // from -f, looked at before -w's
+  const char *szConfigFile;
+  CTunables tune;
+  CTunables tuneBase;    // from the command line, what -f starts from
+  CTimerWheel *timers;
+  CReactor *reactor;
+  CBlockPool *inputPool;
+  unsigned uiLoginsRejected;
+  int iOverloadLevel;
+  unsigned long ulOverloadSince; // when iOverloadLevel last changed
+  int iLoopLagMsecs;     // smoothed time spent per loop outside select
+  unsigned uiOverloadChanges;
+  unsigned uiNBDropped;  // NetBots packets superseded before sending
+  const char *szCheckpointFile;
+  CCheckpoint *checkpoint; // -k, NULL when off
+  bool bCheckpointDirty;
+  unsigned long ulCheckpointLast;
+  unsigned long ulStartMsecs;
+  int iWatchdogMsecs;    // how often to send WATCHDOG=1, 0 for never
+  unsigned long ulWatchdogLast;
+  unsigned uiNextIDNum;
+  unsigned uiAccepted;
+  int iPeakClients;
+  const char *szRealmName; // NULL unless this is one realm's server
+  CRealm *realms;        // the realms this process runs, if any
+  bool bLogShared;       // LogFile belongs to the process, not to us
+  bool bLogLineStart;
+  int iWakeFds[2];       // realms: a byte here means look at the flags
+  volatile unsigned long ulLoopMsecs; // when the loop last came round
+  unsigned long ulWorkStart; // when the last select() returned
+  struct sockaddr_in sockAddress;
+#ifndef UNIXWIN
+  CReader *readers;
+  CWriter *writers;
+  CRecvRing * volatile recvQueue; // rings with input, from the readers
+  CSendRing * volatile sendQueue; // rings with room, from the writers
+  CRecvRing *retiredRecv;  // waiting for their thread to let go
+  CSendRing *retiredSend;
+#endif
+  unsigned long ulStatsStart; // stage counters since then
+  unsigned long ulBytesIn;
+  unsigned long ulMsgsIn;
+  unsigned long ulPasses;
+  unsigned long ulBusyMsecs;
+  unsigned long ulBytesOut;
 
 private:
   int NET_initServer(int iPort, struct sockaddr_in *sockAddress);
+  int PassedListenSocket();
+  void NotifyServiceManager(const char *szState);
+  void ServiceReady();
+  int WatchdogMsecsLeft();
+  int ReadConfig();
+  int *TuneCount(const char *szKey);
+  int RealmOptions(const char *szOpts, CRealm *realm, bool bTune);
+  void Wake();
+  unsigned NextIDNum();
+  void ApplyConfig(CTunables *old);
+  int AddWeight(CSenderWeight **list, const char* szNameWeight);
+  void FreeWeights(CSenderWeight *list);
   int countClients(void);
+  int countPending(void);
+  void RejectLogin(CClientNode *cn, const char *szWhy);
   int getMaxFD();
   void SendToLocal(char ch);
   void WriteLocalChar(char ch);
   void WriteLocalString(const char *szStr);
-  void AppendCharToAll(char ch);
-  void SendToAll(const char *szStr);
-  void SendMyNameToAll(CClientNode *cn, int iMsgType);
-  void SendMyNameToOne(CClientNode *cn, CClientNode *cn_to, int iMsgType);
-  void WriteOwnNames(void);
+  void RelayBroadcast(CClientNode *cn, int iMsgType, const char *szText);
+  void DeliverTell(CClientNode *cn, CClientNode *cn_to, const char *szChannel,
+    int iMsgType, const char *szMsg);
+  void RouteTell(CClientNode *cn, const char *szName, const char *szMsg,
+    int iMsgType, bool bChannelOnly);
   void HandleNewClient(struct sockaddr_in *sockAddress);
-  void HandleUpdateChannels(CClientNode *cn);
-  void HandleTell(CClientNode *cn);
+  void SetChannels(CClientNode *cn, const char *szList);
+  void HandleTell(CClientNode *cn, int iMsgType);
   void CmdDisconnect(CClientNode *cn);
   void CmdSendNames(CClientNode *cn_to);
+  void BuildRosterCache();
   void SendNetBotSendList(CClientNode *cnSend);
-  void NotifyNetBotChanges();
+  void SendNetBotRoster(CClientNode *cnSend);
+  void StartNotifyWindow();
+  int NotifyMsecsLeft();
+  int OverloadLevelFor(int iLag, int iQueue);
+  void UpdateOverload(int iWorkMsecs);
+  int OverloadMsecsLeft();
+  void NoteRosterChange(char chOp, const char *szName);
+  void NotifyNetBotChanges(bool bNow=false);
+  void SetNetBotPrefixes(CClientNode *cn);
+  void SendNetBotIDs(CClientNode *cnSend);
+  void FlushNetBotIDs();
+  void RelayNetBotPacket(CClientNode *cn, const char *pBody, int iLen);
+  bool BuildNetBotDelta(CNBPacket *pOld, CNBPacket *pNew, CStrBuf *out);
+  void WriteNetBotPacket(CClientNode *cn_to, CClientNode *cnFrom, bool bKeyframe);
+  void ForgetNetBotSender(unsigned uiSenderID);
+  bool WantsNetBotsFrom(CClientNode *cn_to, CClientNode *cnFrom);
+  void RebuildNetBotSubscribers();
+  void CmdNetBotSubscribe(CClientNode *cn);
+  void SetNetBotFields(CClientNode *cn, const char *szKeys);
+  void CmdNetBotFields(CClientNode *cn);
+  void QueueConflated(CClientNode *cn_to, CClientNode *cnFrom);
+  void DrainConflated(CClientNode *cn_to);
+  void CmdSnapshot(CClientNode *cn_to);
   void DoCommand(CClientNode *cn);
-  void ReadAllClients(fd_set *fds);
-  void PingAllClients(time_t curTime);
+  int ReadClient(CClientNode *cn, char *pBuffer, int iSize, int *piBytesRead);
+  bool InflateInput(CClientNode *cn, const char *pRaw, int iRaw);
+  bool ReadBlocked(CClientNode *cn);
+  int RateMsecsLeft(CClientNode *cn);
+  void ChargeBytes(CClientNode *cn, int iBytes);
+  bool AdmitMessage(CClientNode *cn, int iClass);
+  void StartHandler(CClientNode *cn);
+  void StopHandler(CClientNode *cn);
+  CConnTask ConnHandler(CClientNode *cn);
+  CIoAwait Recv(CClientNode *cn);
+  CIoAwait Send(CClientNode *cn);
+  CIoAwait Wait(CClientNode *cn);
+  int WakeMsecs(CClientNode *cn);
+  int RecvInput(CClientNode *cn);
+  int SendOutput(CClientNode *cn);
+  CCharBuf *WireFor(CClientNode *cn);
+  void PostEvents(fd_set *fds, fd_set *wfds);
+  void StepInput(CClientNode *cn);
+  bool StepLine(CClientNode *cn, char ch);
+  bool StepFrame(CClientNode *cn);
+  void LoginDone(CClientNode *cn);
+  void ReleaseInput(CClientNode *cn);
+  int SendWire(CClientNode *cn, const char *pData, int iLen, int *piBytesWrote);
+  int TakeInput(CClientNode *cn);
+  bool InputWaiting(CClientNode *cn);
+  void StartStages();
+  void StopStages();
+  void GiveToReader(CClientNode *cn);
+  void ReleaseRings(CClientNode *cn, bool bKeepOutput = false);
+  void TakeRingBack(CClientNode *cn);
+  void TakeInputBack(CClientNode *cn);
+  void PostRingEvents();
+  void FreeRetiredRings();
+  int StatsMsecsLeft();
+  void LogStats();
+  void DispatchFrame(CClientNode *cn, unsigned char ucType, const char *pData, int iLen);
+  void ArmPing(CClientNode *cn, int iSpentMsecs = 0);
+  void ArmIdle(CClientNode *cn);
+  void RunTimers();
+  static bool FrameTextOk(const char *pData, int iLen);
   void CleanDeadClients(void);
   void CloseDeadClients(void);
   void CloseAllSockets();
-  void HandleReadyToSend();
+  void HandleLine(CClientNode *cn);
   void KickOffSameName(CClientNode *cnCheck);
-  void AuthorizeClients();
+  void ParseLoginOptions(CClientNode *cn, const char *szOpts);
+  void NewResumeToken(CClientNode *cn);
+  bool ResumeSession(CClientNode *cn);
+  bool DetachClient(CClientNode *cn);
+  void RestoreCheckpoint(CClientNode *cn);
+  void MarkCheckpoint(CClientNode *cn);
+  int CheckpointMsecsLeft();
+  void SaveCheckpoint(bool bNow = false);
+  void AuthorizeClient(CClientNode *cn);
   void HandleLocal();
   int CheckClients();
-  void SetupSelect(fd_set *fds);
+  void SetupSelect(fd_set *fds, fd_set *wfds);
   void PrintWelcome();
-  void ProcessLoop(struct sockaddr_in *sockAddress);
+  int StartFailed();
   void NotifyClientJoin(char *szName);
   void NotifyClientQuit(char *szName);
-  void HandleBciMessage(CClientNode *cn);
+#ifndef UNIXWIN
+  void HotUpgrade();
+  int RunRealms();
+  static void *RealmThread(void *pRealm);
+  bool SendUpgrade(int iSock);
+  bool UpgradeTaken(int iSock);
+  bool ReceiveUpgrade(int iSock);
+  bool SendHandle(int iSock, char chTag, int iHandle, CStrBuf *rec);
+  int RecvHandle(int iSock, char *pchTag, CStrBuf *rec);
+  void PackField(CStrBuf *rec, const char *pData, int iLen);
+  void PackNum(CStrBuf *rec, unsigned uiNum);
+  void PackBuf(CStrBuf *rec, CCharBuf *buf);
+  void CopyBuf(CStrBuf *out, CCharBuf *buf);
+  const char *UnpackField(CStrBuf *rec, int *piPos, int *piLen);
+  unsigned UnpackNum(CStrBuf *rec, int *piPos);
+#endif
 public:
   CEqbcs();
   ~CEqbcs();
-  int processMain(int exitOnFail);
+  int processMain();
+  int start();
+  int runOnce(int iMaxWaitMsecs);
+  void shutdown();
   void setExitFlag();
+  void setReloadFlag();
+  void setUpgradeFlag();
   void setPort(int newPort);
   in_addr_t setAddr(const char* newAddr);
   int setLogfile(const char* szLogfile);
-  static void vCtrlCHandler(int iValue);
-  static void vBrokenHandler(int iValue);
+  int setNotifyBatch(const char* szMsecs);
+  int setIdleTimeout(const char* szSecs);
+  int setWeight(const char* szNameWeight);
+  int getWeight(const char* szName);
+  int setRateLimits(const char* szLimits);
+  int setOverload(const char* szLimits);
+  int setLoginLimits(const char* szLimits);
+  void setCheckpoint(const char* szFile);
+  void setConfigFile(const char* szFile);
+#ifndef UNIXWIN
+  void setUpgrade(char **argv, int iUpgradeFd);
+#endif
 };
 
-extern CEqbcs bcs;
-
 #endif // __EQBCS2_H__
\ No newline at end of file
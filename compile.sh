@@ -1 +1,3 @@
-g++ EQBCS.cpp BCCore.cpp -o eqbcs
+g++ -std=c++20 -c BCCore.cpp -o BCCore.o
+ar rcs libeqbcs.a BCCore.o
+g++ -std=c++20 EQBCS.cpp -o eqbcs -L. -leqbcs -lz -pthread
@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+# ---------------------------------------------------------------------
+# DEFLATE benchmark: one sender, N receivers, M NetBots packets.
+# Prints the wire bytes each receiver read and the server's CPU time,
+# once with plain logins and once with LOGIN=name:DEFLATE;.
+#
+#   tools/bench_deflate.py [path/to/eqbcs] [port]
+# ---------------------------------------------------------------------
+import os, random, socket, subprocess, sys, threading, time
+
+EQBCS = sys.argv[1] if len(sys.argv) > 1 else './eqbcs'
+PORT = int(sys.argv[2]) if len(sys.argv) > 2 else 22112
+RECEIVERS = 10
+PACKETS = 3000
+
+def cpu(pid):
+    f = open('/proc/%d/stat' % pid).read().split()
+    return (int(f[13]) + int(f[14])) / float(os.sysconf('SC_CLK_TCK'))
+
+def connect(login):
+    s = socket.create_connection(('127.0.0.1', PORT))
+    s.settimeout(0.05)
+    s.sendall(login.encode())
+    return s
+
+def run(deflate):
+    srv = subprocess.Popen([EQBCS, '-p', str(PORT)],
+                           stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.3)
+    opt = ':DEFLATE' if deflate else ''
+    rx = [connect('LOGIN=r%d%s;' % (i, opt)) for i in range(RECEIVERS)]
+    tx = connect('LOGIN=sender;')
+    time.sleep(0.5)
+    for s in rx:
+        try:
+            s.recv(65536)
+        except socket.timeout:
+            pass
+
+    total = [0] * RECEIVERS
+    done = [False]
+    def drain():
+        while not done[0]:
+            for i, s in enumerate(rx):
+                try:
+                    total[i] += len(s.recv(65536))
+                except socket.timeout:
+                    pass
+    th = threading.Thread(target=drain)
+    th.start()
+
+    c0 = cpu(srv.pid)
+    random.seed(1)
+    for k in range(PACKETS):
+        tx.sendall(('\tNBMSG\n[NB]|Z=12|H=%d|M=%d|E=100|T=%d|P=%d|W=1|L=%d|B=0100110|[NB]\n'
+                    % (random.randint(80, 100), random.randint(40, 60),
+                       random.randint(0, 9), random.randint(0, 99), k % 60)).encode())
+        if k % 50 == 0:
+            time.sleep(0.01)
+    time.sleep(1.5)
+    done[0] = True
+    th.join()
+    c1 = cpu(srv.pid)
+    srv.terminate()
+    srv.wait()
+    print('%-7s wire bytes/receiver %d, server cpu %.2fs'
+          % ('deflate' if deflate else 'plain', sum(total) // RECEIVERS, c1 - c0))
+
+run(False)
+run(True)